@@ -0,0 +1,166 @@
+/* for MAP_ANONYMOUS, MAP_HUGETLB and madvise() in strict C builds */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "huge.h"
+
+/* struct to hold an array mapped by huge_alloc() */
+typedef struct
+{
+  char*  ptr;                   /* start of the mapping, on a huge page boundary if it spans one */
+  size_t bytes;                 /* length of the mapping */
+  size_t offset;                /* bytes from the start of the mapping to the array */
+  int    hugetlb;               /* whether it is on reserved huge pages */
+} t_huge;
+
+/*
+** The arrays of huge_alloc(), in a table that grows as they are added.
+** It is kept apart from the arrays so that the first touch of each of
+** their pages is still the caller's.
+*/
+static t_huge* huge_arrays = NULL;
+static int     nhuge = 0;       /* arrays in the table */
+static int     maxhuge = 0;     /* arrays the table has room for */
+static int     nmapped = 0;     /* arrays mapped so far, freed ones included */
+
+void* huge_alloc(size_t bytes, int hugetlb)
+{
+  if (nhuge == maxhuge)
+  {
+    const int grown = maxhuge ? 2 * maxhuge : 64;
+    t_huge* table = (t_huge*)realloc(huge_arrays, grown * sizeof(t_huge));
+
+    if (table == NULL) return NULL;
+
+    huge_arrays = table;
+    maxhuge = grown;
+  }
+
+  t_huge* array = &huge_arrays[nhuge];
+
+  /*
+  ** Each array starts a few cache lines into its mapping, a different
+  ** number for each, or the same cell of every array would fall in the
+  ** same cache sets. An array smaller than a huge page is left on small
+  ** pages.
+  */
+  array->offset = (nmapped % 32) * 128;
+  array->bytes = bytes + array->offset;
+  if (array->bytes >= HUGEPAGE) array->bytes = (array->bytes + HUGEPAGE - 1) / HUGEPAGE * HUGEPAGE;
+  array->ptr = (char*)MAP_FAILED;
+  array->hugetlb = 0;
+
+#ifdef MAP_HUGETLB
+  /* reserved huge pages come aligned, but fail once they run out */
+  if (hugetlb && array->bytes >= HUGEPAGE)
+  {
+    array->ptr = (char*)mmap(NULL, array->bytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    array->hugetlb = array->ptr != MAP_FAILED;
+  }
+#else
+  (void)hugetlb;
+#endif
+
+  if (array->ptr == MAP_FAILED && array->bytes < HUGEPAGE)
+  {
+    array->ptr = (char*)mmap(NULL, array->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  else if (array->ptr == MAP_FAILED)
+  {
+    /* map a huge page more and trim the ends to huge page boundaries */
+    char* base = (char*)mmap(NULL, array->bytes + HUGEPAGE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base == MAP_FAILED) return NULL;
+
+    const size_t head = (HUGEPAGE - (size_t)base % HUGEPAGE) % HUGEPAGE;
+
+    if (head > 0) munmap(base, head);
+    munmap(base + head + array->bytes, HUGEPAGE - head);
+    array->ptr = base + head;
+
+#ifdef MADV_HUGEPAGE
+    /* only advice: the kernel may have no transparent huge pages, or none free */
+    madvise(array->ptr, array->bytes, MADV_HUGEPAGE);
+#endif
+  }
+
+  if (array->ptr == MAP_FAILED) return NULL;
+
+  nhuge++;
+  nmapped++;
+
+  return array->ptr + array->offset;
+}
+
+void huge_free(void* ptr)
+{
+  for (int a = 0; a < nhuge; a++)
+  {
+    if (huge_arrays[a].ptr + huge_arrays[a].offset == ptr)
+    {
+      munmap(huge_arrays[a].ptr, huge_arrays[a].bytes);
+      huge_arrays[a] = huge_arrays[--nhuge];
+      break;
+    }
+  }
+
+  if (nhuge == 0)
+  {
+    free(huge_arrays);
+    huge_arrays = NULL;
+    maxhuge = 0;
+  }
+}
+
+void huge_pages(long huge[3])
+{
+  char          line[256];      /* line of /proc/self/smaps */
+  unsigned long start, end;     /* addresses of a mapping */
+  unsigned long kb;             /* anonymous huge pages of a mapping, in kB */
+  int           ours = 0;       /* whether the mapping holds an array of huge_alloc() */
+
+  huge[0] = huge[1] = huge[2] = 0;
+
+  for (int a = 0; a < nhuge; a++)
+  {
+    huge[1] += huge_arrays[a].bytes / HUGEPAGE;
+    if (huge_arrays[a].hugetlb) huge[2] += huge_arrays[a].bytes / HUGEPAGE;
+  }
+
+  huge[0] = huge[2];
+
+  /*
+  ** Transparent huge pages are only there once touched, and may have been
+  ** split since, so they are counted from the mappings the kernel lists.
+  ** Neighbouring arrays may have been merged into one mapping.
+  */
+  FILE* fp = fopen("/proc/self/smaps", "r");
+
+  if (fp == NULL) return;
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+    {
+      ours = 0;
+
+      for (int a = 0; a < nhuge; a++)
+      {
+        if (!huge_arrays[a].hugetlb && (unsigned long)huge_arrays[a].ptr < end
+            && (unsigned long)huge_arrays[a].ptr + huge_arrays[a].bytes > start)
+          ours = 1;
+      }
+    }
+    else if (ours && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+    {
+      huge[0] += kb * 1024 / HUGEPAGE;
+    }
+  }
+
+  fclose(fp);
+}
@@ -0,0 +1,32 @@
+/*
+** Host arrays on 2 MB aligned huge pages, shared by the Lattice
+** Boltzmann programs and TeaLeaf. The same source builds as C or C++.
+*/
+
+#ifndef HUGE_H
+#define HUGE_H
+
+#include <stddef.h>
+
+#define HUGEPAGE        ((size_t)2 << 20) /* size and alignment of a huge page */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** A zeroed array on huge pages where the kernel gives them, on small
+** pages otherwise, or NULL; free it with huge_free() only. hugetlb asks
+** for the pages reserved in /proc/sys/vm/nr_hugepages first.
+*/
+void* huge_alloc(size_t bytes, int hugetlb);
+void huge_free(void* ptr);
+
+/* huge pages the arrays are on, how many they span, and how many are reserved ones */
+void huge_pages(long huge[3]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
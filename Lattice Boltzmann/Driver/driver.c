@@ -0,0 +1,1265 @@
+/*
+** Code to implement a d2q9-bgk lattice boltzmann scheme.
+** 'd2' inidates a 2-dimensional grid, and
+** 'q9' indicates 9 velocities per grid cell.
+** 'bgk' refers to the Bhatnagar-Gross-Krook collision step.
+**
+** The 'speeds' in each cell are numbered as follows:
+**
+** 6 2 5
+**  \|/
+** 3-0-1
+**  /|\
+** 7 4 8
+**
+** A 2D grid:
+**
+**           cols
+**       --- --- ---
+**      | D | E | F |
+** rows  --- --- ---
+**      | A | B | C |
+**       --- --- ---
+**
+** 'unwrapped' in row major order to give a 1D array:
+**
+**  --- --- --- --- --- ---
+** | A | B | C | D | E | F |
+**  --- --- --- --- --- ---
+**
+** Grid indicies are:
+**
+**          ny
+**          ^       cols(ii)
+**          |  ----- ----- -----
+**          | | ... | ... | etc |
+**          |  ----- ----- -----
+** rows(jj) | | 1,0 | 1,1 | 1,2 |
+**          |  ----- ----- -----
+**          | | 0,0 | 0,1 | 0,2 |
+**          |  ----- ----- -----
+**          ----------------------> nx
+**
+** Note the names of the input parameter and obstacle files
+** are passed on the command line, e.g.:
+**
+**   ./d2q9-bgk input.params obstacles.dat
+**
+** This is the host side shared by the OpenMP, OpenCL and SYCL versions.
+** The timesteps are taken by one of the backends built in, picked with
+** --backend=NAME (the first one listed by usage() by default), in
+** batches of --batch=N timesteps (the backend's own choice by default).
+** Options the driver does not know are handed to the backend: the SYCL
+** one picks its engine with them, and may take a geometry to build on
+** the device in place of the obstacle file (see ../SYCL/d2q9-bgk.cpp).
+**
+** Besides the times, the run summary gives the million lattice updates
+** per second (MLUPS) and the memory bandwidth they imply, from the bytes
+** the backend moves per cell update. --measure-peak also runs a STREAM
+** triad on the backend's device and gives that bandwidth as a share of
+** it. --json adds the summary as a single line of JSON.
+**
+** --sample-steps=N times every Nth timestep on its own, from an idle
+** backend to its completion, into a histogram of quarter-octave buckets
+** whose p50, p90, p99 and max are given at exit. --trace=FILE also
+** writes the sampled timesteps as a Chrome trace (chrome://tracing or
+** ui.perfetto.dev). Sampling drains the backend's queue around each
+** sampled timestep, so keep N large against the batch.
+**
+** --watchdog=N has the backend flag a non-finite or negative density as
+** part of the reduction it already does each timestep, and looks at the
+** flag every N timesteps without waiting for the timesteps in flight, so
+** a run that has gone unstable stops early with the first timestep and
+** tile of the lattice it was seen in. The flag is looked at once more,
+** waiting, at the end of the run.
+**
+** The third value of each line of the obstacle file, 1 for any blocked
+** cell, labels the obstacle the cell belongs to, from 1 to MAXLABELS.
+** --forces gives the force the fluid puts on each label, from the
+** momentum exchanged with the cells bounced back in the timesteps
+** themselves, as a line of x, y pairs per timestep in forces.dat. With
+** the flow along x they are the drag and lift of each obstacle.
+**
+** --layout=rows|tiled|morton picks the order the backend keeps the
+** cells of its lattice in: row-major as here, or in tiles of cells laid
+** out in rows or along a Z-order (Morton) curve, which keep the rows
+** around each cell of a wide lattice in cache on CPUs. Every backend
+** keeps all three, the SYCL one with its default population kernel
+** only. The lattice is reordered on the way to and from the backend
+** only.
+**
+** --deterministic has the backend sum the velocity of each cell in
+** fixed point, so the sums come to the same bits whatever order they are
+** taken in: av_vels.dat is then the same for every thread count, batch,
+** layout and work-group shape of a backend.
+**
+** The parameter file may name the collision operator on a line after
+** omega: bgk, the default; trt, two relaxation times, optionally followed
+** by the magic parameter (1/omega - 1/2)(1/omega_odd - 1/2), 1/4 unless
+** given; or mrt, optionally followed by the relaxation rates of the
+** energy, its square and the energy flux, 1.1, 1.0 and 1.2 unless given.
+** omega sets the viscosity whichever it is. The backends build a kernel
+** for each operator, so no timestep asks which one it is.
+**
+** A line between omega and the collision operator may give nz, the no.
+** of cells in z, for the 3D lattices of a backend that has them; the
+** obstacles then extend through all nz slices, and final_state.dat
+** gains a column for kk and one for u_z.
+**
+** The lattices of the driver and of the OpenMP backend are mapped with
+** huge_alloc(), on 2 MB boundaries and advised onto transparent huge
+** pages, which cuts the TLB misses of the rows above and below each cell
+** on a wide lattice. --hugetlb takes them from the pages reserved in
+** /proc/sys/vm/nr_hugepages instead, while there are enough. Either way
+** the arrays fall back to small pages where huge ones are not to be had,
+** and the run summary gives how many huge pages the lattices were left on.
+**
+** --binary writes final_state.dat and av_vels.dat in the binary layout
+** described in lbm.h instead of as text.
+**
+** Be sure to adjust the grid dimensions in the parameter file
+** if you choose a different obstacle file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "lbm.h"
+#include "huge.h"
+
+#define FINALSTATEFILE  "final_state.dat"
+#define AVVELSFILE      "av_vels.dat"
+#define FORCESFILE      "forces.dat"
+#define LATENCY_BUCKETS 96      /* latency buckets: under 1 us, then quarter octaves up */
+#define LATENCY_STEPS   4       /* buckets per doubling of the latency */
+
+/* the backends built in, the default first */
+static const t_backend* const backends[] = {
+#ifdef HAVE_OPENMP
+  &openmp_backend,
+#endif
+#ifdef HAVE_OPENCL
+  &opencl_backend,
+#endif
+#ifdef HAVE_SYCL
+  &sycl_backend,
+#endif
+  NULL
+};
+
+/* values of --layout=, indexed by LAYOUT_ROWS, LAYOUT_TILED and LAYOUT_MORTON */
+static const char* const layouts[] = {"rows", "tiled", "morton"};
+
+/* collision operators of the parameter file, indexed by COLLISION_BGK, COLLISION_TRT and COLLISION_MRT */
+static const char* const collisions[] = {"bgk", "trt", "mrt"};
+
+/* struct to hold the latencies of the sampled timesteps */
+typedef struct
+{
+  int    every;                 /* sample every Nth timestep, 0 for none */
+  int    samples;               /* no. of timesteps sampled */
+  long   counts[LATENCY_BUCKETS];
+  double total;                 /* sum of the latencies, in s */
+  double max;                   /* longest latency, in s */
+  int*    steps;                /* timestep of each sample, only kept for --trace */
+  double* starts;               /* start of each sample after tic, in s */
+  double* latencies;            /* latency of each sample, in s */
+} t_latency;
+
+/*
+** function prototypes
+*/
+
+/* load params, allocate memory & load obstacles, all open without an obstacle file */
+int initialise(const char* paramfile, const char* obstaclefile,
+               t_param* params, int** obstacles_ptr, float** av_vels_ptr);
+
+/* allocate the lattice, unless the backend has mapped it, and initialise fluid particle densities */
+int initialise_cells(const t_param params, t_speeds* cells_ptr, const int mapped);
+
+/* write the final state and the average velocities to file, as text or binary */
+int write_values(const t_param params, t_speeds cells, int* obstacles, float* av_vels,
+                 const int binary);
+
+/* the same for the density and velocity of the nx*ny*nz cells of a 3D lattice, as text */
+int write_values_flow(const t_param params, float* flow[4], int* obstacles, float* av_vels);
+
+/* write the force on each obstacle label of each timestep to file */
+int write_forces(const t_param params, float* forces);
+
+/* finalise, including freeing up allocated memory, cells unless NULL */
+int finalise(t_speeds* cells_ptr, int** obstacles_ptr, float** av_vels_ptr);
+
+/* Sum all the densities in the grid.
+** The total should remain constant from one timestep to the next. */
+float total_density(const t_param params, t_speeds cells);
+
+/* compute average velocity */
+float av_velocity(const t_param params, t_speeds cells, int* obstacles);
+
+/* calculate Reynolds number */
+float calc_reynolds(const t_param params, t_speeds cells, int* obstacles);
+
+/* calculate Reynolds number of a 3D lattice */
+float calc_reynolds_flow(const t_param params, float* flow[4], int* obstacles);
+
+/* print the throughput of the run, and the summary as JSON if asked */
+void write_performance(const t_param params, const t_backend* backend, const t_work work,
+                       const int batch, const double elapsed, const double peak, const float reynolds,
+                       const t_latency* latency, const long huge[3], const int json);
+
+/* add a sampled timestep to the histogram, and to the trace if kept */
+void record_latency(t_latency* latency, const int tt, const double start, const double seconds);
+
+/* latency below which the fraction p of the samples fall, to the bucket */
+double latency_percentile(const t_latency* latency, const double p);
+
+/* print the percentiles of the sampled timesteps */
+void write_latency(const t_latency* latency);
+
+/* write the sampled timesteps as Chrome trace events */
+int write_trace(const char* path, const t_latency* latency, const t_backend* backend);
+
+/* die with the timestep and tile if the backend has seen an unstable lattice */
+void watch_stability(const t_backend* backend, void* state, const int wait);
+
+/* utility functions */
+const t_backend* find_backend(const char* name);
+int find_layout(const char* name);
+int find_collision(const char* name);
+static double wall_time(void);
+void usage(const char* exe);
+
+/*
+** main program:
+** initialise, timestep loop, finalise
+*/
+int main(int argc, char* argv[])
+{
+  char*    paramfile = NULL;    /* name of the input parameter file */
+  char*    obstaclefile = NULL; /* name of a the input obstacle file */
+  t_param  params;              /* struct to hold parameter values */
+  t_speeds cells;               /* grid containing fluid densities */
+  float*   flow[4] = {NULL};    /* density and velocity of each cell of a 3D lattice */
+  int*     obstacles = NULL;    /* grid indicating which cells are blocked */
+  float* av_vels   = NULL;     /* a record of the av. velocity computed for each timestep */
+  float* forces    = NULL;     /* a record of the force on each label for each timestep */
+  const t_backend* backend = backends[0]; /* backend taking the timesteps */
+  int      batch = 0;           /* timesteps per batch, 0 for the backend's choice */
+  int      measure_peak = 0;    /* whether to measure the STREAM triad bandwidth */
+  int      json = 0;            /* whether to print the summary as JSON */
+  double   peak = 0.0;          /* STREAM triad bandwidth in GB/s, 0 when not measured */
+  t_latency latency = {0};      /* latencies of the sampled timesteps */
+  const char* tracefile = NULL; /* name of the Chrome trace file, if any */
+  int      binary = 0;          /* whether to write the output files in binary */
+  int      watchdog = 0;        /* timesteps between looks at the instability flag, 0 for none */
+  int      with_forces = 0;     /* whether to reduce the force on each obstacle label */
+  int      layout = LAYOUT_ROWS; /* order the backend keeps the cells in */
+  int      deterministic = 0;   /* whether to sum the velocities in fixed point */
+  int      hugetlb = 0;         /* whether to map the lattices on reserved huge pages first */
+  int      generated = 0;       /* whether the backend builds the obstacles itself */
+  int      mapped = 0;          /* whether the backend has mapped cells itself */
+  t_work   work;                /* work of a timestep, for the MLUPS */
+  long     huge[3];             /* huge pages the lattices are on, of those they span, and reserved ones */
+  struct timeval timstr;        /* structure to hold elapsed time */
+  struct rusage ru;             /* structure to hold CPU time--system and user */
+  double tic, toc;              /* floating point numbers to calculate elapsed wallclock time */
+  double usrtim;                /* floating point number to record elapsed user CPU time */
+  double systim;                /* floating point number to record elapsed system CPU time */
+
+  /* parse the command line */
+  if (argc < 3)
+  {
+    usage(argv[0]);
+  }
+  else
+  {
+    paramfile = argv[1];
+    obstaclefile = argv[2];
+  }
+
+  /* the backend first, which takes the options the driver does not know */
+  for (int i = 3; i < argc; i++)
+  {
+    if (strncmp(argv[i], "--backend=", 10) == 0) backend = find_backend(argv[i] + 10);
+  }
+
+  if (backend == NULL) die("no backend built in", __LINE__, __FILE__);
+
+  for (int i = 3; i < argc; i++)
+  {
+    if (strncmp(argv[i], "--backend=", 10) == 0)
+    {
+      /* already taken */
+    }
+    else if (strncmp(argv[i], "--batch=", 8) == 0)
+    {
+      batch = atoi(argv[i] + 8);
+
+      if (batch < 1) die("batch must be at least 1 timestep", __LINE__, __FILE__);
+    }
+    else if (strcmp(argv[i], "--measure-peak") == 0)
+    {
+      measure_peak = 1;
+    }
+    else if (strcmp(argv[i], "--json") == 0)
+    {
+      json = 1;
+    }
+    else if (strncmp(argv[i], "--sample-steps=", 15) == 0)
+    {
+      latency.every = atoi(argv[i] + 15);
+
+      if (latency.every < 1) die("timesteps must be sampled at least every 1 timestep", __LINE__, __FILE__);
+    }
+    else if (strncmp(argv[i], "--trace=", 8) == 0)
+    {
+      tracefile = argv[i] + 8;
+    }
+    else if (strcmp(argv[i], "--binary") == 0)
+    {
+      binary = 1;
+    }
+    else if (strncmp(argv[i], "--watchdog=", 11) == 0)
+    {
+      watchdog = atoi(argv[i] + 11);
+
+      if (watchdog < 1) die("watchdog must look at least every 1 timestep", __LINE__, __FILE__);
+    }
+    else if (strcmp(argv[i], "--forces") == 0)
+    {
+      with_forces = 1;
+    }
+    else if (strncmp(argv[i], "--layout=", 9) == 0)
+    {
+      layout = find_layout(argv[i] + 9);
+    }
+    else if (strcmp(argv[i], "--deterministic") == 0)
+    {
+      deterministic = 1;
+    }
+    else if (strcmp(argv[i], "--hugetlb") == 0)
+    {
+      hugetlb = 1;
+    }
+    else if (backend->option == NULL || !backend->option(argv[i]))
+    {
+      usage(argv[0]);
+    }
+  }
+
+  if (batch == 0) batch = backend->batch;
+
+  if (tracefile && latency.every == 0) die("--trace needs --sample-steps", __LINE__, __FILE__);
+
+  /* the lattices are mapped as they are allocated, from initialise() on */
+  params.hugetlb = hugetlb;
+
+  /* the obstacle file may instead describe a geometry the backend builds */
+  if (backend->geometry != NULL) generated = backend->geometry(obstaclefile);
+
+  /* initialise our data structures and load values from file */
+  initialise(paramfile, generated ? NULL : obstaclefile, &params, &obstacles, &av_vels);
+
+  if (params.nz > 1 && backend->flow == NULL) die("nz > 1 needs a backend with 3D lattices", __LINE__, __FILE__);
+
+  if (params.nz > 1 && binary) die("--binary only writes 2D lattices", __LINE__, __FILE__);
+
+  /* the backends only reduce forces for the labels asked for */
+  if (!with_forces) params.nlabels = 0;
+
+  params.layout = layout;
+  params.deterministic = deterministic;
+
+  if (params.nlabels > 0)
+  {
+    forces = malloc(sizeof(float) * 2 * params.nlabels * params.maxIters);
+
+    if (forces == NULL) die("cannot allocate memory for forces", __LINE__, __FILE__);
+  }
+
+  if (tracefile)
+  {
+    const int samples = (params.maxIters + latency.every - 1) / latency.every;
+
+    latency.steps = malloc(sizeof(int) * samples);
+    latency.starts = malloc(sizeof(double) * samples);
+    latency.latencies = malloc(sizeof(double) * samples);
+
+    if (latency.steps == NULL || latency.starts == NULL || latency.latencies == NULL)
+      die("cannot allocate memory for the trace", __LINE__, __FILE__);
+  }
+
+  if (params.nz > 1)
+  {
+    for (int f = 0; f < 4; f++)
+    {
+      flow[f] = malloc(sizeof(float) * params.nx * params.ny * params.nz);
+
+      if (flow[f] == NULL) die("cannot allocate memory for the flow", __LINE__, __FILE__);
+    }
+  }
+
+  void* state = backend->allocate(params);
+
+  /* the lattice, unless the backend maps it itself */
+  if (backend->cells != NULL) mapped = backend->cells(state, &cells);
+  initialise_cells(params, &cells, mapped);
+
+  backend->upload(state, cells, obstacles);
+
+  /* iterate for maxIters timesteps */
+  gettimeofday(&timstr, NULL);
+  tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+
+  for (int tt = 0, n; tt < params.maxIters; tt += n)
+  {
+    n = (tt + batch < params.maxIters) ? batch : params.maxIters - tt;
+
+    if (latency.every > 0 && tt % latency.every == 0)
+    {
+      /* a sampled timestep runs alone, from an idle backend to its completion */
+      n = 1;
+      if (backend->finish != NULL) backend->finish(state);
+      const double start = wall_time();
+      backend->step_batch(state, tt, n);
+      if (backend->finish != NULL) backend->finish(state);
+      record_latency(&latency, tt, start - tic, wall_time() - start);
+    }
+    else
+    {
+      /* batches stop short of the next sampled timestep */
+      if (latency.every > 0 && tt % latency.every + n > latency.every)
+        n = latency.every - tt % latency.every;
+
+      /* and short of the next look of the watchdog */
+      if (watchdog > 0 && tt % watchdog + n > watchdog)
+        n = watchdog - tt % watchdog;
+
+      backend->step_batch(state, tt, n);
+    }
+
+    if (watchdog > 0 && (tt + n) % watchdog == 0) watch_stability(backend, state, 0);
+
+#ifdef DEBUG
+    backend->reduce(state, tt, n, av_vels);
+    printf("==timestep: %d==\n", tt + n - 1);
+    printf("av velocity: %.12E\n", av_vels[tt + n - 1]);
+#endif
+  }
+
+  if (watchdog > 0) watch_stability(backend, state, 1);
+
+  backend->reduce(state, 0, params.maxIters, av_vels);
+  if (params.nlabels > 0) backend->forces(state, 0, params.maxIters, forces);
+
+  gettimeofday(&timstr, NULL);
+  toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+  getrusage(RUSAGE_SELF, &ru);
+  timstr = ru.ru_utime;
+  usrtim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+  timstr = ru.ru_stime;
+  systim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+
+  /* while the backend's lattices are still mapped */
+  huge_pages(huge);
+
+  if (params.nz > 1) backend->flow(state, flow[0], flow[1], flow[2], flow[3]);
+  backend->download(state, cells);
+
+  /* the microbenchmark runs once the lattice is off the device */
+  if (measure_peak) peak = backend->measure_peak(state);
+
+  /* every cell updated once a timestep, unless the backend says otherwise */
+  work.engine = NULL;
+  work.updates = (double)params.nx * params.ny * params.nz;
+  work.cell_bytes = backend->cell_bytes;
+  if (backend->work != NULL) backend->work(state, &work);
+
+  /* write final values and free memory */
+  const float reynolds = (params.nz > 1) ? calc_reynolds_flow(params, flow, obstacles)
+                                         : calc_reynolds(params, cells, obstacles);
+  printf("==done==\n");
+  printf("Reynolds number:\t\t%.12E\n", reynolds);
+  printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
+  printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
+  printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
+  printf("Peak resident set size:\t\t%ld (kB)\n", ru.ru_maxrss);
+  printf("Backend:\t\t\t%s (%d timesteps per batch)\n", backend->name, batch);
+  if (work.engine != NULL) printf("Engine:\t\t\t\t%s\n", work.engine);
+  printf("Huge pages:\t\t\t%ld of %ld (2 MB) (%ld reserved)\n", huge[0], huge[1], huge[2]);
+  if (backend->report != NULL) backend->report(state);
+  if (latency.samples > 0) write_latency(&latency);
+  write_performance(params, backend, work, batch, toc - tic, peak, reynolds, &latency, huge, json);
+  if (tracefile) write_trace(tracefile, &latency, backend);
+  if (params.nz > 1)
+    write_values_flow(params, flow, obstacles, av_vels);
+  else
+    write_values(params, cells, obstacles, av_vels, binary);
+  if (params.nlabels > 0) write_forces(params, forces);
+  backend->release(state);
+  finalise(mapped ? NULL : &cells, &obstacles, &av_vels);
+  for (int f = 0; f < 4; f++)
+    free(flow[f]);
+  free(forces);
+  free(latency.steps);
+  free(latency.starts);
+  free(latency.latencies);
+
+  return EXIT_SUCCESS;
+}
+
+float av_velocity(const t_param params, t_speeds cells, int* obstacles)
+{
+  int    tot_cells = 0;  /* no. of cells used in calculation */
+  float tot_u;          /* accumulated magnitudes of velocity for each cell */
+
+  /* initialise */
+  tot_u = 0.f;
+
+  /* loop over all non-blocked cells */
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      /* ignore occupied cells */
+      if (!obstacles[ii + jj*params.nx])
+      {
+        /* local density total */
+        float local_density = 0.f;
+
+        local_density += cells.s0[ii + jj*params.nx] + cells.s1[ii + jj*params.nx] + cells.s2[ii + jj*params.nx]
+                       + cells.s3[ii + jj*params.nx] + cells.s4[ii + jj*params.nx] + cells.s5[ii + jj*params.nx]
+                       + cells.s6[ii + jj*params.nx] + cells.s7[ii + jj*params.nx] + cells.s8[ii + jj*params.nx];
+
+        /* x-component of velocity */
+        float u_x = (cells.s1[ii + jj*params.nx]
+                      + cells.s5[ii + jj*params.nx]
+                      + cells.s8[ii + jj*params.nx]
+                      - (cells.s3[ii + jj*params.nx]
+                         + cells.s6[ii + jj*params.nx]
+                         + cells.s7[ii + jj*params.nx]))
+                     / local_density;
+        /* compute y velocity component */
+        float u_y = (cells.s2[ii + jj*params.nx]
+                      + cells.s5[ii + jj*params.nx]
+                      + cells.s6[ii + jj*params.nx]
+                      - (cells.s4[ii + jj*params.nx]
+                         + cells.s7[ii + jj*params.nx]
+                         + cells.s8[ii + jj*params.nx]))
+                     / local_density;
+        /* accumulate the norm of x- and y- velocity components */
+        tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
+        /* increase counter of inspected cells */
+        ++tot_cells;
+      }
+    }
+  }
+
+  return tot_u / (float)tot_cells;
+}
+
+int initialise(const char* paramfile, const char* obstaclefile,
+               t_param* params, int** obstacles_ptr, float** av_vels_ptr)
+{
+  char   message[1024];  /* message buffer */
+  FILE*   fp;            /* file pointer */
+  int    xx, yy;         /* generic array indices */
+  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
+  int    retval;         /* to hold return value for checking */
+  char   collision[16];  /* name of the collision operator */
+  float  magic = 0.25f;  /* TRT magic parameter */
+
+  /* open the parameter file */
+  fp = fopen(paramfile, "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input parameter file: %s", paramfile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* read in the parameter values */
+  retval = fscanf(fp, "%d\n", &(params->nx));
+
+  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%d\n", &(params->ny));
+
+  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%d\n", &(params->maxIters));
+
+  if (retval != 1) die("could not read param file: maxIters", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
+
+  if (retval != 1) die("could not read param file: reynolds_dim", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%f\n", &(params->density));
+
+  if (retval != 1) die("could not read param file: density", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%f\n", &(params->accel));
+
+  if (retval != 1) die("could not read param file: accel", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%f\n", &(params->omega));
+
+  if (retval != 1) die("could not read param file: omega", __LINE__, __FILE__);
+
+  /* 2D parameter files stop here, or go on with the collision operator */
+  retval = fscanf(fp, "%d\n", &(params->nz));
+
+  if (retval != 1) params->nz = 1;
+
+  if (params->nz < 1) die("nz must be positive", __LINE__, __FILE__);
+
+  /* the collision operator, BGK unless named, and its own relaxation rates */
+  params->collision = COLLISION_BGK;
+  params->omega_odd = params->omega;
+  params->s_e = 1.1f;
+  params->s_eps = 1.f;
+  params->s_q = 1.2f;
+
+  if (fscanf(fp, "%15s\n", collision) == 1) params->collision = find_collision(collision);
+
+  if (params->collision == COLLISION_TRT)
+  {
+    if (fscanf(fp, "%f\n", &magic) == 1 && magic <= 0.f)
+      die("the TRT magic parameter should be positive", __LINE__, __FILE__);
+
+    params->omega_odd = 1.f / (magic / (1.f / params->omega - 0.5f) + 0.5f);
+  }
+
+  if (params->collision == COLLISION_MRT)
+  {
+    float* rates[3] = {&params->s_e, &params->s_eps, &params->s_q};
+
+    /* as many of the rates as the file gives, in order */
+    for (int r = 0; r < 3 && fscanf(fp, "%f\n", rates[r]) == 1; r++);
+
+    if (params->s_e <= 0.f || params->s_e >= 2.f || params->s_eps <= 0.f || params->s_eps >= 2.f
+        || params->s_q <= 0.f || params->s_q >= 2.f)
+      die("the MRT relaxation rates should be between 0 and 2", __LINE__, __FILE__);
+  }
+
+  if (params->collision != COLLISION_BGK && (params->omega <= 0.f || params->omega >= 2.f))
+    die("omega should be between 0 and 2 for the TRT and MRT operators", __LINE__, __FILE__);
+
+  /* and close up the file */
+  fclose(fp);
+
+  /* the map of obstacles */
+  *obstacles_ptr = malloc(sizeof(int) * (params->ny * params->nx));
+
+  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+
+  /* first set all cells in obstacle array to zero */
+  for (int jj = 0; jj < params->ny; jj++)
+  {
+    for (int ii = 0; ii < params->nx; ii++)
+    {
+      (*obstacles_ptr)[ii + jj*params->nx] = 0;
+    }
+  }
+
+  /*
+  ** allocate space to hold a record of the avarage velocities computed
+  ** at each timestep
+  */
+  *av_vels_ptr = (float*)malloc(sizeof(float) * params->maxIters);
+
+  if (*av_vels_ptr == NULL) die("cannot allocate memory for av_vels", __LINE__, __FILE__);
+
+  params->nlabels = 0;
+
+  /* a generated geometry is built later by the backend */
+  if (obstaclefile == NULL) return EXIT_SUCCESS;
+
+  /* open the obstacle data file */
+  fp = fopen(obstaclefile, "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* read-in the blocked cells list */
+  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  {
+    /* some checks */
+    if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+
+    if (xx < 0 || xx > params->nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
+
+    if (yy < 0 || yy > params->ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
+
+    if (blocked < 1 || blocked > MAXLABELS) die("obstacle label should be 1 to MAXLABELS", __LINE__, __FILE__);
+
+    /* assign to array */
+    (*obstacles_ptr)[xx + yy*params->nx] = blocked;
+
+    if (blocked > params->nlabels) params->nlabels = blocked;
+  }
+
+  /* and close the file */
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+int initialise_cells(const t_param params, t_speeds* cells_ptr, const int mapped)
+{
+  /*
+  ** Allocate memory.
+  **
+  ** NB we are allocating a 1D array, so that the
+  ** memory will be contiguous.  We still want to
+  ** index this memory as if it were a (row major
+  ** ordered) 2D array, however.  We will perform
+  ** some arithmetic using the row and column
+  ** coordinates, inside the square brackets, when
+  ** we want to access elements of this array.
+  **
+  ** Note also that we are using a structure to
+  ** hold one such array per 'speed', the layout
+  ** every backend works on, aligned for the vector
+  ** loads of the OpenMP one and on huge pages. The
+  ** scratch lattice belongs to the backend.
+  */
+
+  /* main grid, unless the backend has mapped it */
+  if (!mapped)
+  {
+    cells_ptr->s0 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+    cells_ptr->s1 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+    cells_ptr->s2 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+    cells_ptr->s3 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+    cells_ptr->s4 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+    cells_ptr->s5 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+    cells_ptr->s6 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+    cells_ptr->s7 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+    cells_ptr->s8 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+
+    if (cells_ptr->s0 == NULL || cells_ptr->s1 == NULL || cells_ptr->s2 == NULL
+        || cells_ptr->s3 == NULL || cells_ptr->s4 == NULL || cells_ptr->s5 == NULL
+        || cells_ptr->s6 == NULL || cells_ptr->s7 == NULL || cells_ptr->s8 == NULL)
+      die("cannot allocate memory for cells", __LINE__, __FILE__);
+  }
+
+  /* initialise densities */
+  float w0 = params.density * 4.f / 9.f;
+  float w1 = params.density      / 9.f;
+  float w2 = params.density      / 36.f;
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      /* centre */
+      cells_ptr->s0[ii + jj*params.nx] = w0;
+      /* axis directions */
+      cells_ptr->s1[ii + jj*params.nx] = w1;
+      cells_ptr->s2[ii + jj*params.nx] = w1;
+      cells_ptr->s3[ii + jj*params.nx] = w1;
+      cells_ptr->s4[ii + jj*params.nx] = w1;
+      /* diagonals */
+      cells_ptr->s5[ii + jj*params.nx] = w2;
+      cells_ptr->s6[ii + jj*params.nx] = w2;
+      cells_ptr->s7[ii + jj*params.nx] = w2;
+      cells_ptr->s8[ii + jj*params.nx] = w2;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int finalise(t_speeds* cells_ptr, int** obstacles_ptr, float** av_vels_ptr)
+{
+  /*
+  ** free up allocated memory
+  */
+  if (cells_ptr != NULL)
+  {
+    huge_free(cells_ptr->s0);
+    huge_free(cells_ptr->s1);
+    huge_free(cells_ptr->s2);
+    huge_free(cells_ptr->s3);
+    huge_free(cells_ptr->s4);
+    huge_free(cells_ptr->s5);
+    huge_free(cells_ptr->s6);
+    huge_free(cells_ptr->s7);
+    huge_free(cells_ptr->s8);
+    cells_ptr->s0 = cells_ptr->s1 = cells_ptr->s2 = NULL;
+    cells_ptr->s3 = cells_ptr->s4 = cells_ptr->s5 = NULL;
+    cells_ptr->s6 = cells_ptr->s7 = cells_ptr->s8 = NULL;
+  }
+
+  free(*obstacles_ptr);
+  *obstacles_ptr = NULL;
+
+  free(*av_vels_ptr);
+  *av_vels_ptr = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+
+float calc_reynolds(const t_param params, t_speeds cells, int* obstacles)
+{
+  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+
+  return av_velocity(params, cells, obstacles) * params.reynolds_dim / viscosity;
+}
+
+float calc_reynolds_flow(const t_param params, float* flow[4], int* obstacles)
+{
+  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+  const size_t slice = (size_t)params.nx * params.ny;
+  int    tot_cells = 0;  /* no. of cells used in calculation */
+  float tot_u = 0.f;    /* accumulated magnitudes of velocity for each cell */
+
+  for (size_t idx = 0; idx < slice * params.nz; idx++)
+  {
+    /* the obstacles extend through all the slices */
+    if (!obstacles[idx % slice])
+    {
+      tot_u += sqrtf((flow[1][idx] * flow[1][idx]) + (flow[2][idx] * flow[2][idx]) + (flow[3][idx] * flow[3][idx]));
+      ++tot_cells;
+    }
+  }
+
+  return tot_u / (float)tot_cells * params.reynolds_dim / viscosity;
+}
+
+float total_density(const t_param params, t_speeds cells)
+{
+  float total = 0.f;  /* accumulator */
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      total += cells.s0[ii + jj*params.nx] + cells.s1[ii + jj*params.nx] + cells.s2[ii + jj*params.nx]
+             + cells.s3[ii + jj*params.nx] + cells.s4[ii + jj*params.nx] + cells.s5[ii + jj*params.nx]
+             + cells.s6[ii + jj*params.nx] + cells.s7[ii + jj*params.nx] + cells.s8[ii + jj*params.nx];
+    }
+  }
+
+  return total;
+}
+
+int write_values(const t_param params, t_speeds cells, int* obstacles, float* av_vels,
+                 const int binary)
+{
+  FILE* fp;                     /* file pointer */
+  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
+  float local_density;         /* per grid cell sum of densities */
+  float pressure;              /* fluid pressure in grid cell */
+  float u_x;                   /* x-component of velocity in grid cell */
+  float u_y;                   /* y-component of velocity in grid cell */
+  float u;                     /* norm--root of summed squares--of u_x and u_y */
+  const int dims[2] = {params.nx, params.ny};
+
+  fp = fopen(FINALSTATEFILE, binary ? "wb" : "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  if (binary && (fwrite(STATEMAGIC, 1, 8, fp) != 8 || fwrite(dims, sizeof(int), 2, fp) != 2))
+  {
+    die("could not write output file", __LINE__, __FILE__);
+  }
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      /* an occupied cell */
+      if (obstacles[ii + jj*params.nx])
+      {
+        u_x = u_y = u = 0.f;
+        pressure = params.density * c_sq;
+      }
+      /* no obstacle */
+      else
+      {
+        local_density = 0.f;
+
+        local_density += cells.s0[ii + jj*params.nx] + cells.s1[ii + jj*params.nx] + cells.s2[ii + jj*params.nx]
+                       + cells.s3[ii + jj*params.nx] + cells.s4[ii + jj*params.nx] + cells.s5[ii + jj*params.nx]
+                       + cells.s6[ii + jj*params.nx] + cells.s7[ii + jj*params.nx] + cells.s8[ii + jj*params.nx];
+
+        /* compute x velocity component */
+        u_x = (cells.s1[ii + jj*params.nx]
+               + cells.s5[ii + jj*params.nx]
+               + cells.s8[ii + jj*params.nx]
+               - (cells.s3[ii + jj*params.nx]
+                  + cells.s6[ii + jj*params.nx]
+                  + cells.s7[ii + jj*params.nx]))
+              / local_density;
+        /* compute y velocity component */
+        u_y = (cells.s2[ii + jj*params.nx]
+               + cells.s5[ii + jj*params.nx]
+               + cells.s6[ii + jj*params.nx]
+               - (cells.s4[ii + jj*params.nx]
+                  + cells.s7[ii + jj*params.nx]
+                  + cells.s8[ii + jj*params.nx]))
+              / local_density;
+        /* compute norm of velocity */
+        u = sqrtf((u_x * u_x) + (u_y * u_y));
+        /* compute pressure */
+        pressure = local_density * c_sq;
+      }
+
+      /* write to file */
+      if (binary)
+      {
+        const t_cell_state cell = {u_x, u_y, u, pressure, obstacles[ii + jj*params.nx]};
+
+        if (fwrite(&cell, sizeof(cell), 1, fp) != 1)
+          die("could not write output file", __LINE__, __FILE__);
+      }
+      else
+        fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, u_x, u_y, u, pressure, obstacles[ii + jj*params.nx]);
+    }
+  }
+
+  fclose(fp);
+
+  fp = fopen(AVVELSFILE, binary ? "wb" : "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  if (binary)
+  {
+    if (fwrite(AVVELSMAGIC, 1, 8, fp) != 8 || fwrite(&params.maxIters, sizeof(int), 1, fp) != 1
+        || fwrite(av_vels, sizeof(float), params.maxIters, fp) != (size_t)params.maxIters)
+      die("could not write output file", __LINE__, __FILE__);
+  }
+  else
+  {
+    for (int ii = 0; ii < params.maxIters; ii++)
+    {
+      fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+    }
+  }
+
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+int write_values_flow(const t_param params, float* flow[4], int* obstacles, float* av_vels)
+{
+  FILE* fp;                     /* file pointer */
+  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
+
+  fp = fopen(FINALSTATEFILE, "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  for (int kk = 0; kk < params.nz; kk++)
+  {
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+      for (int ii = 0; ii < params.nx; ii++)
+      {
+        const size_t idx = ii + ((size_t)jj + (size_t)kk*params.ny)*params.nx;
+        const int obstacle = obstacles[ii + jj*params.nx];
+        float u[3] = {0.f, 0.f, 0.f};
+        float pressure = params.density * c_sq;
+
+        /* no obstacle */
+        if (!obstacle)
+        {
+          u[0] = flow[1][idx];
+          u[1] = flow[2][idx];
+          u[2] = flow[3][idx];
+          pressure = flow[0][idx] * c_sq;
+        }
+
+        /* write to file */
+        fprintf(fp, "%d %d %d %.12E %.12E %.12E %.12E %.12E %d\n", ii, jj, kk, u[0], u[1], u[2],
+                sqrtf((u[0] * u[0]) + (u[1] * u[1]) + (u[2] * u[2])), pressure, obstacle);
+      }
+    }
+  }
+
+  fclose(fp);
+
+  fp = fopen(AVVELSFILE, "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  for (int ii = 0; ii < params.maxIters; ii++)
+  {
+    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+  }
+
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+int write_forces(const t_param params, float* forces)
+{
+  FILE* fp;                     /* file pointer */
+
+  fp = fopen(FORCESFILE, "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  for (int ii = 0; ii < params.maxIters; ii++)
+  {
+    fprintf(fp, "%d:", ii);
+
+    for (int ll = 0; ll < params.nlabels; ll++)
+    {
+      fprintf(fp, "\t%.12E\t%.12E", forces[2*(ii*params.nlabels + ll)], forces[2*(ii*params.nlabels + ll) + 1]);
+    }
+
+    fprintf(fp, "\n");
+  }
+
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+void write_performance(const t_param params, const t_backend* backend, const t_work work,
+                       const int batch, const double elapsed, const double peak, const float reynolds,
+                       const t_latency* latency, const long huge[3], const int json)
+{
+  /* every timestep updates every cell, blocked or not */
+  const double mlups = work.updates * params.maxIters / elapsed / 1e6;
+  const double bandwidth = mlups * work.cell_bytes / 1e3;  /* GB/s */
+
+  printf("MLUPS:\t\t\t\t%.2lf\n", mlups);
+  printf("Memory bandwidth:\t\t%.2lf (GB/s) (%d bytes per cell update)\n", bandwidth, work.cell_bytes);
+  if (peak > 0.0)
+    printf("STREAM triad bandwidth:\t\t%.2lf (GB/s) (%.1lf%% achieved)\n", peak, 100.0 * bandwidth / peak);
+
+  if (!json) return;
+
+  printf("{\"backend\": \"%s\", \"nx\": %d, \"ny\": %d, \"nz\": %d, \"iterations\": %d, \"batch\": %d, "
+         "\"reynolds\": %.12E, \"elapsed_s\": %.6lf, \"mlups\": %.3lf, \"bytes_per_cell_update\": %d, "
+         "\"bandwidth_gbs\": %.3lf, \"layout\": \"%s\", \"deterministic\": %d, \"collision\": \"%s\"",
+         backend->name, params.nx, params.ny, params.nz, params.maxIters, batch,
+         reynolds, elapsed, mlups, work.cell_bytes, bandwidth, layouts[params.layout],
+         params.deterministic, collisions[params.collision]);
+  if (work.engine != NULL)
+    printf(", \"engine\": \"%s\"", work.engine);
+  printf(", \"huge_pages\": %ld, \"huge_pages_spanned\": %ld, \"huge_pages_reserved\": %ld", huge[0], huge[1], huge[2]);
+  if (peak > 0.0)
+    printf(", \"peak_gbs\": %.3lf, \"peak_fraction\": %.4lf", peak, bandwidth / peak);
+  if (latency->samples > 0)
+    printf(", \"sample_steps\": %d, \"latency_samples\": %d, \"latency_mean_us\": %.3lf, "
+           "\"latency_p50_us\": %.3lf, \"latency_p90_us\": %.3lf, \"latency_p99_us\": %.3lf, "
+           "\"latency_max_us\": %.3lf",
+           latency->every, latency->samples, 1e6 * latency->total / latency->samples,
+           1e6 * latency_percentile(latency, 0.50), 1e6 * latency_percentile(latency, 0.90),
+           1e6 * latency_percentile(latency, 0.99), 1e6 * latency->max);
+  printf("}\n");
+}
+
+void record_latency(t_latency* latency, const int tt, const double start, const double seconds)
+{
+  const double us = seconds * 1e6;
+  int bucket = 0;
+
+  /* bucket b > 0 holds latencies of 2^((b-1)/LATENCY_STEPS) us up to 2^(b/LATENCY_STEPS) us */
+  if (us >= 1.0) bucket = 1 + (int)(LATENCY_STEPS * log2(us));
+  if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+
+  latency->counts[bucket]++;
+  latency->total += seconds;
+  if (seconds > latency->max) latency->max = seconds;
+
+  if (latency->steps != NULL)
+  {
+    latency->steps[latency->samples] = tt;
+    latency->starts[latency->samples] = start;
+    latency->latencies[latency->samples] = seconds;
+  }
+
+  latency->samples++;
+}
+
+double latency_percentile(const t_latency* latency, const double p)
+{
+  const long rank = (long)ceil(p * latency->samples);
+  long below = 0;
+
+  for (int b = 0; b < LATENCY_BUCKETS - 1; b++)
+  {
+    below += latency->counts[b];
+
+    /* the top of the bucket, unless the longest sample falls short of it */
+    if (below >= rank)
+    {
+      const double top = 1e-6 * pow(2.0, (double)b / LATENCY_STEPS);
+      return (top < latency->max) ? top : latency->max;
+    }
+  }
+
+  return latency->max;
+}
+
+void write_latency(const t_latency* latency)
+{
+  printf("Sampled timesteps:\t\t%d (every %d) (mean %.1lf us)\n",
+         latency->samples, latency->every, 1e6 * latency->total / latency->samples);
+  printf("Timestep latency:\t\tp50 %.1lf, p90 %.1lf, p99 %.1lf, max %.1lf (us)\n",
+         1e6 * latency_percentile(latency, 0.50), 1e6 * latency_percentile(latency, 0.90),
+         1e6 * latency_percentile(latency, 0.99), 1e6 * latency->max);
+}
+
+int write_trace(const char* path, const t_latency* latency, const t_backend* backend)
+{
+  FILE* fp;  /* file pointer */
+
+  fp = fopen(path, "w");
+
+  if (fp == NULL)
+  {
+    die("could not open trace file", __LINE__, __FILE__);
+  }
+
+  /* complete events in microseconds from the start of the timed loop */
+  fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"d2q9-bgk %s\"}}",
+          backend->name);
+
+  for (int i = 0; i < latency->samples; i++)
+  {
+    fprintf(fp, ",\n{\"name\": \"timestep\", \"cat\": \"lbm\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+                "\"ts\": %.3lf, \"dur\": %.3lf, \"args\": {\"step\": %d}}",
+            1e6 * latency->starts[i], 1e6 * latency->latencies[i], latency->steps[i]);
+  }
+
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+const t_backend* find_backend(const char* name)
+{
+  char message[1024];  /* message buffer */
+
+  for (int b = 0; backends[b] != NULL; b++)
+  {
+    if (strcmp(backends[b]->name, name) == 0) return backends[b];
+  }
+
+  sprintf(message, "backend not built in: %.64s", name);
+  die(message, __LINE__, __FILE__);
+
+  return NULL;
+}
+
+int find_layout(const char* name)
+{
+  char message[1024];  /* message buffer */
+
+  for (int l = 0; l < (int)(sizeof(layouts) / sizeof(layouts[0])); l++)
+  {
+    if (strcmp(layouts[l], name) == 0) return l;
+  }
+
+  sprintf(message, "unknown layout: %.64s", name);
+  die(message, __LINE__, __FILE__);
+
+  return LAYOUT_ROWS;
+}
+
+int find_collision(const char* name)
+{
+  char message[1024];  /* message buffer */
+
+  for (int c = 0; c < (int)(sizeof(collisions) / sizeof(collisions[0])); c++)
+  {
+    if (strcmp(collisions[c], name) == 0) return c;
+  }
+
+  sprintf(message, "unknown collision operator in param file: %.64s", name);
+  die(message, __LINE__, __FILE__);
+
+  return COLLISION_BGK;
+}
+
+void watch_stability(const t_backend* backend, void* state, const int wait)
+{
+  char message[1024];  /* message buffer */
+  int  tile[4];        /* first tile seen unstable: x0, y0, x1, y1 */
+  const int tt = backend->poll(state, wait, tile);
+
+  if (tt < 0) return;
+
+  sprintf(message, "unstable at timestep %d: non-finite or negative density in cells %d,%d to %d,%d",
+          tt, tile[0], tile[1], tile[2], tile[3]);
+  die(message, __LINE__, __FILE__);
+}
+
+static double wall_time(void)
+{
+  struct timeval timstr;        /* structure to hold elapsed time */
+
+  gettimeofday(&timstr, NULL);
+
+  return timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+}
+
+void die(const char* message, const int line, const char* file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n", message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}
+
+void usage(const char* exe)
+{
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> [--backend=NAME] [--batch=N]\n"
+                  "       [--measure-peak] [--json] [--sample-steps=N] [--trace=FILE] [--binary]\n"
+                  "       [--watchdog=N] [--forces] [--layout=rows|tiled|morton]\n"
+                  "       [--deterministic] [--hugetlb]\n", exe);
+  fprintf(stderr, "Backends built in:");
+
+  for (int b = 0; backends[b] != NULL; b++)
+  {
+    fprintf(stderr, " %s", backends[b]->name);
+  }
+
+  fprintf(stderr, "\n");
+
+  for (int b = 0; backends[b] != NULL; b++)
+  {
+    if (backends[b]->options != NULL)
+      fprintf(stderr, "Options of --backend=%s:\n%s", backends[b]->name, backends[b]->options);
+  }
+
+  exit(EXIT_FAILURE);
+}
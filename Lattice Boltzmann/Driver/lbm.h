@@ -0,0 +1,217 @@
+/*
+** Interface between the d2q9-bgk host driver and its backends.
+**
+** The driver reads the parameters and obstacles, initialises the
+** lattice, times the run and writes the results; a backend owns the
+** lattice on its device and only moves it in and out and advances it.
+** For a run of maxIters timesteps the driver calls, in order:
+**
+**   state = allocate(params)
+**   cells(state, &cells)             where the backend maps the lattice itself
+**   upload(state, cells, obstacles)
+**   step_batch(state, first, n)      for consecutive batches of timesteps,
+**   finish(state)                    around each one timed with --sample-steps
+**   poll(state, 0, tile)             every N timesteps with --watchdog=N
+**   poll(state, 1, tile)             with --watchdog=N
+**   reduce(state, 0, maxIters, av_vels)
+**   forces(state, 0, maxIters, forces)  with --forces only
+**   flow(state, ...)                 for a 3D lattice, params.nz > 1
+**   download(state, cells)
+**   measure_peak(state)              with --measure-peak only
+**   work(state, &work)
+**   release(state)
+**
+** Before any of them, option() is given each command line option the
+** driver does not know, and geometry() the name of the obstacle file.
+**
+** Nothing here includes a system header, so C++ backends with types of
+** the same names may wrap this file in a namespace.
+*/
+
+#ifndef LBM_H
+#define LBM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NSPEEDS         9
+#ifndef TRIAD_SIZE
+#define TRIAD_SIZE      (1 << 24) /* elements of each STREAM triad array */
+#endif
+#define TRIAD_REPEATS   10        /* STREAM triad passes, the fastest is kept */
+#define MAXLABELS       8         /* obstacle labels the forces are reduced for */
+#define EXACT_SCALE     68719476736.0f /* 2^36, the fixed-point unit of --deterministic sums */
+
+/* orders a backend may keep the cells of its lattice in, picked with --layout= */
+#define LAYOUT_ROWS     0         /* row-major, as the driver's cells */
+#define LAYOUT_TILED    1         /* row-major tiles, each tile row-major */
+#define LAYOUT_MORTON   2         /* the same tiles along a Z-order (Morton) curve */
+
+/* collision operators, named on the line of the parameter file after omega */
+#define COLLISION_BGK   0         /* one relaxation time, omega */
+#define COLLISION_TRT   1         /* omega for the even parts of the populations, omega_odd for the odd */
+#define COLLISION_MRT   2         /* a relaxation time per moment, omega for the stress */
+
+/* struct to hold the parameter values */
+typedef struct
+{
+  int    nx;            /* no. of cells in x-direction */
+  int    ny;            /* no. of cells in y-direction */
+  int    nz;            /* no. of cells in z-direction, 1 unless the parameter file gives it */
+  int    maxIters;      /* no. of iterations */
+  int    reynolds_dim;  /* dimension for Reynolds number */
+  float density;       /* density per link */
+  float accel;         /* density redistribution */
+  float omega;         /* relaxation parameter */
+  int    collision;     /* COLLISION_BGK, COLLISION_TRT or COLLISION_MRT */
+  float  omega_odd;     /* TRT relaxation of the odd parts, from the magic parameter */
+  float  s_e;           /* MRT relaxation of the energy */
+  float  s_eps;         /* MRT relaxation of the energy squared */
+  float  s_q;           /* MRT relaxation of the energy flux */
+  int    nlabels;       /* no. of obstacle labels to reduce forces for, 0 for none */
+  int    layout;        /* LAYOUT_ROWS, LAYOUT_TILED or LAYOUT_MORTON */
+  int    deterministic; /* whether to sum the velocities in fixed point, to the same bits in any order */
+  int    hugetlb;       /* whether to map the host lattices on reserved huge pages first, as huge_alloc() does */
+} t_param;
+
+/* struct to hold the 'speed' values, one array per speed */
+typedef struct
+{
+  float* s0;
+  float* s1;
+  float* s2;
+  float* s3;
+  float* s4;
+  float* s5;
+  float* s6;
+  float* s7;
+  float* s8;
+} t_speeds;
+
+/*
+** With --binary the output files hold the same values as the text ones,
+** in the same order, after an 8 byte magic: final_state.dat has int nx,
+** int ny and then a t_cell_state for each line, av_vels.dat has int
+** maxIters and then a float for each line. check/lbmcheck reads both.
+*/
+#define STATEMAGIC      "D2Q9FSB1"
+#define AVVELSMAGIC     "D2Q9AVB1"
+
+/* struct to hold a line of final_state.dat */
+typedef struct
+{
+  float u_x;
+  float u_y;
+  float u;
+  float pressure;
+  int   obstacle;
+} t_cell_state;
+
+/* struct to hold the work of a timestep, for the MLUPS and bandwidth of the run summary */
+typedef struct
+{
+  const char* engine;   /* name of the backend's engine, NULL when it has one only */
+  double updates;       /* cell updates per timestep */
+  int    cell_bytes;    /* bytes moved to and from memory per cell update */
+} t_work;
+
+/* struct to hold the entry points of a backend */
+typedef struct
+{
+  const char* name;     /* value of --backend= selecting it */
+  int batch;            /* timesteps per step_batch() call unless --batch= is given */
+  int cell_bytes;       /* bytes moved to and from memory per cell update */
+
+  /* create the device lattices and anything else sized by params */
+  void* (*allocate)(const t_param params);
+
+  /* copy the initial lattice and the obstacles, row-major, to the device */
+  void (*upload)(void* state, const t_speeds cells, const int* obstacles);
+
+  /* take timesteps first to first+n-1; they may still be running on return */
+  void (*step_batch)(void* state, const int first, const int n);
+
+  /* wait for every timestep taken so far, NULL when step_batch() already has */
+  void (*finish)(void* state);
+
+  /*
+  ** The first timestep to leave a non-finite or negative density, and
+  ** in tile the cells x0, y0, x1, y1 of the first tile of the lattice it
+  ** was seen in, or -1 if none has. With wait every timestep taken is
+  ** covered; without, only those found done, and it must not block.
+  */
+  int (*poll)(void* state, const int wait, int tile[4]);
+
+  /*
+  ** Wait for the timesteps and store the average velocity of timesteps
+  ** first to first+n-1. With params.deterministic every cell adds its
+  ** velocity in units of 1/EXACT_SCALE, truncated, to a 64-bit integer
+  ** sum, and the average is (float)((double)sum / EXACT_SCALE / cells).
+  */
+  void (*reduce)(void* state, const int first, const int n, float* av_vels);
+
+  /*
+  ** Wait for the timesteps and store the force on each obstacle label
+  ** over timesteps first to first+n-1: params.nlabels x, y pairs per
+  ** timestep, from the momentum exchanged by the cells bounced back.
+  */
+  void (*forces)(void* state, const int first, const int n, float* forces);
+
+  /* copy the lattice left by the last timestep back into cells, row-major */
+  void (*download)(void* state, t_speeds cells);
+
+  /* free everything allocate() created */
+  void (*release)(void* state);
+
+  /* print timings of the backend's own, may be NULL */
+  void (*report)(void* state);
+
+  /* STREAM triad bandwidth of the backend's device in GB/s */
+  double (*measure_peak)(void* state);
+
+  /*
+  ** The rest are for backends with more than one engine, and may all be
+  ** NULL. usage() lists options after the driver's own.
+  */
+  const char* options;
+
+  /* take a command line option the driver does not know, 0 if not one of the backend's either */
+  int (*option)(const char* arg);
+
+  /*
+  ** Take the name of the obstacle file as a geometry the backend builds
+  ** itself, 0 if it is a file. The obstacles uploaded are then all open,
+  ** and download() leaves the generated ones in their place.
+  */
+  int (*geometry)(const char* spec);
+
+  /*
+  ** Map cells itself, e.g. onto a file, for the driver to initialise and
+  ** upload, 0 to leave them to the driver; release() unmaps them.
+  */
+  int (*cells)(void* state, t_speeds* cells);
+
+  /*
+  ** The density and velocity of each of the nx*ny*nz cells of a 3D
+  ** lattice, which leaves cells alone. Without it params.nz must be 1.
+  */
+  void (*flow)(void* state, float* density, float* u_x, float* u_y, float* u_z);
+
+  /* change work from nx*ny*nz cell updates of cell_bytes each and no engine name */
+  void (*work)(void* state, t_work* work);
+} t_backend;
+
+/* the backends, each defined only when built in */
+extern const t_backend openmp_backend;
+extern const t_backend opencl_backend;
+extern const t_backend sycl_backend;
+
+/* utility functions of the driver */
+void die(const char* message, const int line, const char* file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LBM_H */
@@ -1,61 +1,44 @@
 /*
-** Code to implement a d2q9-bgk lattice boltzmann scheme.
-** 'd2' inidates a 2-dimensional grid, and
-** 'q9' indicates 9 velocities per grid cell.
-** 'bgk' refers to the Bhatnagar-Gross-Krook collision step.
+** OpenCL backend of the d2q9-bgk lattice boltzmann code: each timestep
+** is one launch of the propagate kernel in kernels.cl, which also sums
+** the velocity of each work-group into a record kept on the device, so
+** the average velocities are read back once at the end of the run.
+** The same sum flags work-groups that reach a non-finite or negative
+** density, and the first timestep and group to do so are kept in a
+** two-int watch buffer, read back without blocking by poll(). With
+** labelled obstacles each work-group also sums the momentum its blocked
+** cells take from their open neighbours into a force per label, kept on
+** the device beside the velocity sums for forces() to read back.
+** With --deterministic the velocities are summed in fixed point as well,
+** which reduce() adds up to the same bits for any work-group shape.
+** The collision operator of the parameter file, and its rates, are
+** compiled into the kernel as -D options, so the kernel has no branch
+** on it.
+** The host side, and the layout of the speeds, are those of the driver
+** in ../Driver. With --layout=tiled or morton the device keeps them in
+** tiles of LOCALSIZE by TILE_Y cells, laid out as those of the OpenMP
+** backend, and each work-group takes a row of a tile, the groups
+** sweeping the tiles in the order they are stored; the layout is
+** compiled in as well, and the cells are reordered on the host as they
+** are written and read back.
 **
-** The 'speeds' in each cell are numbered as follows:
+** The device is the first one listed unless the OCL_DEVICE environment
+** variable gives the index of another.
 **
-** 6 2 5
-**  \|/
-** 3-0-1
-**  /|\
-** 7 4 8
-**
-** A 2D grid:
-**
-**           cols
-**       --- --- ---
-**      | D | E | F |
-** rows  --- --- ---
-**      | A | B | C |
-**       --- --- ---
-**
-** 'unwrapped' in row major order to give a 1D array:
-**
-**  --- --- --- --- --- ---
-** | A | B | C | D | E | F |
-**  --- --- --- --- --- ---
-**
-** Grid indicies are:
-**
-**          ny
-**          ^       cols(ii)
-**          |  ----- ----- -----
-**          | | ... | ... | etc |
-**          |  ----- ----- -----
-** rows(jj) | | 1,0 | 1,1 | 1,2 |
-**          |  ----- ----- -----
-**          | | 0,0 | 0,1 | 0,2 |
-**          |  ----- ----- -----
-**          ----------------------> nx
-**
-** Note the names of the input parameter and obstacle files
-** are passed on the command line, e.g.:
-**
-**   ./d2q9-bgk input.params obstacles.dat
-**
-** Be sure to adjust the grid dimensions in the parameter file
-** if you choose a different obstacle file.
+** The built OpenCL program is cached in the directory named by the
+** OCL_CACHE_DIR environment variable (the current directory if unset,
+** no cache if empty), keyed on the device, the driver, the build
+** options and the kernel source, so later runs skip the JIT build.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
-#include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/time.h>
-#include <sys/resource.h>
+#include <mm_malloc.h>
 
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
@@ -63,24 +46,19 @@
 #include <CL/opencl.h>
 #endif
 
-#define NSPEEDS         9
+#include "lbm.h"
+
 #define LOCALSIZE       128
 #define LOCALSIZE2      1
-#define FINALSTATEFILE  "final_state.dat"
-#define AVVELSFILE      "av_vels.dat"
+#ifndef OCLFILE
 #define OCLFILE         "kernels.cl"
-
-/* struct to hold the parameter values */
-typedef struct
-{
-  int    nx;            /* no. of cells in x-direction */
-  int    ny;            /* no. of cells in y-direction */
-  int    maxIters;      /* no. of iterations */
-  int    reynolds_dim;  /* dimension for Reynolds number */
-  float density;       /* density per link */
-  float accel;         /* density redistribution */
-  float omega;         /* relaxation parameter */
-} t_param;
+#endif
+#define OCLOPTIONS      "-cl-fast-relaxed-math"
+#define OCLCACHEMAGIC   "D2Q9CLB1"
+#define OCLBATCH        256     /* timestep launches enqueued between flushes */
+#ifndef TILE_Y
+#define TILE_Y          32      /* rows of a tile, each row a work-group of LOCALSIZE cells */
+#endif
 
 /* struct to hold OpenCL objects */
 typedef struct
@@ -90,7 +68,7 @@ typedef struct
   cl_command_queue  queue;
 
   cl_program program;
-  cl_kernel  propagate;
+  cl_kernel  propagate[2];      /* one per parity: [0] reads speeds, [1] reads tmp_speeds */
 
   cl_mem speeds0;
   cl_mem speeds1;
@@ -112,625 +90,70 @@ typedef struct
   cl_mem tmp_speeds8;
   cl_mem partial_sum;
   cl_mem partial_sum2;
+  cl_mem partial_force;         /* per work-group force on each label of every timestep */
+  cl_mem partial_exact;         /* per work-group fixed-point velocity sum, with --deterministic */
 
   cl_mem obstacles;
+  cl_mem ring;                  /* two-slot ring holding the iteration index */
+  cl_mem watch;                 /* first unstable timestep and group in it, INT_MAX for none */
+  cl_mem tile_base;             /* first cell of each tile, NULL in rows */
+  cl_mem tile_groups;           /* first cell of the row of a tile each work-group takes, NULL in rows */
+  int*   groups;                /* tile_groups on the host */
+
+  t_param  params;
+  int      tt;                  /* no. of timesteps enqueued */
+  int      batches;             /* no. of batches enqueued */
+  cl_event batch_done[2];       /* completion of the last two batches */
+  cl_int   watch_read[2];       /* watch as read by watch_done */
+  cl_int   watch_seen[2];       /* watch as last found read */
+  cl_event watch_done;          /* completion of the read of the watch in flight */
+
+  double context_time;          /* time to select the device and set up the context and queue */
+  double build_time;            /* time to build the program and create the kernels */
+  double buffer_time;           /* time to create and fill the buffers */
+  double enqueue_time;          /* host time spent enqueueing timesteps */
+  const char* program_origin;   /* where the program came from: "cached binary" or "compiled" */
 } t_ocl;
 
-/* struct to hold the 'speed' values */
-typedef struct
-{
-  float speeds[NSPEEDS];
-} t_speed;
-
-typedef struct
-{
-  float* restrict s0 ;
-  float* restrict s1 ;
-  float* restrict s2 ;
-  float* restrict s3 ;
-  float* restrict s4 ;
-  float* restrict s5 ;
-  float* restrict s6 ;
-  float* restrict s7 ;
-  float* restrict s8 ;
-} t_speeds;
-
 /*
 ** function prototypes
 */
 
-/* load params, allocate memory, load obstacles & initialise fluid particle densities */
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr, t_ocl* ocl);
+/* create and build the OpenCL program with options, going through the binary cache */
+void loadProgram(t_ocl* ocl, const char* ocl_src, const char* options);
+
+/* set, once, every argument of the propagate kernel for one parity */
+void setPropagateArgs(cl_kernel kernel, const cl_mem* src, const cl_mem* dst,
+                      const t_param params, float densityaccel, int parity, t_ocl ocl);
 
 /*
-** The main calculation methods.
-** timestep calls, in order, the functions:
-** accelerate_flow(), propagate(), rebound() & collision()
+** lay the tiles of layout out, their first cells into base and the first
+** cell x + y*nx of each row of a tile, in the order they are stored,
+** into groups
 */
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels);
-
-/* finalise, including freeing up allocated memory */
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr, t_ocl ocl);
-
-/* Sum all the densities in the grid.
-** The total should remain constant from one timestep to the next. */
-float total_density(const t_param params, t_speed* cells);
-
-/* compute average velocity */
-float av_velocity(const t_param params, t_speed* cells, int* obstacles, t_ocl ocl);
-
-/* calculate Reynolds number */
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles, t_ocl ocl);
+static void place_tiles(const t_param params, const int layout, int* base, int* groups);
 
 /* utility functions */
+double wall_time(void);
 void checkError(cl_int err, const char *op, const int line);
-void die(const char* message, const int line, const char* file);
-void usage(const char* exe);
 
 cl_device_id selectOpenCLDevice();
 
-/*
-** main program:
-** initialise, timestep loop, finalise
-*/
-int main(int argc, char* argv[])
-{
-  char*    paramfile = NULL;    /* name of the input parameter file */
-  char*    obstaclefile = NULL; /* name of a the input obstacle file */
-  t_param  params;              /* struct to hold parameter values */
-  t_ocl    ocl;                 /* struct to hold OpenCL objects */
-  t_speed* cells     = NULL;    /* grid containing fluid densities */
-  t_speed* tmp_cells = NULL;    /* scratch space */
-  int*     obstacles = NULL;    /* grid indicating which cells are blocked */
-  float* av_vels   = NULL;     /* a record of the av. velocity computed for each timestep */
-  cl_int err;
-  struct timeval timstr;        /* structure to hold elapsed time */
-  struct rusage ru;             /* structure to hold CPU time--system and user */
-  double tic, toc;              /* floating point numbers to calculate elapsed wallclock time */
-  double usrtim;                /* floating point number to record elapsed user CPU time */
-  double systim;                /* floating point number to record elapsed system CPU time */
-
-  /* parse the command line */
-  if (argc != 3)
-  {
-    usage(argv[0]);
-  }
-  else
-  {
-    paramfile = argv[1];
-    obstaclefile = argv[2];
-  }
-
-/* initialise our data structures and load values from file */
-initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels, &ocl);
-
-t_speeds speeds;
-speeds.s0 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-speeds.s1 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-speeds.s2 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-speeds.s3 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-speeds.s4 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-speeds.s5 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-speeds.s6 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-speeds.s7 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-speeds.s8 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-t_speeds tmp_speeds;
-tmp_speeds.s0 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-tmp_speeds.s1 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-tmp_speeds.s2 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-tmp_speeds.s3 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-tmp_speeds.s4 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-tmp_speeds.s5 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-tmp_speeds.s6 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-tmp_speeds.s7 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-tmp_speeds.s8 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-
-/* loop over _all_ cells */
-for (int jj = 0; jj < params.ny; jj++)
-{
-  for (int ii = 0; ii < params.nx; ii++)
-  {
-    speeds.s0[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[0];
-    speeds.s1[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[1];
-    speeds.s2[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[2];
-    speeds.s3[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[3];
-    speeds.s4[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[4];
-    speeds.s5[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[5];
-    speeds.s6[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[6];
-    speeds.s7[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[7];
-    speeds.s8[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[8];
-    tmp_speeds.s0[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[0];
-    tmp_speeds.s1[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[1];
-    tmp_speeds.s2[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[2];
-    tmp_speeds.s3[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[3];
-    tmp_speeds.s4[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[4];
-    tmp_speeds.s5[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[5];
-    tmp_speeds.s6[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[6];
-    tmp_speeds.s7[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[7];
-    tmp_speeds.s8[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[8];
-  }
-}
-
-
-  // Write obstacles to OpenCL buffer
-  err = clEnqueueWriteBuffer(
-    ocl.queue, ocl.obstacles, CL_FALSE, 0,
-    sizeof(cl_int) * params.nx * params.ny, obstacles, 0, NULL, NULL);
-  checkError(err, "writing obstacles data", __LINE__);
-  // Write cells to device
-  err = clEnqueueWriteBuffer(
-    ocl.queue, ocl.speeds0, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s0, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueWriteBuffer(
-    ocl.queue, ocl.speeds1, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s1, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueWriteBuffer(
-    ocl.queue, ocl.speeds2, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s2, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueWriteBuffer(
-    ocl.queue, ocl.speeds3, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s3, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueWriteBuffer(
-    ocl.queue, ocl.speeds4, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s4, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueWriteBuffer(
-    ocl.queue, ocl.speeds5, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s5, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueWriteBuffer(
-    ocl.queue, ocl.speeds6, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s6, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueWriteBuffer(
-    ocl.queue, ocl.speeds7, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s7, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueWriteBuffer(
-    ocl.queue, ocl.speeds8, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s8, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-
-  float densityaccel = params.density*params.accel;
-
-    // Set kernel arguments
-  err = clSetKernelArg(ocl.propagate, 18, sizeof(cl_mem), &ocl.obstacles);
-  checkError(err, "setting propagate arg 2", __LINE__);
-  err = clSetKernelArg(ocl.propagate, 19, sizeof(cl_int), &params.nx);
-  checkError(err, "setting propagate arg 3", __LINE__);
-  err = clSetKernelArg(ocl.propagate, 20, sizeof(cl_int), &params.ny);
-  checkError(err, "setting propagate arg 4", __LINE__);
-  err = clSetKernelArg(ocl.propagate, 21, sizeof(cl_float), &params.omega);
-  checkError(err, "setting propagate arg 5", __LINE__);
-  err = clSetKernelArg(ocl.propagate, 22, sizeof(cl_float)*LOCALSIZE*LOCALSIZE2, NULL);
-  checkError(err, "setting propagate arg 6", __LINE__);
-  err = clSetKernelArg(ocl.propagate, 23, sizeof(cl_int)*LOCALSIZE*LOCALSIZE2, NULL);
-  checkError(err, "setting propagate arg 7", __LINE__);
-  err = clSetKernelArg(ocl.propagate, 24, sizeof(cl_mem), &ocl.partial_sum);
-  checkError(err, "setting propagate arg 8", __LINE__);
-  err = clSetKernelArg(ocl.propagate, 25, sizeof(cl_mem), &ocl.partial_sum2);
-  checkError(err, "setting propagate arg 9", __LINE__);
-  err = clSetKernelArg(ocl.propagate, 27, sizeof(cl_float), &densityaccel);
-  checkError(err, "setting accelerate_flow arg 4", __LINE__);
-
-
-  err = clFinish(ocl.queue);
-  checkError(err, "waiting for propagate kernel", __LINE__);
-
-  /* iterate for maxIters timesteps */
-  gettimeofday(&timstr, NULL);
-  tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
-
-  for (int tt = 0; tt < params.maxIters; tt++){
-      cl_int err;
-
-      // Set kernel arguments
-      if(tt%2==0){
-        err = clSetKernelArg(ocl.propagate, 0, sizeof(cl_mem), &ocl.speeds0);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 1, sizeof(cl_mem), &ocl.speeds1);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 2, sizeof(cl_mem), &ocl.speeds2);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 3, sizeof(cl_mem), &ocl.speeds3);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 4, sizeof(cl_mem), &ocl.speeds4);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 5, sizeof(cl_mem), &ocl.speeds5);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 6, sizeof(cl_mem), &ocl.speeds6);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 7, sizeof(cl_mem), &ocl.speeds7);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 8, sizeof(cl_mem), &ocl.speeds8);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 9, sizeof(cl_mem), &ocl.tmp_speeds0);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 10, sizeof(cl_mem), &ocl.tmp_speeds1);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 11, sizeof(cl_mem), &ocl.tmp_speeds2);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 12, sizeof(cl_mem), &ocl.tmp_speeds3);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 13, sizeof(cl_mem), &ocl.tmp_speeds4);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 14, sizeof(cl_mem), &ocl.tmp_speeds5);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 15, sizeof(cl_mem), &ocl.tmp_speeds6);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 16, sizeof(cl_mem), &ocl.tmp_speeds7);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 17, sizeof(cl_mem), &ocl.tmp_speeds8);
-        checkError(err, "setting propagate arg 1", __LINE__);
-      }else{
-        err = clSetKernelArg(ocl.propagate, 0, sizeof(cl_mem), &ocl.tmp_speeds0);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 1, sizeof(cl_mem), &ocl.tmp_speeds1);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 2, sizeof(cl_mem), &ocl.tmp_speeds2);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 3, sizeof(cl_mem), &ocl.tmp_speeds3);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 4, sizeof(cl_mem), &ocl.tmp_speeds4);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 5, sizeof(cl_mem), &ocl.tmp_speeds5);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 6, sizeof(cl_mem), &ocl.tmp_speeds6);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 7, sizeof(cl_mem), &ocl.tmp_speeds7);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 8, sizeof(cl_mem), &ocl.tmp_speeds8);
-        checkError(err, "setting propagate arg 0", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 9, sizeof(cl_mem), &ocl.speeds0);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 10, sizeof(cl_mem), &ocl.speeds1);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 11, sizeof(cl_mem), &ocl.speeds2);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 12, sizeof(cl_mem), &ocl.speeds3);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 13, sizeof(cl_mem), &ocl.speeds4);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 14, sizeof(cl_mem), &ocl.speeds5);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 15, sizeof(cl_mem), &ocl.speeds6);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 16, sizeof(cl_mem), &ocl.speeds7);
-        checkError(err, "setting propagate arg 1", __LINE__);
-        err = clSetKernelArg(ocl.propagate, 17, sizeof(cl_mem), &ocl.speeds8);
-        checkError(err, "setting propagate arg 1", __LINE__);
-      }
-      err = clSetKernelArg(ocl.propagate, 26, sizeof(cl_int), &tt);
-      checkError(err, "setting propagate arg 10", __LINE__);
-    //argiements set above
-
-
-      // Enqueue kernel
-      size_t global[2] = {params.nx, params.ny};
-      size_t local[2] = {LOCALSIZE,LOCALSIZE2};
-      err = clEnqueueNDRangeKernel(ocl.queue, ocl.propagate,
-                                   2, NULL, global, local, 0, NULL, NULL);
-      checkError(err, "enqueueing propagate kernel", __LINE__);
-  }
-
-  float * tot_up = _mm_malloc((params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2)*sizeof(float)*params.maxIters,64);
-  int * tot_cellsp = _mm_malloc((params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2)*sizeof(int)*params.maxIters,64);
-
-  err = clFinish(ocl.queue);
-  checkError(err, "writing for kernels to finish", __LINE__);
-
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.partial_sum, CL_FALSE, 0,
-    (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2)*sizeof(float)*params.maxIters, tot_up, 0, NULL, NULL);
-  checkError(err, "reading velo data", __LINE__);
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.partial_sum2, CL_FALSE, 0,
-    (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2)*sizeof(int)*params.maxIters, tot_cellsp, 0, NULL, NULL);
-  checkError(err, "reading velo2 data", __LINE__);
-  err = clFinish(ocl.queue);
-  checkError(err, "writing for reduction to come back", __LINE__);
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.tmp_speeds0, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s0, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.tmp_speeds1, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s1, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.tmp_speeds2, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s2, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.tmp_speeds3, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s3, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.tmp_speeds4, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s4, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.tmp_speeds5, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s5, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.tmp_speeds6, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s6, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.tmp_speeds7, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s7, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  err = clEnqueueReadBuffer(
-    ocl.queue, ocl.tmp_speeds8, CL_FALSE, 0,
-    sizeof(float) * (params.ny * params.nx), speeds.s8, 0, NULL, NULL);
-  checkError(err, "writing speed data", __LINE__);
-  float tot_u = 0;
-  int tot_cells = 0;
-  for (int tt = 0; tt < params.maxIters; tt++){
-    tot_u = 0;
-    tot_cells = 0;
-    for(int i = 0; i < params.nx/LOCALSIZE*params.ny/LOCALSIZE2; i++){
-      tot_u += tot_up[i+tt*params.nx/LOCALSIZE*params.ny/LOCALSIZE2];
-      tot_cells += tot_cellsp[i+tt*params.nx/LOCALSIZE*params.ny/LOCALSIZE2];
-    }
-    av_vels[tt] = tot_u/tot_cells;
-
-  }
-  // Wait for reads to finish
-  err = clFinish(ocl.queue);
-  checkError(err, "waiting for propagate kernel", __LINE__);
-
-  gettimeofday(&timstr, NULL);
-  toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
-  getrusage(RUSAGE_SELF, &ru);
-  timstr = ru.ru_utime;
-  usrtim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
-  timstr = ru.ru_stime;
-  systim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
-
-  /* loop over _all_ cells */
-  for (int jj = 0; jj < params.ny; jj++)
-  {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-    cells[ii + jj*params.nx].speeds[0] = speeds.s0[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[1] = speeds.s1[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[2] = speeds.s2[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[3] = speeds.s3[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[4] = speeds.s4[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[5] = speeds.s5[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[6] = speeds.s6[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[7] = speeds.s7[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[8] = speeds.s8[ii + jj*params.nx];
-    }
-  }
-
-
-  /* write final values and free memory */
-  printf("==done==\n");
-  printf("Reynolds number:\t\t%.12E\n", calc_reynolds(params, cells, obstacles, ocl));
-  printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
-  printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
-  printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
-  write_values(params, cells, obstacles, av_vels);
-  finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels, ocl);
-
-  return EXIT_SUCCESS;
-}
-
-
-float av_velocity(const t_param params, t_speed* cells, int* obstacles, t_ocl ocl)
+static void* opencl_allocate(const t_param params)
 {
-  int    tot_cells = 0;  /* no. of cells used in calculation */
-  float tot_u;          /* accumulated magnitudes of velocity for each cell */
-
-  /* initialise */
-  tot_u = 0.f;
-
-  /* loop over all non-blocked cells */
-  for (int jj = 0; jj < params.ny; jj++)
-  {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      /* ignore occupied cells */
-      if (!obstacles[ii + jj*params.nx])
-      {
-        /* local density total */
-        float local_density = 0.f;
-
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += cells[ii + jj*params.nx].speeds[kk];
-        }
-
-        /* x-component of velocity */
-        float u_x = (cells[ii + jj*params.nx].speeds[1]
-                      + cells[ii + jj*params.nx].speeds[5]
-                      + cells[ii + jj*params.nx].speeds[8]
-                      - (cells[ii + jj*params.nx].speeds[3]
-                         + cells[ii + jj*params.nx].speeds[6]
-                         + cells[ii + jj*params.nx].speeds[7]))
-                     / local_density;
-        /* compute y velocity component */
-        float u_y = (cells[ii + jj*params.nx].speeds[2]
-                      + cells[ii + jj*params.nx].speeds[5]
-                      + cells[ii + jj*params.nx].speeds[6]
-                      - (cells[ii + jj*params.nx].speeds[4]
-                         + cells[ii + jj*params.nx].speeds[7]
-                         + cells[ii + jj*params.nx].speeds[8]))
-                     / local_density;
-        /* accumulate the norm of x- and y- velocity components */
-        tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
-        /* increase counter of inspected cells */
-        ++tot_cells;
-      }
-    }
-  }
-
-  return tot_u / (float)tot_cells;
-}
-
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr, t_ocl *ocl){
   char   message[1024];  /* message buffer */
   FILE*   fp;            /* file pointer */
-  int    xx, yy;         /* generic array indices */
-  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
-  int    retval;         /* to hold return value for checking */
   char*  ocl_src;        /* OpenCL kernel source */
+  char   options[256];   /* build options, with the collision operator */
   long   ocl_size;       /* size of OpenCL kernel source */
+  t_ocl* ocl = calloc(1, sizeof(t_ocl));
 
-  /* open the parameter file */
-  fp = fopen(paramfile, "r");
-
-  if (fp == NULL)
-  {
-    sprintf(message, "could not open input parameter file: %s", paramfile);
-    die(message, __LINE__, __FILE__);
-  }
-  /* read in the parameter values */
-  retval = fscanf(fp, "%d\n", &(params->nx));
-
-  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->ny));
-
-  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->maxIters));
-
-  if (retval != 1) die("could not read param file: maxIters", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
-
-  if (retval != 1) die("could not read param file: reynolds_dim", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->density));
-
-  if (retval != 1) die("could not read param file: density", __LINE__, __FILE__);
+  if (ocl == NULL) die("cannot allocate memory for the OpenCL backend", __LINE__, __FILE__);
 
-  retval = fscanf(fp, "%f\n", &(params->accel));
-
-  if (retval != 1) die("could not read param file: accel", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->omega));
-
-  if (retval != 1) die("could not read param file: omega", __LINE__, __FILE__);
-
-  /* and close up the file */
-  fclose(fp);
-
-  /*
-  ** Allocate memory.
-  **
-  ** Remember C is pass-by-value, so we need to
-  ** pass pointers into the initialise function.
-  **
-  ** NB we are allocating a 1D array, so that the
-  ** memory will be contiguous.  We still want to
-  ** index this memory as if it were a (row major
-  ** ordered) 2D array, however.  We will perform
-  ** some arithmetic using the row and column
-  ** coordinates, inside the square brackets, when
-  ** we want to access elements of this array.
-  **
-  ** Note also that we are using a structure to
-  ** hold an array of 'speeds'.  We will allocate
-  ** a 1D array of these structs.
-  */
-
-  /* main grid */
-  *cells_ptr = (t_speed*)malloc(sizeof(t_speed) * (params->ny * params->nx));
-
-  if (*cells_ptr == NULL) die("cannot allocate memory for cells", __LINE__, __FILE__);
-
-  /* 'helper' grid, used as scratch space */
-  *tmp_cells_ptr = (t_speed*)malloc(sizeof(t_speed) * (params->ny * params->nx));
-
-  if (*tmp_cells_ptr == NULL) die("cannot allocate memory for tmp_cells", __LINE__, __FILE__);
-
-  /* the map of obstacles */
-  *obstacles_ptr = malloc(sizeof(int) * (params->ny * params->nx));
-
-  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
-
-  /* initialise densities */
-  float w0 = params->density * 4.f / 9.f;
-  float w1 = params->density      / 9.f;
-  float w2 = params->density      / 36.f;
-
-  for (int jj = 0; jj < params->ny; jj++)
-  {
-    for (int ii = 0; ii < params->nx; ii++)
-    {
-      /* centre */
-      (*cells_ptr)[ii + jj*params->nx].speeds[0] = w0;
-      /* axis directions */
-      (*cells_ptr)[ii + jj*params->nx].speeds[1] = w1;
-      (*cells_ptr)[ii + jj*params->nx].speeds[2] = w1;
-      (*cells_ptr)[ii + jj*params->nx].speeds[3] = w1;
-      (*cells_ptr)[ii + jj*params->nx].speeds[4] = w1;
-      /* diagonals */
-      (*cells_ptr)[ii + jj*params->nx].speeds[5] = w2;
-      (*cells_ptr)[ii + jj*params->nx].speeds[6] = w2;
-      (*cells_ptr)[ii + jj*params->nx].speeds[7] = w2;
-      (*cells_ptr)[ii + jj*params->nx].speeds[8] = w2;
-    }
-  }
-
-  /* first set all cells in obstacle array to zero */
-  for (int jj = 0; jj < params->ny; jj++)
-  {
-    for (int ii = 0; ii < params->nx; ii++)
-    {
-      (*obstacles_ptr)[ii + jj*params->nx] = 0;
-    }
-  }
-
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile, "r");
-
-  if (fp == NULL)
-  {
-    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
-    die(message, __LINE__, __FILE__);
-  }
-
-  /* read-in the blocked cells list */
-  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
-  {
-    /* some checks */
-    if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
-
-    if (xx < 0 || xx > params->nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
-
-    if (yy < 0 || yy > params->ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
-
-    if (blocked != 1) die("obstacle blocked value should be 1", __LINE__, __FILE__);
-
-    /* assign to array */
-    (*obstacles_ptr)[xx + yy*params->nx] = blocked;
-  }
-
-  /* and close the file */
-  fclose(fp);
-
-  /*
-  ** allocate space to hold a record of the avarage velocities computed
-  ** at each timestep
-  */
-  *av_vels_ptr = (float*)malloc(sizeof(float) * params->maxIters);
+  ocl->params = params;
 
   cl_int err;
+  double t0 = wall_time();
   ocl->device = selectOpenCLDevice();
 
   // Create OpenCL context
@@ -747,6 +170,8 @@ int initialise(const char* paramfile, const char* obstaclefile,
   // Create OpenCL command queue
   ocl->queue = clCreateCommandQueue(ocl->context, ocl->device, 0, &err);
   checkError(err, "creating command queue", __LINE__);
+  ocl->context_time = wall_time() - t0;
+  t0 = wall_time();
 
   // Load OpenCL kernel source
   fseek(fp, 0, SEEK_END);
@@ -757,279 +182,874 @@ int initialise(const char* paramfile, const char* obstaclefile,
   fread(ocl_src, 1, ocl_size, fp);
   fclose(fp);
 
-  // Create OpenCL program
-  ocl->program = clCreateProgramWithSource(
-    ocl->context, 1, (const char**)&ocl_src, NULL, &err);
+  // Create and build OpenCL program, with the collision operator and its rates compiled in
+  if (params.collision == COLLISION_BGK)
+    snprintf(options, sizeof(options), "%s -DCOLLISION=%d", OCLOPTIONS, params.collision);
+  else
+    snprintf(options, sizeof(options), "%s -DCOLLISION=%d -DOMEGA_ODD=%.9ef -DS_E=%.9ef -DS_EPS=%.9ef -DS_Q=%.9ef",
+             OCLOPTIONS, params.collision, params.omega_odd, params.s_e, params.s_eps, params.s_q);
+  if (params.layout != LAYOUT_ROWS)
+    snprintf(options + strlen(options), sizeof(options) - strlen(options), " -DLAYOUT=%d -DTILE_X=%d -DTILE_Y=%d",
+             params.layout, LOCALSIZE, TILE_Y);
+  loadProgram(ocl, ocl_src, options);
   free(ocl_src);
-  checkError(err, "creating program", __LINE__);
 
-  // Build OpenCL program
-  err = clBuildProgram(ocl->program, 1, &ocl->device, "-cl-fast-relaxed-math", NULL, NULL);
-  if (err == CL_BUILD_PROGRAM_FAILURE)
+  // Create OpenCL kernels
+  for (int parity = 0; parity < 2; parity++)
   {
-    size_t sz;
-    clGetProgramBuildInfo(
-      ocl->program, ocl->device,
-      CL_PROGRAM_BUILD_LOG, 0, NULL, &sz);
-    char *buildlog = malloc(sz);
-    clGetProgramBuildInfo(
-      ocl->program, ocl->device,
-      CL_PROGRAM_BUILD_LOG, sz, buildlog, NULL);
-    fprintf(stderr, "\nOpenCL build log:\n\n%s\n", buildlog);
-    free(buildlog);
+    ocl->propagate[parity] = clCreateKernel(ocl->program, "propagate", &err);
+    checkError(err, "creating propagate kernel", __LINE__);
   }
-  checkError(err, "building program", __LINE__);
-
-  // Create OpenCL kernels
-  ocl->propagate = clCreateKernel(ocl->program, "propagate", &err);
-  checkError(err, "creating propagate kernel", __LINE__);
+  ocl->build_time = wall_time() - t0;
+  t0 = wall_time();
 
   // Allocate OpenCL buffers
   ocl->speeds0 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->speeds1 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->speeds2 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->speeds3 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->speeds4 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->speeds5 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->speeds6 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->speeds7 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->speeds8 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->tmp_speeds0 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->tmp_speeds1 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->tmp_speeds2 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->tmp_speeds3 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->tmp_speeds4 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->tmp_speeds5 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->tmp_speeds6 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->tmp_speeds7 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->tmp_speeds8 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    params->nx * params->ny * sizeof(float), NULL, &err);
+    params.nx * params.ny * sizeof(float), NULL, &err);
   checkError(err, "creating cells buffer", __LINE__);
   ocl->partial_sum = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    (params->nx/LOCALSIZE)*(params->ny/LOCALSIZE2)*sizeof(float)*params->maxIters, NULL, &err);
+    (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2)*sizeof(float)*params.maxIters, NULL, &err);
   checkError(err, "creating partial buffer", __LINE__);
   ocl->partial_sum2 = clCreateBuffer(
     ocl->context, CL_MEM_READ_WRITE,
-    (params->nx/LOCALSIZE)*(params->ny/LOCALSIZE2)*sizeof(int)*params->maxIters, NULL, &err);
+    (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2)*sizeof(int)*params.maxIters, NULL, &err);
   checkError(err, "creating partial2 buffer", __LINE__);
+  ocl->partial_force = clCreateBuffer(
+    ocl->context, CL_MEM_READ_WRITE,
+    (params.nlabels > 0 ? (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2)*2*params.nlabels*params.maxIters : 1)*sizeof(float),
+    NULL, &err);
+  checkError(err, "creating partial force buffer", __LINE__);
+  ocl->partial_exact = clCreateBuffer(
+    ocl->context, CL_MEM_READ_WRITE,
+    (params.deterministic ? (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2)*params.maxIters : 1)*sizeof(cl_long),
+    NULL, &err);
+  checkError(err, "creating partial exact buffer", __LINE__);
 
   ocl->obstacles = clCreateBuffer(
     ocl->context, CL_MEM_READ_ONLY,
-    sizeof(cl_int) * params->nx * params->ny, NULL, &err);
+    sizeof(cl_int) * params.nx * params.ny, NULL, &err);
   checkError(err, "creating obstacles buffer", __LINE__);
 
-  return EXIT_SUCCESS;
+  ocl->ring = clCreateBuffer(
+    ocl->context, CL_MEM_READ_WRITE,
+    sizeof(cl_int) * 2, NULL, &err);
+  checkError(err, "creating ring buffer", __LINE__);
+
+  ocl->watch = clCreateBuffer(
+    ocl->context, CL_MEM_READ_WRITE,
+    sizeof(cl_int) * 2, NULL, &err);
+  checkError(err, "creating watch buffer", __LINE__);
+
+  if (params.layout != LAYOUT_ROWS)
+  {
+    const int groups = (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2);
+    const int ntiles = (params.nx/LOCALSIZE)*((params.ny + TILE_Y - 1)/TILE_Y);
+    int* base = malloc(sizeof(int) * ntiles);
+
+    ocl->groups = malloc(sizeof(int) * groups);
+    if (base == NULL || ocl->groups == NULL) die("cannot allocate memory for the tiles", __LINE__, __FILE__);
+
+    place_tiles(params, params.layout, base, ocl->groups);
+
+    ocl->tile_base = clCreateBuffer(
+      ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+      sizeof(cl_int) * ntiles, base, &err);
+    checkError(err, "creating tile base buffer", __LINE__);
+    ocl->tile_groups = clCreateBuffer(
+      ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+      sizeof(cl_int) * groups, ocl->groups, &err);
+    checkError(err, "creating tile groups buffer", __LINE__);
+    free(base);
+  }
+  ocl->buffer_time = wall_time() - t0;
+
+  const cl_mem speeds_mem[NSPEEDS] = {
+    ocl->speeds0, ocl->speeds1, ocl->speeds2, ocl->speeds3, ocl->speeds4,
+    ocl->speeds5, ocl->speeds6, ocl->speeds7, ocl->speeds8};
+  const cl_mem tmp_speeds_mem[NSPEEDS] = {
+    ocl->tmp_speeds0, ocl->tmp_speeds1, ocl->tmp_speeds2, ocl->tmp_speeds3, ocl->tmp_speeds4,
+    ocl->tmp_speeds5, ocl->tmp_speeds6, ocl->tmp_speeds7, ocl->tmp_speeds8};
+
+  float densityaccel = params.density*params.accel;
+
+  // Set kernel arguments: the kernels never change between timesteps
+  setPropagateArgs(ocl->propagate[0], speeds_mem, tmp_speeds_mem, params, densityaccel, 0, *ocl);
+  setPropagateArgs(ocl->propagate[1], tmp_speeds_mem, speeds_mem, params, densityaccel, 1, *ocl);
+
+  return ocl;
 }
 
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr, t_ocl ocl)
+static void opencl_upload(void* state, const t_speeds cells, const int* obstacles)
 {
-  /*
-  ** free up allocated memory
-  */
-  free(*cells_ptr);
-  *cells_ptr = NULL;
-
-  free(*tmp_cells_ptr);
-  *tmp_cells_ptr = NULL;
-
-  free(*obstacles_ptr);
-  *obstacles_ptr = NULL;
-
-  free(*av_vels_ptr);
-  *av_vels_ptr = NULL;
-
-
-  clReleaseMemObject(ocl.speeds0);
-  clReleaseMemObject(ocl.speeds1);
-  clReleaseMemObject(ocl.speeds2);
-  clReleaseMemObject(ocl.speeds3);
-  clReleaseMemObject(ocl.speeds4);
-  clReleaseMemObject(ocl.speeds5);
-  clReleaseMemObject(ocl.speeds6);
-  clReleaseMemObject(ocl.speeds7);
-  clReleaseMemObject(ocl.speeds8);
-  clReleaseMemObject(ocl.tmp_speeds0);
-  clReleaseMemObject(ocl.tmp_speeds1);
-  clReleaseMemObject(ocl.tmp_speeds2);
-  clReleaseMemObject(ocl.tmp_speeds3);
-  clReleaseMemObject(ocl.tmp_speeds4);
-  clReleaseMemObject(ocl.tmp_speeds5);
-  clReleaseMemObject(ocl.tmp_speeds6);
-  clReleaseMemObject(ocl.tmp_speeds7);
-  clReleaseMemObject(ocl.tmp_speeds8);
-  clReleaseMemObject(ocl.partial_sum);
-  clReleaseMemObject(ocl.partial_sum2);
-
-  clReleaseMemObject(ocl.obstacles);
-  clReleaseKernel(ocl.propagate);
-  clReleaseProgram(ocl.program);
-  clReleaseCommandQueue(ocl.queue);
-  clReleaseContext(ocl.context);
-
-  return EXIT_SUCCESS;
+  t_ocl* ocl = state;
+  const t_param params = ocl->params;
+  cl_int err;
+  double buffer_start = wall_time();
+
+  const int groups = (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2);
+  const cl_mem speeds_mem[NSPEEDS] = {
+    ocl->speeds0, ocl->speeds1, ocl->speeds2, ocl->speeds3, ocl->speeds4,
+    ocl->speeds5, ocl->speeds6, ocl->speeds7, ocl->speeds8};
+  const float* initial_speeds[NSPEEDS] = {
+    cells.s0, cells.s1, cells.s2, cells.s3, cells.s4,
+    cells.s5, cells.s6, cells.s7, cells.s8};
+  float* tiled = NULL;          /* the speeds in tiles, one plane after another */
+  int* tiled_obstacles = NULL;
+
+  // In tiles the cells of work-group g are those of its row of a tile
+  if (params.layout != LAYOUT_ROWS){
+    tiled = malloc(sizeof(float) * NSPEEDS * params.nx * params.ny);
+    tiled_obstacles = malloc(sizeof(int) * params.nx * params.ny);
+    if (tiled == NULL || tiled_obstacles == NULL) die("cannot allocate memory for the tiles", __LINE__, __FILE__);
+
+    for (int g = 0; g < groups; g++){
+      for (int l = 0; l < LOCALSIZE; l++){
+        for (int kk = 0; kk < NSPEEDS; kk++)
+          tiled[kk*params.nx*params.ny + g*LOCALSIZE + l] = initial_speeds[kk][ocl->groups[g] + l];
+        tiled_obstacles[g*LOCALSIZE + l] = obstacles[ocl->groups[g] + l];
+      }
+    }
+    for (int kk = 0; kk < NSPEEDS; kk++) initial_speeds[kk] = tiled + kk*params.nx*params.ny;
+    obstacles = tiled_obstacles;
+  }
+
+  // Write obstacles to OpenCL buffer
+  err = clEnqueueWriteBuffer(
+    ocl->queue, ocl->obstacles, CL_FALSE, 0,
+    sizeof(cl_int) * params.nx * params.ny, obstacles, 0, NULL, NULL);
+  checkError(err, "writing obstacles data", __LINE__);
+  // Write cells to device
+  for (int kk = 0; kk < NSPEEDS; kk++){
+    err = clEnqueueWriteBuffer(
+      ocl->queue, speeds_mem[kk], CL_FALSE, 0,
+      sizeof(float) * (params.ny * params.nx), initial_speeds[kk], 0, NULL, NULL);
+    checkError(err, "writing speed data", __LINE__);
+  }
+
+  // Start the iteration index ring at zero
+  const cl_int ring_start[2] = {0, 0};
+  err = clEnqueueWriteBuffer(
+    ocl->queue, ocl->ring, CL_FALSE, 0,
+    sizeof(ring_start), ring_start, 0, NULL, NULL);
+  checkError(err, "writing ring data", __LINE__);
+
+  // Nothing unstable yet
+  ocl->watch_seen[0] = ocl->watch_seen[1] = INT_MAX;
+  err = clEnqueueWriteBuffer(
+    ocl->queue, ocl->watch, CL_FALSE, 0,
+    sizeof(ocl->watch_seen), ocl->watch_seen, 0, NULL, NULL);
+  checkError(err, "writing watch data", __LINE__);
+
+  // The host arrays may go as soon as this returns
+  err = clFinish(ocl->queue);
+  checkError(err, "waiting for buffer writes", __LINE__);
+  free(tiled);
+  free(tiled_obstacles);
+  ocl->buffer_time += wall_time() - buffer_start;
+  ocl->tt = 0;
 }
 
+static void opencl_step_batch(void* state, const int first, const int n)
+{
+  t_ocl* ocl = state;
+  cl_int err;
+  size_t global[2] = {ocl->params.nx, ocl->params.ny};
+  size_t local[2] = {LOCALSIZE,LOCALSIZE2};
+  const int slot = ocl->batches % 2;
+
+  // Keep at most two batches in flight: wait for the one before last
+  if (ocl->batch_done[slot] != NULL){
+    err = clWaitForEvents(1, &ocl->batch_done[slot]);
+    checkError(err, "waiting for propagate batch", __LINE__);
+    clReleaseEvent(ocl->batch_done[slot]);
+    ocl->batch_done[slot] = NULL;
+  }
+
+  double enqueue_start = wall_time();
+
+  // Enqueue kernels, the last of the batch signalling its completion
+  for (int t = first; t < first + n; t++){
+    err = clEnqueueNDRangeKernel(ocl->queue, ocl->propagate[t % 2],
+                                 2, NULL, global, local, 0, NULL,
+                                 (t == first + n - 1) ? &ocl->batch_done[slot] : NULL);
+    checkError(err, "enqueueing propagate kernel", __LINE__);
+  }
+  err = clFlush(ocl->queue);
+  checkError(err, "flushing propagate batch", __LINE__);
+
+  ocl->enqueue_time += wall_time() - enqueue_start;
+  ocl->batches++;
+  ocl->tt = first + n;
+}
+
+static void opencl_finish(void* state)
+{
+  t_ocl* ocl = state;
+  cl_int err;
+
+  err = clFinish(ocl->queue);
+  checkError(err, "waiting for propagate batches", __LINE__);
 
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles, t_ocl ocl)
+  for (int slot = 0; slot < 2; slot++){
+    if (ocl->batch_done[slot] != NULL) clReleaseEvent(ocl->batch_done[slot]);
+    ocl->batch_done[slot] = NULL;
+  }
+}
+
+static int opencl_poll(void* state, const int wait, int tile[4])
 {
-  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+  t_ocl* ocl = state;
+  cl_int err;
+  cl_int status = CL_COMPLETE;
+
+  // Take in the read in flight if it is back, or whatever it is with wait
+  if (ocl->watch_done != NULL){
+    if (!wait){
+      err = clGetEventInfo(ocl->watch_done, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                           sizeof(status), &status, NULL);
+      checkError(err, "querying watch read", __LINE__);
+      checkError(status < 0 ? status : CL_SUCCESS, "reading watch data", __LINE__);
+    }
+    if (status == CL_COMPLETE){
+      err = clWaitForEvents(1, &ocl->watch_done);
+      checkError(err, "waiting for watch read", __LINE__);
+      clReleaseEvent(ocl->watch_done);
+      ocl->watch_done = NULL;
+      ocl->watch_seen[0] = ocl->watch_read[0];
+      ocl->watch_seen[1] = ocl->watch_read[1];
+    }
+  }
+
+  // The reads queue behind the timesteps enqueued so far
+  if (wait){
+    err = clEnqueueReadBuffer(
+      ocl->queue, ocl->watch, CL_TRUE, 0,
+      sizeof(ocl->watch_seen), ocl->watch_seen, 0, NULL, NULL);
+    checkError(err, "reading watch data", __LINE__);
+  }
+  else if (ocl->watch_done == NULL){
+    err = clEnqueueReadBuffer(
+      ocl->queue, ocl->watch, CL_FALSE, 0,
+      sizeof(ocl->watch_read), ocl->watch_read, 0, NULL, &ocl->watch_done);
+    checkError(err, "reading watch data", __LINE__);
+    err = clFlush(ocl->queue);
+    checkError(err, "flushing watch read", __LINE__);
+  }
+
+  if (ocl->watch_seen[0] == INT_MAX) return -1;
 
-  return av_velocity(params, cells, obstacles, ocl) * params.reynolds_dim / viscosity;
+  // In tiles a work-group takes the row of a tile its entry of groups names
+  if (ocl->params.layout != LAYOUT_ROWS){
+    tile[0] = ocl->groups[ocl->watch_seen[1]] % ocl->params.nx;
+    tile[1] = ocl->groups[ocl->watch_seen[1]] / ocl->params.nx;
+    tile[2] = tile[0] + LOCALSIZE - 1;
+    tile[3] = tile[1];
+
+    return ocl->watch_seen[0];
+  }
+
+  const int gx = ocl->watch_seen[1] % (ocl->params.nx/LOCALSIZE);
+  const int gy = ocl->watch_seen[1] / (ocl->params.nx/LOCALSIZE);
+  tile[0] = gx * LOCALSIZE;
+  tile[1] = gy * LOCALSIZE2;
+  tile[2] = tile[0] + LOCALSIZE - 1;
+  tile[3] = tile[1] + LOCALSIZE2 - 1;
+
+  return ocl->watch_seen[0];
 }
 
-float total_density(const t_param params, t_speed* cells)
+static void opencl_reduce(void* state, const int first, const int n, float* av_vels)
 {
-  float total = 0.f;  /* accumulator */
+  t_ocl* ocl = state;
+  const t_param params = ocl->params;
+  const int groups = (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2);
+  cl_int err;
 
-  for (int jj = 0; jj < params.ny; jj++)
-  {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      for (int kk = 0; kk < NSPEEDS; kk++)
-      {
-        total += cells[ii + jj*params.nx].speeds[kk];
-      }
+  float * tot_up = _mm_malloc(groups*sizeof(float)*n,64);
+  int * tot_cellsp = _mm_malloc(groups*sizeof(int)*n,64);
+  cl_long * tot_exactp = _mm_malloc(groups*sizeof(cl_long)*n,64);
+
+  // The reads queue behind the timesteps still running
+  err = clEnqueueReadBuffer(
+    ocl->queue, ocl->partial_sum, CL_FALSE, groups*sizeof(float)*first,
+    groups*sizeof(float)*n, tot_up, 0, NULL, NULL);
+  checkError(err, "reading velo data", __LINE__);
+  err = clEnqueueReadBuffer(
+    ocl->queue, ocl->partial_sum2, CL_FALSE, groups*sizeof(int)*first,
+    groups*sizeof(int)*n, tot_cellsp, 0, NULL, NULL);
+  checkError(err, "reading velo2 data", __LINE__);
+  if (params.deterministic){
+    err = clEnqueueReadBuffer(
+      ocl->queue, ocl->partial_exact, CL_FALSE, groups*sizeof(cl_long)*first,
+      groups*sizeof(cl_long)*n, tot_exactp, 0, NULL, NULL);
+    checkError(err, "reading exact velo data", __LINE__);
+  }
+  err = clFinish(ocl->queue);
+  checkError(err, "writing for reduction to come back", __LINE__);
+
+  for (int slot = 0; slot < 2; slot++){
+    if (ocl->batch_done[slot] != NULL) clReleaseEvent(ocl->batch_done[slot]);
+    ocl->batch_done[slot] = NULL;
+  }
+
+  float tot_u = 0;
+  int tot_cells = 0;
+  for (int tt = 0; tt < n; tt++){
+    tot_u = 0;
+    tot_cells = 0;
+    for(int i = 0; i < groups; i++){
+      tot_u += tot_up[i+tt*groups];
+      tot_cells += tot_cellsp[i+tt*groups];
+    }
+    av_vels[first + tt] = tot_u/tot_cells;
+
+    /* integer sums, in any order the same */
+    if (params.deterministic){
+      cl_long tot_exact = 0;
+      for(int i = 0; i < groups; i++) tot_exact += tot_exactp[i+tt*groups];
+      av_vels[first + tt] = (float)((double)tot_exact / EXACT_SCALE / tot_cells);
+    }
+  }
+
+  _mm_free(tot_up);
+  _mm_free(tot_cellsp);
+  _mm_free(tot_exactp);
+}
+
+static void opencl_forces(void* state, const int first, const int n, float* forces)
+{
+  t_ocl* ocl = state;
+  const t_param params = ocl->params;
+  const int groups = (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2);
+  const int pairs = params.nlabels;
+  cl_int err;
+
+  float * forcesp = _mm_malloc(groups*2*pairs*sizeof(float)*n,64);
+
+  // The read queues behind the timesteps still running
+  err = clEnqueueReadBuffer(
+    ocl->queue, ocl->partial_force, CL_TRUE, groups*2*pairs*sizeof(float)*first,
+    groups*2*pairs*sizeof(float)*n, forcesp, 0, NULL, NULL);
+  checkError(err, "reading force data", __LINE__);
+
+  for (int tt = 0; tt < n; tt++){
+    for (int l = 0; l < 2*pairs; l++){
+      float force = 0;
+      for(int i = 0; i < groups; i++)
+        force += forcesp[(i+tt*groups)*2*pairs + l];
+      forces[(first + tt)*2*pairs + l] = force;
     }
   }
 
-  return total;
+  _mm_free(forcesp);
 }
 
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels)
+static void opencl_download(void* state, t_speeds cells)
 {
-  FILE* fp;                     /* file pointer */
-  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
-  float local_density;         /* per grid cell sum of densities */
-  float pressure;              /* fluid pressure in grid cell */
-  float u_x;                   /* x-component of velocity in grid cell */
-  float u_y;                   /* y-component of velocity in grid cell */
-  float u;                     /* norm--root of summed squares--of u_x and u_y */
+  t_ocl* ocl = state;
+  const t_param params = ocl->params;
+  cl_int err;
 
-  fp = fopen(FINALSTATEFILE, "w");
+  // Read back the buffers written by the last timestep
+  const cl_mem speeds_mem[NSPEEDS] = {
+    ocl->speeds0, ocl->speeds1, ocl->speeds2, ocl->speeds3, ocl->speeds4,
+    ocl->speeds5, ocl->speeds6, ocl->speeds7, ocl->speeds8};
+  const cl_mem tmp_speeds_mem[NSPEEDS] = {
+    ocl->tmp_speeds0, ocl->tmp_speeds1, ocl->tmp_speeds2, ocl->tmp_speeds3, ocl->tmp_speeds4,
+    ocl->tmp_speeds5, ocl->tmp_speeds6, ocl->tmp_speeds7, ocl->tmp_speeds8};
+  const cl_mem* final_mem = (ocl->tt % 2) ? tmp_speeds_mem : speeds_mem;
+  float* const final_speeds[NSPEEDS] = {
+    cells.s0, cells.s1, cells.s2, cells.s3, cells.s4,
+    cells.s5, cells.s6, cells.s7, cells.s8};
+  float* tiled = NULL;          /* the speeds in tiles, one plane after another */
+
+  if (params.layout != LAYOUT_ROWS){
+    tiled = malloc(sizeof(float) * NSPEEDS * params.nx * params.ny);
+    if (tiled == NULL) die("cannot allocate memory for the tiles", __LINE__, __FILE__);
+  }
 
-  if (fp == NULL)
+  for (int kk = 0; kk < NSPEEDS; kk++){
+    err = clEnqueueReadBuffer(
+      ocl->queue, final_mem[kk], CL_FALSE, 0,
+      sizeof(float) * (params.ny * params.nx), tiled ? tiled + kk*params.nx*params.ny : final_speeds[kk],
+      0, NULL, NULL);
+    checkError(err, "reading speed data", __LINE__);
+  }
+
+  // Wait for reads to finish
+  err = clFinish(ocl->queue);
+  checkError(err, "waiting for speed data", __LINE__);
+
+  // and put the rows of the tiles back in place
+  if (tiled != NULL){
+    const int groups = (params.nx/LOCALSIZE)*(params.ny/LOCALSIZE2);
+
+    for (int g = 0; g < groups; g++)
+      for (int l = 0; l < LOCALSIZE; l++)
+        for (int kk = 0; kk < NSPEEDS; kk++)
+          final_speeds[kk][ocl->groups[g] + l] = tiled[kk*params.nx*params.ny + g*LOCALSIZE + l];
+
+    free(tiled);
+  }
+}
+
+static void opencl_release(void* state)
+{
+  t_ocl* ocl = state;
+
+  for (int slot = 0; slot < 2; slot++)
+    if (ocl->batch_done[slot] != NULL) clReleaseEvent(ocl->batch_done[slot]);
+  if (ocl->watch_done != NULL) clReleaseEvent(ocl->watch_done);
+
+  clReleaseMemObject(ocl->speeds0);
+  clReleaseMemObject(ocl->speeds1);
+  clReleaseMemObject(ocl->speeds2);
+  clReleaseMemObject(ocl->speeds3);
+  clReleaseMemObject(ocl->speeds4);
+  clReleaseMemObject(ocl->speeds5);
+  clReleaseMemObject(ocl->speeds6);
+  clReleaseMemObject(ocl->speeds7);
+  clReleaseMemObject(ocl->speeds8);
+  clReleaseMemObject(ocl->tmp_speeds0);
+  clReleaseMemObject(ocl->tmp_speeds1);
+  clReleaseMemObject(ocl->tmp_speeds2);
+  clReleaseMemObject(ocl->tmp_speeds3);
+  clReleaseMemObject(ocl->tmp_speeds4);
+  clReleaseMemObject(ocl->tmp_speeds5);
+  clReleaseMemObject(ocl->tmp_speeds6);
+  clReleaseMemObject(ocl->tmp_speeds7);
+  clReleaseMemObject(ocl->tmp_speeds8);
+  clReleaseMemObject(ocl->partial_sum);
+  clReleaseMemObject(ocl->partial_sum2);
+  clReleaseMemObject(ocl->partial_force);
+  clReleaseMemObject(ocl->partial_exact);
+
+  clReleaseMemObject(ocl->obstacles);
+  clReleaseMemObject(ocl->ring);
+  clReleaseMemObject(ocl->watch);
+  if (ocl->tile_base != NULL) clReleaseMemObject(ocl->tile_base);
+  if (ocl->tile_groups != NULL) clReleaseMemObject(ocl->tile_groups);
+  free(ocl->groups);
+  clReleaseKernel(ocl->propagate[0]);
+  clReleaseKernel(ocl->propagate[1]);
+  clReleaseProgram(ocl->program);
+  clReleaseCommandQueue(ocl->queue);
+  clReleaseContext(ocl->context);
+
+  free(ocl);
+}
+
+static void opencl_report(void* state)
+{
+  t_ocl* ocl = state;
+
+  printf("Context setup time:\t\t%.6lf (s)\n", ocl->context_time);
+  printf("Program build time:\t\t%.6lf (s) (%s)\n", ocl->build_time, ocl->program_origin);
+  printf("Buffer setup time:\t\t%.6lf (s)\n", ocl->buffer_time);
+  printf("Host enqueue time:\t\t%.6lf (s) (%.3lf us/iteration)\n",
+         ocl->enqueue_time, 1e6 * ocl->enqueue_time / ocl->tt);
+}
+
+static double opencl_measure_peak(void* state)
+{
+  t_ocl* ocl = state;
+  cl_int err;
+  const size_t size = sizeof(float) * TRIAD_SIZE;
+  const size_t global = TRIAD_SIZE;
+  const cl_float scalar = 3.f;
+  double best = 0.0;
+
+  cl_kernel triad = clCreateKernel(ocl->program, "triad", &err);
+  checkError(err, "creating triad kernel", __LINE__);
+
+  float* init = malloc(size);
+  if (init == NULL) die("cannot allocate memory for the STREAM triad", __LINE__, __FILE__);
+  for (int i = 0; i < TRIAD_SIZE; i++) init[i] = 1.f;
+
+  cl_mem a = clCreateBuffer(ocl->context, CL_MEM_READ_WRITE, size, NULL, &err);
+  checkError(err, "creating triad buffer", __LINE__);
+  cl_mem b = clCreateBuffer(ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, init, &err);
+  checkError(err, "creating triad buffer", __LINE__);
+  cl_mem c = clCreateBuffer(ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, init, &err);
+  checkError(err, "creating triad buffer", __LINE__);
+  free(init);
+
+  err  = clSetKernelArg(triad, 0, sizeof(cl_mem), &a);
+  err |= clSetKernelArg(triad, 1, sizeof(cl_mem), &b);
+  err |= clSetKernelArg(triad, 2, sizeof(cl_mem), &c);
+  err |= clSetKernelArg(triad, 3, sizeof(cl_float), &scalar);
+  checkError(err, "setting triad args", __LINE__);
+
+  // The first pass also moves the buffers onto the device, so is not timed
+  for (int r = -1; r < TRIAD_REPEATS; r++)
+  {
+    const double t0 = wall_time();
+
+    err = clEnqueueNDRangeKernel(ocl->queue, triad, 1, NULL, &global, NULL, 0, NULL, NULL);
+    checkError(err, "enqueueing triad kernel", __LINE__);
+    err = clFinish(ocl->queue);
+    checkError(err, "waiting for triad kernel", __LINE__);
+
+    const double t = wall_time() - t0;
+    if (r >= 0 && t > 0.0 && 3.0 * size / t > best) best = 3.0 * size / t;
+  }
+
+  clReleaseMemObject(a);
+  clReleaseMemObject(b);
+  clReleaseMemObject(c);
+  clReleaseKernel(triad);
+
+  return best / 1e9;
+}
+
+const t_backend opencl_backend = {
+  "opencl",
+  OCLBATCH,
+  2*NSPEEDS*sizeof(float) + sizeof(int),  /* read and write the speeds, read the obstacle */
+  opencl_allocate,
+  opencl_upload,
+  opencl_step_batch,
+  opencl_finish,
+  opencl_poll,
+  opencl_reduce,
+  opencl_forces,
+  opencl_download,
+  opencl_release,
+  opencl_report,
+  opencl_measure_peak,
+  NULL, NULL, NULL, NULL, NULL, NULL  /* one engine only */
+};
+
+/* FNV-1a hash of len bytes, continuing from h */
+static uint64_t hashBytes(uint64_t h, const void* data, size_t len)
+{
+  const unsigned char* bytes = data;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= bytes[i];
+    h *= 1099511628211ULL;
+  }
+
+  return h;
+}
+
+/* the binary cached under key at path, or NULL if there is none */
+static unsigned char* readCachedBinary(const char* path, uint64_t key, size_t* size)
+{
+  char     magic[8];
+  uint64_t file_key;
+  FILE*    fp = fopen(path, "rb");
+
+  if (fp == NULL) return NULL;
+
+  if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, OCLCACHEMAGIC, sizeof(magic)) != 0
+      || fread(&file_key, sizeof(file_key), 1, fp) != 1 || file_key != key
+      || fread(size, sizeof(*size), 1, fp) != 1 || *size == 0)
+  {
+    fclose(fp);
+    return NULL;
+  }
+
+  unsigned char* binary = malloc(*size);
+
+  if (binary == NULL || fread(binary, 1, *size, fp) != *size)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    free(binary);
+    binary = NULL;
   }
 
-  for (int jj = 0; jj < params.ny; jj++)
+  fclose(fp);
+
+  return binary;
+}
+
+/*
+** Store the binary of a built program under key at path. It is written
+** to a private file first and renamed into place, so runs sharing the
+** cache never see half a binary. Failing to cache is not an error.
+*/
+static void writeCachedBinary(const char* path, uint64_t key, cl_program program)
+{
+  char   tmp_path[1100];
+  size_t size = 0;
+
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+    return;
+
+  unsigned char* binary = malloc(size);
+
+  if (binary == NULL) return;
+
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) == CL_SUCCESS)
   {
-    for (int ii = 0; ii < params.nx; ii++)
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+    FILE* fp = fopen(tmp_path, "wb");
+
+    if (fp != NULL)
     {
-      /* an occupied cell */
-      if (obstacles[ii + jj*params.nx])
+      int ok = fwrite(OCLCACHEMAGIC, 1, 8, fp) == 8 && fwrite(&key, sizeof(key), 1, fp) == 1
+               && fwrite(&size, sizeof(size), 1, fp) == 1 && fwrite(binary, 1, size, fp) == size;
+
+      if (fclose(fp) != 0 || !ok || rename(tmp_path, path) != 0)
       {
-        u_x = u_y = u = 0.f;
-        pressure = params.density * c_sq;
+        remove(tmp_path);
+        fprintf(stderr, "could not write OpenCL binary cache: %s\n", path);
       }
-      /* no obstacle */
-      else
-      {
-        local_density = 0.f;
+    }
+  }
 
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += cells[ii + jj*params.nx].speeds[kk];
-        }
-
-        /* compute x velocity component */
-        u_x = (cells[ii + jj*params.nx].speeds[1]
-               + cells[ii + jj*params.nx].speeds[5]
-               + cells[ii + jj*params.nx].speeds[8]
-               - (cells[ii + jj*params.nx].speeds[3]
-                  + cells[ii + jj*params.nx].speeds[6]
-                  + cells[ii + jj*params.nx].speeds[7]))
-              / local_density;
-        /* compute y velocity component */
-        u_y = (cells[ii + jj*params.nx].speeds[2]
-               + cells[ii + jj*params.nx].speeds[5]
-               + cells[ii + jj*params.nx].speeds[6]
-               - (cells[ii + jj*params.nx].speeds[4]
-                  + cells[ii + jj*params.nx].speeds[7]
-                  + cells[ii + jj*params.nx].speeds[8]))
-              / local_density;
-        /* compute norm of velocity */
-        u = sqrtf((u_x * u_x) + (u_y * u_y));
-        /* compute pressure */
-        pressure = local_density * c_sq;
-      }
+  free(binary);
+}
+
+void loadProgram(t_ocl* ocl, const char* ocl_src, const char* options)
+{
+  cl_int err;
+  char   info[1024];
+  char   path[1024] = "";
+  uint64_t key = 14695981039346656037ULL;
+
+  /* the cache key: device, driver, build options and kernel source */
+  clGetDeviceInfo(ocl->device, CL_DEVICE_NAME, sizeof(info), info, NULL);
+  key = hashBytes(key, info, strlen(info) + 1);
+  clGetDeviceInfo(ocl->device, CL_DRIVER_VERSION, sizeof(info), info, NULL);
+  key = hashBytes(key, info, strlen(info) + 1);
+  clGetDeviceInfo(ocl->device, CL_DEVICE_VERSION, sizeof(info), info, NULL);
+  key = hashBytes(key, info, strlen(info) + 1);
+  key = hashBytes(key, options, strlen(options) + 1);
+  key = hashBytes(key, ocl_src, strlen(ocl_src));
+
+  const char* dir = getenv("OCL_CACHE_DIR");
+  if (dir == NULL) dir = ".";
+  if (*dir != '\0')
+    snprintf(path, sizeof(path), "%s/d2q9-bgk-%016llx.clbin", dir, (unsigned long long)key);
+
+  size_t size;
+  unsigned char* binary = (*path != '\0') ? readCachedBinary(path, key, &size) : NULL;
+
+  if (binary != NULL)
+  {
+    cl_int status = CL_SUCCESS;
+
+    ocl->program = clCreateProgramWithBinary(ocl->context, 1, &ocl->device, &size,
+                                             (const unsigned char**)&binary, &status, &err);
+    free(binary);
 
-      /* write to file */
-      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, u_x, u_y, u, pressure, obstacles[ii * params.nx + jj]);
+    if (err == CL_SUCCESS && status == CL_SUCCESS)
+    {
+      err = clBuildProgram(ocl->program, 1, &ocl->device, options, NULL, NULL);
+
+      if (err == CL_SUCCESS)
+      {
+        ocl->program_origin = "cached binary";
+        return;
+      }
     }
+
+    /* a binary the driver no longer accepts is rebuilt from source */
+    if (ocl->program != NULL) clReleaseProgram(ocl->program);
   }
 
-  fclose(fp);
+  // Create OpenCL program
+  ocl->program = clCreateProgramWithSource(
+    ocl->context, 1, &ocl_src, NULL, &err);
+  checkError(err, "creating program", __LINE__);
 
-  fp = fopen(AVVELSFILE, "w");
+  // Build OpenCL program
+  err = clBuildProgram(ocl->program, 1, &ocl->device, options, NULL, NULL);
+  if (err == CL_BUILD_PROGRAM_FAILURE)
+  {
+    size_t sz;
+    clGetProgramBuildInfo(
+      ocl->program, ocl->device,
+      CL_PROGRAM_BUILD_LOG, 0, NULL, &sz);
+    char *buildlog = malloc(sz);
+    clGetProgramBuildInfo(
+      ocl->program, ocl->device,
+      CL_PROGRAM_BUILD_LOG, sz, buildlog, NULL);
+    fprintf(stderr, "\nOpenCL build log:\n\n%s\n", buildlog);
+    free(buildlog);
+  }
+  checkError(err, "building program", __LINE__);
 
-  if (fp == NULL)
+  if (*path != '\0') writeCachedBinary(path, key, ocl->program);
+
+  ocl->program_origin = "compiled";
+}
+
+void setPropagateArgs(cl_kernel kernel, const cl_mem* src, const cl_mem* dst,
+                      const t_param params, float densityaccel, int parity, t_ocl ocl)
+{
+  cl_int err;
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    err = clSetKernelArg(kernel, kk, sizeof(cl_mem), &src[kk]);
+    checkError(err, "setting propagate arg 0", __LINE__);
+    err = clSetKernelArg(kernel, NSPEEDS + kk, sizeof(cl_mem), &dst[kk]);
+    checkError(err, "setting propagate arg 1", __LINE__);
   }
+  err = clSetKernelArg(kernel, 18, sizeof(cl_mem), &ocl.obstacles);
+  checkError(err, "setting propagate arg 2", __LINE__);
+  err = clSetKernelArg(kernel, 19, sizeof(cl_int), &params.nx);
+  checkError(err, "setting propagate arg 3", __LINE__);
+  err = clSetKernelArg(kernel, 20, sizeof(cl_int), &params.ny);
+  checkError(err, "setting propagate arg 4", __LINE__);
+  err = clSetKernelArg(kernel, 21, sizeof(cl_float), &params.omega);
+  checkError(err, "setting propagate arg 5", __LINE__);
+  err = clSetKernelArg(kernel, 22, sizeof(cl_float)*LOCALSIZE*LOCALSIZE2, NULL);
+  checkError(err, "setting propagate arg 6", __LINE__);
+  err = clSetKernelArg(kernel, 23, sizeof(cl_int)*LOCALSIZE*LOCALSIZE2, NULL);
+  checkError(err, "setting propagate arg 7", __LINE__);
+  err = clSetKernelArg(kernel, 24, sizeof(cl_mem), &ocl.partial_sum);
+  checkError(err, "setting propagate arg 8", __LINE__);
+  err = clSetKernelArg(kernel, 25, sizeof(cl_mem), &ocl.partial_sum2);
+  checkError(err, "setting propagate arg 9", __LINE__);
+  err = clSetKernelArg(kernel, 26, sizeof(cl_mem), &ocl.ring);
+  checkError(err, "setting propagate arg 10", __LINE__);
+  err = clSetKernelArg(kernel, 27, sizeof(cl_float), &densityaccel);
+  checkError(err, "setting accelerate_flow arg 4", __LINE__);
+  err = clSetKernelArg(kernel, 28, sizeof(cl_int), &parity);
+  checkError(err, "setting propagate arg 11", __LINE__);
+  err = clSetKernelArg(kernel, 29, sizeof(cl_mem), &ocl.watch);
+  checkError(err, "setting propagate arg 12", __LINE__);
+  err = clSetKernelArg(kernel, 30, sizeof(cl_float)*2*LOCALSIZE*LOCALSIZE2, NULL);
+  checkError(err, "setting propagate arg 13", __LINE__);
+  err = clSetKernelArg(kernel, 31, sizeof(cl_int)*LOCALSIZE*LOCALSIZE2, NULL);
+  checkError(err, "setting propagate arg 14", __LINE__);
+  err = clSetKernelArg(kernel, 32, sizeof(cl_mem), &ocl.partial_force);
+  checkError(err, "setting propagate arg 15", __LINE__);
+  err = clSetKernelArg(kernel, 33, sizeof(cl_int), &params.nlabels);
+  checkError(err, "setting propagate arg 16", __LINE__);
+  err = clSetKernelArg(kernel, 34, sizeof(cl_long)*LOCALSIZE*LOCALSIZE2, NULL);
+  checkError(err, "setting propagate arg 17", __LINE__);
+  err = clSetKernelArg(kernel, 35, sizeof(cl_mem), &ocl.partial_exact);
+  checkError(err, "setting propagate arg 18", __LINE__);
+  err = clSetKernelArg(kernel, 36, sizeof(cl_int), &params.deterministic);
+  checkError(err, "setting propagate arg 19", __LINE__);
+  /* NULL in rows, where the kernel reads neither */
+  err = clSetKernelArg(kernel, 37, sizeof(cl_mem), &ocl.tile_base);
+  checkError(err, "setting propagate arg 20", __LINE__);
+  err = clSetKernelArg(kernel, 38, sizeof(cl_mem), &ocl.tile_groups);
+  checkError(err, "setting propagate arg 21", __LINE__);
+}
+
+static void place_tiles(const t_param params, const int layout, int* base, int* groups)
+{
+  const int ntx = params.nx / LOCALSIZE;
+  const int nty = (params.ny + TILE_Y - 1) / TILE_Y;
+  const int morton = (layout == LAYOUT_MORTON);
+  int side = 1;                 /* power of two covering the tiles both ways */
+  int first = 0;                /* first cell of the next tile stored */
+  int g = 0;                    /* next work-group */
 
-  for (int ii = 0; ii < params.maxIters; ii++)
+  while (side < ntx || side < nty) side *= 2;
+
+  /* along rows, or the Z-order curve over the covering square, skipping the tiles past the lattice */
+  for (int pos = 0; pos < (morton ? side * side : ntx * nty); pos++)
   {
-    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+    int tx = pos % ntx;
+    int ty = pos / ntx;
+
+    if (morton)
+    {
+      tx = ty = 0;
+      for (int b = 0; (1 << (2*b)) < side * side; b++)
+      {
+        tx |= ((pos >> (2*b)) & 1) << b;
+        ty |= ((pos >> (2*b + 1)) & 1) << b;
+      }
+
+      if (tx >= ntx || ty >= nty) continue;
+    }
+
+    /* the tiles of the last row are cut short when ny is not a whole number of them */
+    const int height = (ty == nty - 1) ? params.ny - ty*TILE_Y : TILE_Y;
+
+    base[ty*ntx + tx] = first;
+    for (int r = 0; r < height; r++)
+      groups[g++] = tx*LOCALSIZE + (ty*TILE_Y + r)*params.nx;
+    first += LOCALSIZE * height;
   }
+}
 
-  fclose(fp);
+double wall_time(void)
+{
+  struct timeval timstr;        /* structure to hold elapsed time */
+
+  gettimeofday(&timstr, NULL);
 
-  return EXIT_SUCCESS;
+  return timstr.tv_sec + (timstr.tv_usec / 1000000.0);
 }
 
 void checkError(cl_int err, const char *op, const int line)
@@ -1042,20 +1062,6 @@ void checkError(cl_int err, const char *op, const int line)
   }
 }
 
-void die(const char* message, const int line, const char* file)
-{
-  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
-  fprintf(stderr, "%s\n", message);
-  fflush(stderr);
-  exit(EXIT_FAILURE);
-}
-
-void usage(const char* exe)
-{
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
-  exit(EXIT_FAILURE);
-}
-
 #define MAX_DEVICES 32
 #define MAX_DEVICE_NAME 1024
 
@@ -1,15 +1,118 @@
 #pragma OPENCL EXTENSION cl_khr_fp64 : enable
 
 #define NSPEEDS         9
+#define MAXLABELS       8       /* as in lbm.h */
+#define EXACT_SCALE     68719476736.0f /* as in lbm.h */
+#define COLLISION_BGK   0       /* as in lbm.h */
+#define COLLISION_TRT   1
+#define COLLISION_MRT   2
+#define LAYOUT_ROWS     0       /* as in lbm.h */
+
+/* the collision operator, and its rates other than omega, are given as -D build options */
+#ifndef COLLISION
+#define COLLISION       COLLISION_BGK
+#endif
+
+/*
+** and so is the layout of the cells, with the TILE_X by TILE_Y cells of
+** its tiles: CELL() is the index of the cell at column x, row y, in
+** rows or through the first cell tile_base holds for each tile
+*/
+#ifndef LAYOUT
+#define LAYOUT          LAYOUT_ROWS
+#endif
+#if LAYOUT == LAYOUT_ROWS
+#define CELL(x, y)      ((x) + (y)*nx)
+#else
+#define CELL(x, y)      (tile_base[((y) / TILE_Y)*(nx / TILE_X) + (x) / TILE_X] + ((y) % TILE_Y)*TILE_X + (x) % TILE_X)
+#endif
+
+/*
+** Relax the populations f of an open cell towards d_equ into g: BGK
+** with omega; TRT with omega for the even and OMEGA_ODD for the odd
+** parts of each pair of opposite populations; MRT with omega for the
+** stress, and S_E, S_EPS and S_Q for the energy, its square and the
+** energy flux, in the moments of Lallemand and Luo.
+*/
+static void relax(const float omega, const float f[NSPEEDS], const float d_equ[NSPEEDS], float g[NSPEEDS])
+{
+#if COLLISION == COLLISION_TRT
+  /* the rest population is even; each other one pairs with its opposite */
+  const int pairs[4][2] = {{1, 3}, {2, 4}, {5, 7}, {6, 8}};
+
+  g[0] = f[0] + omega * (d_equ[0] - f[0]);
+  for (int p = 0; p < 4; p++)
+  {
+    const int i = pairs[p][0];
+    const int j = pairs[p][1];
+    const float even = omega * 0.5f * ((d_equ[i] + d_equ[j]) - (f[i] + f[j]));
+    const float odd = OMEGA_ODD * 0.5f * ((d_equ[i] - d_equ[j]) - (f[i] - f[j]));
+
+    g[i] = f[i] + even + odd;
+    g[j] = f[j] + even - odd;
+  }
+#elif COLLISION == COLLISION_MRT
+  /* the moments of the non-equilibrium parts the density and momentum have none of */
+  float n[NSPEEDS];
+
+  for (int i = 0; i < NSPEEDS; i++) n[i] = f[i] - d_equ[i];
+
+  const float e   = -4.f*n[0] - n[1] - n[2] - n[3] - n[4] + 2.f*(n[5] + n[6] + n[7] + n[8]);
+  const float eps =  4.f*n[0] - 2.f*(n[1] + n[2] + n[3] + n[4]) + n[5] + n[6] + n[7] + n[8];
+  const float q_x = -2.f*n[1] + 2.f*n[3] + n[5] - n[6] - n[7] + n[8];
+  const float q_y = -2.f*n[2] + 2.f*n[4] + n[5] + n[6] - n[7] - n[8];
+  const float p_xx = n[1] - n[2] + n[3] - n[4];
+  const float p_xy = n[5] - n[6] + n[7] - n[8];
+
+  /* each relaxed at its own rate and divided by the norm of its row of the transform */
+  const float a_e   = S_E * e / 36.f;
+  const float a_eps = S_EPS * eps / 36.f;
+  const float a_qx  = S_Q * q_x / 12.f;
+  const float a_qy  = S_Q * q_y / 12.f;
+  const float a_xx  = omega * p_xx / 4.f;
+  const float a_xy  = omega * p_xy / 4.f;
+
+  /* and back to the populations through the transpose of the transform */
+  g[0] = f[0] - (-4.f*a_e + 4.f*a_eps);
+  g[1] = f[1] - (-a_e - 2.f*a_eps - 2.f*a_qx + a_xx);
+  g[2] = f[2] - (-a_e - 2.f*a_eps - 2.f*a_qy - a_xx);
+  g[3] = f[3] - (-a_e - 2.f*a_eps + 2.f*a_qx + a_xx);
+  g[4] = f[4] - (-a_e - 2.f*a_eps + 2.f*a_qy - a_xx);
+  g[5] = f[5] - (2.f*a_e + a_eps + a_qx + a_qy + a_xy);
+  g[6] = f[6] - (2.f*a_e + a_eps - a_qx + a_qy - a_xy);
+  g[7] = f[7] - (2.f*a_e + a_eps - a_qx - a_qy + a_xy);
+  g[8] = f[8] - (2.f*a_e + a_eps + a_qx - a_qy - a_xy);
+#else
+  for (int i = 0; i < NSPEEDS; i++) g[i] = f[i] + omega * (d_equ[i] - f[i]);
+#endif
+}
 
 kernel void propagate(global float* restrict speeds0, global float* restrict speeds1, global float* restrict speeds2, global float* restrict speeds3, global float* restrict speeds4, global float* restrict speeds5, global float* restrict speeds6,
   global float* restrict speeds7, global float* restrict speeds8, global float* restrict tmp_speeds0, global float* restrict tmp_speeds1, global float* restrict tmp_speeds2, global float* restrict tmp_speeds3, global float* restrict tmp_speeds4,
   global float* restrict tmp_speeds5, global float* restrict tmp_speeds6, global float* restrict tmp_speeds7, global float* restrict tmp_speeds8, global int* restrict obstacles, int nx, int ny, float omega, local float* local_sum, local int* local_sum2,
-  global float* partial_sum, global int* partial_sum2, int iters,float densityaccel){
+  global float* partial_sum, global int* partial_sum2, global int* restrict ring,float densityaccel, int parity,
+  global int* restrict watch, local float* local_force, local int* local_label,
+  global float* partial_force, int nlabels, local long* local_exact,
+  global long* partial_exact, int deterministic,
+  global const int* restrict tile_base, global const int* restrict tile_groups){
 
-  /* get column and row indices */
+  /* get column and row indices, in tiles those of the row of a tile
+  ** tile_groups names for the work-group, the groups sweeping the tiles
+  ** in the order they are stored */
+#if LAYOUT == LAYOUT_ROWS
   const int ii = get_global_id(0);
   const int jj = get_global_id(1);
+#else
+  const int first = tile_groups[get_group_id(0) + get_group_id(1)*get_num_groups(0)];
+  const int ii = first % nx + get_local_id(0);
+  const int jj = first / nx;
+#endif
+
+  /* the iteration index lives on the device: each launch reads its own
+  ** ring slot and passes the next index on through the other one, so
+  ** no slot is read and written by the same launch */
+  const int iters = ring[parity];
+  if (ii == 0 && jj == 0) ring[parity ^ 1] = iters + 1;
 
   const float c_sq_inv = 3.f;
   const float c_sq = half_recip(c_sq_inv); /* square of speed of sound */
@@ -31,18 +134,39 @@ kernel void propagate(global float* restrict speeds0, global float* restrict spe
   ** appropriate directions of travel and writing into
   ** scratch space grid */
 
-  float tmp_s0 = speeds0[ii + jj*nx];
-  float tmp_s1 = (jj == ny-2 && (!obstacles[x_w + jj*nx] && isgreater((speeds3[x_w + jj*nx] - w11) , 0.f) && isgreater((speeds6[x_w + jj*nx] - w21) , 0.f) && isgreater((speeds7[x_w + jj*nx] - w21) , 0.f))) ? speeds1[x_w + jj*nx]+w11 : speeds1[x_w + jj*nx];
-  float tmp_s2 = speeds2[ii + y_s*nx];
-  float tmp_s3 = (jj == ny-2 && (!obstacles[x_e + jj*nx] && isgreater((speeds3[x_e + jj*nx] - w11) , 0.f) && isgreater((speeds6[x_e + jj*nx] - w21) , 0.f) && isgreater((speeds7[x_e + jj*nx] - w21) , 0.f))) ? speeds3[x_e + jj*nx]-w11 : speeds3[x_e + jj*nx];
-  float tmp_s4 = speeds4[ii + y_n*nx];
-  float tmp_s5 = (y_s == ny-2 && (!obstacles[x_w + y_s*nx] && isgreater((speeds3[x_w + y_s*nx] - w11) , 0.f) && isgreater((speeds6[x_w + y_s*nx] - w21) , 0.f) && isgreater((speeds7[x_w + y_s*nx] - w21) , 0.f))) ? speeds5[x_w + y_s*nx]+w21 : speeds5[x_w + y_s*nx];
-  float tmp_s6 = (y_s == ny-2 && (!obstacles[x_e + y_s*nx] && isgreater((speeds3[x_e + y_s*nx] - w11) , 0.f) && isgreater((speeds6[x_e + y_s*nx] - w21) , 0.f) && isgreater((speeds7[x_e + y_s*nx] - w21) , 0.f))) ? speeds6[x_e + y_s*nx]-w21 : speeds6[x_e + y_s*nx];
-  float tmp_s7 = (y_n == ny-2 && (!obstacles[x_e + y_n*nx] && isgreater((speeds3[x_e + y_n*nx] - w11) , 0.f) && isgreater((speeds6[x_e + y_n*nx] - w21) , 0.f) && isgreater((speeds7[x_e + y_n*nx] - w21) , 0.f))) ? speeds7[x_e + y_n*nx]-w21 : speeds7[x_e + y_n*nx];
-  float tmp_s8 = (y_n == ny-2 && (!obstacles[x_w + y_n*nx] && isgreater((speeds3[x_w + y_n*nx] - w11) , 0.f) && isgreater((speeds6[x_w + y_n*nx] - w21) , 0.f) && isgreater((speeds7[x_w + y_n*nx] - w21) , 0.f))) ? speeds8[x_w + y_n*nx]+w21 : speeds8[x_w + y_n*nx];
+  float tmp_s0 = speeds0[CELL(ii, jj)];
+  float tmp_s1 = (jj == ny-2 && (!obstacles[CELL(x_w, jj)] && isgreater((speeds3[CELL(x_w, jj)] - w11) , 0.f) && isgreater((speeds6[CELL(x_w, jj)] - w21) , 0.f) && isgreater((speeds7[CELL(x_w, jj)] - w21) , 0.f))) ? speeds1[CELL(x_w, jj)]+w11 : speeds1[CELL(x_w, jj)];
+  float tmp_s2 = speeds2[CELL(ii, y_s)];
+  float tmp_s3 = (jj == ny-2 && (!obstacles[CELL(x_e, jj)] && isgreater((speeds3[CELL(x_e, jj)] - w11) , 0.f) && isgreater((speeds6[CELL(x_e, jj)] - w21) , 0.f) && isgreater((speeds7[CELL(x_e, jj)] - w21) , 0.f))) ? speeds3[CELL(x_e, jj)]-w11 : speeds3[CELL(x_e, jj)];
+  float tmp_s4 = speeds4[CELL(ii, y_n)];
+  float tmp_s5 = (y_s == ny-2 && (!obstacles[CELL(x_w, y_s)] && isgreater((speeds3[CELL(x_w, y_s)] - w11) , 0.f) && isgreater((speeds6[CELL(x_w, y_s)] - w21) , 0.f) && isgreater((speeds7[CELL(x_w, y_s)] - w21) , 0.f))) ? speeds5[CELL(x_w, y_s)]+w21 : speeds5[CELL(x_w, y_s)];
+  float tmp_s6 = (y_s == ny-2 && (!obstacles[CELL(x_e, y_s)] && isgreater((speeds3[CELL(x_e, y_s)] - w11) , 0.f) && isgreater((speeds6[CELL(x_e, y_s)] - w21) , 0.f) && isgreater((speeds7[CELL(x_e, y_s)] - w21) , 0.f))) ? speeds6[CELL(x_e, y_s)]-w21 : speeds6[CELL(x_e, y_s)];
+  float tmp_s7 = (y_n == ny-2 && (!obstacles[CELL(x_e, y_n)] && isgreater((speeds3[CELL(x_e, y_n)] - w11) , 0.f) && isgreater((speeds6[CELL(x_e, y_n)] - w21) , 0.f) && isgreater((speeds7[CELL(x_e, y_n)] - w21) , 0.f))) ? speeds7[CELL(x_e, y_n)]-w21 : speeds7[CELL(x_e, y_n)];
+  float tmp_s8 = (y_n == ny-2 && (!obstacles[CELL(x_w, y_n)] && isgreater((speeds3[CELL(x_w, y_n)] - w11) , 0.f) && isgreater((speeds6[CELL(x_w, y_n)] - w21) , 0.f) && isgreater((speeds7[CELL(x_w, y_n)] - w21) , 0.f))) ? speeds8[CELL(x_w, y_n)]+w21 : speeds8[CELL(x_w, y_n)];
+
+  /* momentum handed to a blocked cell by the populations coming in from
+  ** open cells, each bringing its momentum and taking it back reversed */
+  const int label = (nlabels > 0) ? obstacles[CELL(ii, jj)] : 0;
+  float force_x = 0.f;
+  float force_y = 0.f;
+  if (label){
+    const float f1 = obstacles[CELL(x_w, jj)]  ? 0.f : tmp_s1;
+    const float f2 = obstacles[CELL(ii, y_s)]  ? 0.f : tmp_s2;
+    const float f3 = obstacles[CELL(x_e, jj)]  ? 0.f : tmp_s3;
+    const float f4 = obstacles[CELL(ii, y_n)]  ? 0.f : tmp_s4;
+    const float f5 = obstacles[CELL(x_w, y_s)] ? 0.f : tmp_s5;
+    const float f6 = obstacles[CELL(x_e, y_s)] ? 0.f : tmp_s6;
+    const float f7 = obstacles[CELL(x_e, y_n)] ? 0.f : tmp_s7;
+    const float f8 = obstacles[CELL(x_w, y_n)] ? 0.f : tmp_s8;
+    force_x = 2.f * (f1 - f3 + f5 - f6 - f7 + f8);
+    force_y = 2.f * (f2 - f4 + f5 + f6 - f7 - f8);
+  }
 
   /* compute local density total */
   float local_density = tmp_s0 + tmp_s1 + tmp_s2 + tmp_s3 + tmp_s4  + tmp_s5  + tmp_s6  + tmp_s7  + tmp_s8;
+  /* a non-finite or negative density has the sign or all the exponent
+  ** bits set, tested on the bits so relaxed math cannot drop the test */
+  const int unstable = as_uint(local_density) >= 0x7f800000u;
   const float local_density_recip = half_recip(local_density);
   /* compute x velocity component */
   float u_x = (tmp_s1
@@ -96,21 +220,22 @@ kernel void propagate(global float* restrict speeds0, global float* restrict spe
                                    + ((u_x - u_y) * (u_x - u_y)) * temp1
                                    + temp2);
 
-  float tmp;
-  int expression = obstacles[ii + jj*nx];
-  tmp_s0 = select((tmp_s0 + omega * (d_equ[0] - tmp_s0)),tmp_s0,expression);
-  tmp = tmp_s1;
-  tmp_s1 = select((tmp_s1 + omega * (d_equ[1] - tmp_s1)),tmp_s3,expression);
-  tmp_s3 = select((tmp_s3 + omega * (d_equ[3] - tmp_s3)),tmp,expression);
-  tmp = tmp_s2;
-  tmp_s2 = select((tmp_s2 + omega * (d_equ[2] - tmp_s2)),tmp_s4,expression);
-  tmp_s4 = select((tmp_s4 + omega * (d_equ[4] - tmp_s4)),tmp,expression);
-  tmp = tmp_s5;
-  tmp_s5 = select((tmp_s5 + omega * (d_equ[5] - tmp_s5)),tmp_s7,expression);
-  tmp_s7 = select((tmp_s7 + omega * (d_equ[7] - tmp_s7)),tmp,expression);
-  tmp = tmp_s6;
-  tmp_s6 = select((tmp_s6 + omega * (d_equ[6] - tmp_s6)),tmp_s8,expression);
-  tmp_s8 = select((tmp_s8 + omega * (d_equ[8] - tmp_s8)),tmp,expression);
+  /* relax the open cells with the collision operator, rebound the blocked ones */
+  const float f[NSPEEDS] = {tmp_s0, tmp_s1, tmp_s2, tmp_s3, tmp_s4, tmp_s5, tmp_s6, tmp_s7, tmp_s8};
+  float g[NSPEEDS];
+
+  relax(omega, f, d_equ, g);
+
+  int expression = obstacles[CELL(ii, jj)];
+  tmp_s0 = select(g[0],f[0],expression);
+  tmp_s1 = select(g[1],f[3],expression);
+  tmp_s3 = select(g[3],f[1],expression);
+  tmp_s2 = select(g[2],f[4],expression);
+  tmp_s4 = select(g[4],f[2],expression);
+  tmp_s5 = select(g[5],f[7],expression);
+  tmp_s7 = select(g[7],f[5],expression);
+  tmp_s6 = select(g[6],f[8],expression);
+  tmp_s8 = select(g[8],f[6],expression);
 
   /* local density total */
   local_density =  half_recip(tmp_s0 + tmp_s1 + tmp_s2 + tmp_s3 + tmp_s4 + tmp_s5 + tmp_s6 + tmp_s7 + tmp_s8);
@@ -133,15 +258,15 @@ kernel void propagate(global float* restrict speeds0, global float* restrict spe
                * local_density;
 
 
-  tmp_speeds0[ii + jj*nx] = tmp_s0;
-  tmp_speeds1[ii + jj*nx] = tmp_s1;
-  tmp_speeds2[ii + jj*nx] = tmp_s2;
-  tmp_speeds3[ii + jj*nx] = tmp_s3;
-  tmp_speeds4[ii + jj*nx] = tmp_s4;
-  tmp_speeds5[ii + jj*nx] = tmp_s5;
-  tmp_speeds6[ii + jj*nx] = tmp_s6;
-  tmp_speeds7[ii + jj*nx] = tmp_s7;
-  tmp_speeds8[ii + jj*nx] = tmp_s8;
+  tmp_speeds0[CELL(ii, jj)] = tmp_s0;
+  tmp_speeds1[CELL(ii, jj)] = tmp_s1;
+  tmp_speeds2[CELL(ii, jj)] = tmp_s2;
+  tmp_speeds3[CELL(ii, jj)] = tmp_s3;
+  tmp_speeds4[CELL(ii, jj)] = tmp_s4;
+  tmp_speeds5[CELL(ii, jj)] = tmp_s5;
+  tmp_speeds6[CELL(ii, jj)] = tmp_s6;
+  tmp_speeds7[CELL(ii, jj)] = tmp_s7;
+  tmp_speeds8[CELL(ii, jj)] = tmp_s8;
 
 
   int local_idi = get_local_id(0);
@@ -149,9 +274,15 @@ kernel void propagate(global float* restrict speeds0, global float* restrict spe
   int local_sizei = get_local_size(0);
   int local_sizej = get_local_size(1);
   /* accumulate the norm of x- and y- velocity components */
-  local_sum[local_idi + local_idj*local_sizei] = (obstacles[ii + jj*nx]) ? 0 : hypot(u_x,u_y);
-  /* increase counter of inspected cells */
-  local_sum2[local_idi + local_idj*local_sizei] = (obstacles[ii + jj*nx]) ? 0 : 1 ;
+  local_sum[local_idi + local_idj*local_sizei] = (obstacles[CELL(ii, jj)]) ? 0 : hypot(u_x,u_y);
+  /* and in fixed point, summed to the same bits by any work-group shape */
+  local_exact[local_idi + local_idj*local_sizei] = (obstacles[CELL(ii, jj)] || !deterministic) ? 0 : (long)(hypot(u_x,u_y) * EXACT_SCALE);
+  /* increase counter of inspected cells, counting unstable ones from bit 16 */
+  local_sum2[local_idi + local_idj*local_sizei] = ((obstacles[CELL(ii, jj)]) ? 0 : 1) + (unstable << 16);
+  /* and the force on the label of the cell */
+  local_force[2*(local_idi + local_idj*local_sizei)] = force_x;
+  local_force[2*(local_idi + local_idj*local_sizei) + 1] = force_y;
+  local_label[local_idi + local_idj*local_sizei] = label;
   barrier(CLK_LOCAL_MEM_FENCE);
   int group_id = get_group_id(0);
   int group_size = get_num_groups(0);
@@ -165,7 +296,36 @@ kernel void propagate(global float* restrict speeds0, global float* restrict spe
       sum2 += local_sum2[i];
     }
     partial_sum[group_id+group_id2*group_size+iters*group_size*group_size2] = sum;
-    partial_sum2[group_id+group_id2*group_size+iters*group_size*group_size2] = sum2;
+    partial_sum2[group_id+group_id2*group_size+iters*group_size*group_size2] = sum2 & 0xffff;
+    if (deterministic){
+      long exact = 0;
+      for(int i = 0; i<local_sizei*local_sizej; i++) exact += local_exact[i];
+      partial_exact[group_id+group_id2*group_size+iters*group_size*group_size2] = exact;
+    }
+    /* keep the first unstable timestep, and the lowest group unstable in it */
+    if ((sum2 >> 16) && atomic_min(&watch[0], iters) >= iters)
+      atomic_min(&watch[1], group_id+group_id2*group_size);
+
+    if (nlabels > 0){
+      float force[2*MAXLABELS];
+      for(int l = 0; l<2*nlabels; l++) force[l] = 0.0f;
+      for(int i = 0; i<local_sizei*local_sizej; i++){
+        if (local_label[i]){
+          force[2*(local_label[i]-1)] += local_force[2*i];
+          force[2*(local_label[i]-1) + 1] += local_force[2*i + 1];
+        }
+      }
+      for(int l = 0; l<2*nlabels; l++)
+        partial_force[(group_id+group_id2*group_size+iters*group_size*group_size2)*2*nlabels + l] = force[l];
+    }
   }
 
 }
+
+/* STREAM triad, the bandwidth the propagate kernel is measured against */
+kernel void triad(global float* restrict a, global const float* restrict b,
+                  global const float* restrict c, float scalar){
+  const int i = get_global_id(0);
+
+  a[i] = b[i] + scalar * c[i];
+}
@@ -1,186 +1,267 @@
 /*
-** Code to implement a d2q9-bgk lattice boltzmann scheme.
-** 'd2' inidates a 2-dimensional grid, and
-** 'q9' indicates 9 velocities per grid cell.
-** 'bgk' refers to the Bhatnagar-Gross-Krook collision step.
+** OpenMP backend of the d2q9-bgk lattice boltzmann code: the timesteps
+** run on the host, threaded with OpenMP and vectorised over a row.
+** The host side, and the layout of the speeds, are those of the driver
+** in ../Driver.
 **
-** The 'speeds' in each cell are numbered as follows:
+** Each timestep fuses accelerate_flow(), propagate(), rebound() and
+** collision() with the average velocity of the lattice it leaves, so
+** reduce() only hands back the values recorded by step_batch(). It
+** also notes the first row to reach a non-finite or negative density,
+** which poll() hands back; the tiles of this backend are the rows of the
+** tiles the lattice is stored in (below). With
+** labelled obstacles each row, while still in cache, then sums the
+** momentum its blocked cells took from their open neighbours into the
+** force on each label, which forces() hands back. With --deterministic
+** the row is also swept again for the velocity of its cells in fixed
+** point, whose sum is the same whatever the threads and tiles. Each
+** collision operator the parameter file may name is inlined into a row
+** loop of its own, and the loop is picked once per row.
 **
-** 6 2 5
-**  \|/
-** 3-0-1
-**  /|\
-** 7 4 8
-**
-** A 2D grid:
-**
-**           cols
-**       --- --- ---
-**      | D | E | F |
-** rows  --- --- ---
-**      | A | B | C |
-**       --- --- ---
-**
-** 'unwrapped' in row major order to give a 1D array:
-**
-**  --- --- --- --- --- ---
-** | A | B | C | D | E | F |
-**  --- --- --- --- --- ---
-**
-** Grid indicies are:
-**
-**          ny
-**          ^       cols(ii)
-**          |  ----- ----- -----
-**          | | ... | ... | etc |
-**          |  ----- ----- -----
-** rows(jj) | | 1,0 | 1,1 | 1,2 |
-**          |  ----- ----- -----
-**          | | 0,0 | 0,1 | 0,2 |
-**          |  ----- ----- -----
-**          ----------------------> nx
-**
-** Note the names of the input parameter and obstacle files
-** are passed on the command line, e.g.:
-**
-**   ./d2q9-bgk input.params obstacles.dat
-**
-** Be sure to adjust the grid dimensions in the parameter file
-** if you choose a different obstacle file.
+** The lattice is kept in tiles of TILE_X by TILE_Y cells, each tile
+** row-major and stored whole: in rows of tiles with --layout=tiled and
+** along a Z-order curve with --layout=morton. A timestep sweeps the
+** tiles in the order they are stored, a row of a tile at a time, so the
+** rows north and south of a row are only TILE_X cells long and still in
+** cache however wide the lattice. The tiles of the last row and column
+** are cut short where the lattice is not a whole number of tiles, and
+** each row is streamed as wide as its tile, so any nx and ny will do.
+** The row-major layout is one tile of the whole lattice. Where each
+** tile starts is worked out once, by allocate(), and the cells only
+** change layout in upload() and download(). The lattices are on the
+** driver's huge_alloc() pages, so a sweep touches few TLB entries
+** however far apart its rows are.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
-#include <time.h>
-#include <sys/time.h>
-#include <sys/resource.h>
+#include <mm_malloc.h>
+#include <omp.h>
+
+#include "lbm.h"
+#include "huge.h"
 
-#define NSPEEDS         9
-#define FINALSTATEFILE  "final_state.dat"
-#define AVVELSFILE      "av_vels.dat"
+#ifndef TILE_X
+#define TILE_X          128       /* cells of a tile in x, a multiple of the vector length */
+#endif
+#ifndef TILE_Y
+#define TILE_Y          32        /* cells of a tile in y */
+#endif
 
-/* struct to hold the parameter values */
+/* struct to hold where the tiles of the lattice are */
 typedef struct
 {
-  int    nx;            /* no. of cells in x-direction */
-  int    ny;            /* no. of cells in y-direction */
-  int    maxIters;      /* no. of iterations */
-  int    reynolds_dim;  /* dimension for Reynolds number */
-  float density;       /* density per link */
-  float accel;         /* density redistribution */
-  float omega;         /* relaxation parameter */
-} t_param;
-
-/* struct to hold the 'speed' values */
-/* struct to hold the 'speed' values */
+  int  nx;                      /* no. of cells of a tile in x-direction */
+  int  ny;                      /* no. of cells of a tile in y-direction */
+  int  ntx;                     /* no. of tiles in x-direction */
+  int  nty;                     /* no. of tiles in y-direction */
+  int  edge_nx;                 /* no. of cells in x-direction of the last column of tiles */
+  int  edge_ny;                 /* no. of cells in y-direction of the last row of tiles */
+  int* base;                    /* first cell of each tile, tiles numbered along rows */
+  int* order;                   /* tile stored at each position, numbered along rows */
+} t_tiles;
+
+/*
+** struct to hold the first cell of a row of a tile and of the same rows
+** around it, and the last cell of those in the tile west
+*/
 typedef struct
 {
-  float speeds[NSPEEDS];
-} t_speed;
-
-/* struct to hold the 'speed' values */
+  int c;                        /* the row */
+  int e;                        /* the row of the tile east */
+  int w;                        /* end of the row of the tile west */
+  int n;                        /* the row north */
+  int ne;                       /* the row north of it in the tile east */
+  int nw;                       /* end of the row north of it in the tile west */
+  int s;                        /* the row south */
+  int se;                       /* the row south of it in the tile east */
+  int sw;                       /* end of the row south of it in the tile west */
+} t_row;
+
+/* struct to hold the lattices of the backend */
 typedef struct
 {
-  float* restrict s0;
-  float* restrict s1;
-  float* restrict s2;
-  float* restrict s3;
-  float* restrict s4;
-  float* restrict s5;
-  float* restrict s6;
-  float* restrict s7;
-  float* restrict s8;
-} t_speeds;
+  t_param  params;
+  t_speeds speeds;              /* lattice read by even timesteps */
+  t_speeds tmp_speeds;          /* lattice read by odd timesteps */
+  int*     obstacles;
+  t_tiles  tiles;               /* layout of speeds, tmp_speeds and obstacles */
+  float*   av_vels;             /* av. velocity left by each timestep */
+  float*   forces;              /* force on each label of each timestep, x then y */
+  int      tt;                  /* no. of timesteps taken */
+  int      unstable_tt;         /* first timestep to leave a bad density, -1 for none */
+  int      unstable_row;        /* first row it left one in */
+  int      unstable_col;        /* and the column of tiles */
+} t_openmp;
+
 /*
-** function prototypes
+** The main calculation method: accelerate_flow(), propagate(),
+** rebound() & collision() from speeds into tmp_speeds, returning
+** the average velocity of tmp_speeds. The first row of a tile with a
+** non-finite or negative density, as row * tiles.ntx + tile column,
+** goes in *unstable_tile, which is ny * tiles.ntx if none has, and the
+** x, y force on each of the params.nlabels labels in force.
 */
+static float timestep(const t_param params, const t_tiles tiles, t_speeds speeds, t_speeds tmp_speeds,
+                      int* obstacles, int* unstable_tile, float* force);
 
-/* load params, allocate memory, load obstacles & initialise fluid particle densities */
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed** cells_ptr, t_speed** tmp_scells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr);
+/*
+** Stream the nx cells of the row at rows.c, nx being the width of its
+** tile, and collide them with the operator collision: propagate(),
+** rebound() & collision() of one row for timestep(). collision is a
+** constant at every call, so each operator is inlined into a row loop
+** of its own. The velocities of the open cells are added to *tot_u and
+** *tot_cells, and *unstable is set if a density is non-finite or
+** negative.
+*/
+static inline void stream_collide_row(const t_param params, const int collision, const int nx,
+                                      const t_speeds speeds, t_speeds tmp_speeds, const int* restrict obstacles,
+                                      const t_row rows, float* tot_u, int* tot_cells, int* unstable);
 
 /*
-** The main calculation methods.
-** timestep calls, in order, the functions:
-** accelerate_flow(), propagate(), rebound() & collision()
+** Relax the populations f of an open cell towards d_equ with the
+** operator collision into g: BGK with params.omega; TRT with
+** params.omega for the even and params.omega_odd for the odd parts of
+** each pair of opposite populations; MRT with params.omega for the
+** stress, and params.s_e, s_eps and s_q for the energy, its square and
+** the energy flux, in the moments of Lallemand and Luo.
 */
-float timestep(const t_param params, t_speeds speeds, t_speeds tmp_speeds, int* obstacles);
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels);
+static inline void relax(const int collision, const t_param params, const float f[NSPEEDS],
+                         const float d_equ[NSPEEDS], float g[NSPEEDS]);
 
-/* finalise, including freeing up allocated memory */
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_scells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr);
+/* relax the opposite populations i and j of TRT */
+static inline void relax_pair(const t_param params, const float f[NSPEEDS], const float d_equ[NSPEEDS],
+                              float g[NSPEEDS], const int i, const int j);
 
-/* Sum all the densities in the grid.
-** The total should remain constant from one timestep to the next. */
-float total_density(const t_param params, t_speed* cells);
+/* no. of cells in x-direction of the tiles in column tx, those of the last column cut short by the lattice */
+static inline int tile_width(const t_tiles tiles, const int tx)
+{
+  return (tx == tiles.ntx - 1) ? tiles.edge_nx : tiles.nx;
+}
 
-/* compute average velocity */
-float av_velocity(const t_param params, t_speed* cells, int* obstacles);
+/* no. of cells in y-direction of the tiles in row ty */
+static inline int tile_height(const t_tiles tiles, const int ty)
+{
+  return (ty == tiles.nty - 1) ? tiles.edge_ny : tiles.ny;
+}
 
-/* calculate Reynolds number */
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles);
+/* index of cell ii, jj in the tiles */
+static inline int cell_index(const t_tiles tiles, const int ii, const int jj)
+{
+  const int tx = ii / tiles.nx;
 
-/* utility functions */
-void die(const char* message, const int line, const char* file);
-void usage(const char* exe);
+  return tiles.base[(jj / tiles.ny) * tiles.ntx + tx] + (jj % tiles.ny) * tile_width(tiles, tx) + ii % tiles.nx;
+}
 
 /*
-** main program:
-** initialise, timestep loop, finalise
+** lay the tiles of params.layout out, one tile of the whole lattice for
+** LAYOUT_ROWS. The tiles past the last whole one in each direction are
+** cut short by the lattice and stored just as long as they are.
 */
-int main(int argc, char* argv[])
+static void place_tiles(const t_param params, t_tiles* tiles)
 {
-  char*    paramfile = NULL;    /* name of the input parameter file */
-  char*    obstaclefile = NULL; /* name of a the input obstacle file */
-  t_param  params;              /* struct to hold parameter values */
-  t_speed* cells     = NULL;    /* grid containing fluid densities */
-  t_speed* tmp_scells = NULL;    /* scratch space */
-  int*     obstacles = NULL;    /* grid indicating which cells are blocked */
-  float* av_vels   = NULL;     /* a record of the av. velocity computed for each timestep */
-  struct timeval timstr;        /* structure to hold elapsed time */
-  struct rusage ru;             /* structure to hold CPU time--system and user */
-  double tic, toc;              /* floating point numbers to calculate elapsed wallclock time */
-  double usrtim;                /* floating point number to record elapsed user CPU time */
-  double systim;                /* floating point number to record elapsed system CPU time */
-
-  /* parse the command line */
-  if (argc != 3)
+  tiles->nx = (params.layout == LAYOUT_ROWS) ? params.nx : TILE_X;
+  tiles->ny = (params.layout == LAYOUT_ROWS) ? params.ny : TILE_Y;
+  tiles->ntx = (params.nx + tiles->nx - 1) / tiles->nx;
+  tiles->nty = (params.ny + tiles->ny - 1) / tiles->ny;
+  tiles->edge_nx = params.nx - (tiles->ntx - 1) * tiles->nx;
+  tiles->edge_ny = params.ny - (tiles->nty - 1) * tiles->ny;
+  tiles->base = malloc(sizeof(int) * tiles->ntx * tiles->nty);
+  tiles->order = malloc(sizeof(int) * tiles->ntx * tiles->nty);
+
+  if (tiles->base == NULL || tiles->order == NULL)
+    die("cannot allocate memory for the tiles", __LINE__, __FILE__);
+
+  if (params.layout == LAYOUT_MORTON)
   {
-    usage(argv[0]);
+    int side = 1;               /* power of two covering the tiles both ways */
+    int pos = 0;                /* position of the next tile stored */
+
+    while (side < tiles->ntx || side < tiles->nty) side *= 2;
+
+    /* the Z-order curve over the covering square, skipping the tiles past the lattice */
+    for (int z = 0; z < side * side; z++)
+    {
+      int tx = 0, ty = 0;
+
+      for (int b = 0; (1 << (2*b)) < side * side; b++)
+      {
+        tx |= ((z >> (2*b)) & 1) << b;
+        ty |= ((z >> (2*b + 1)) & 1) << b;
+      }
+
+      if (tx < tiles->ntx && ty < tiles->nty) tiles->order[pos++] = ty * tiles->ntx + tx;
+    }
   }
   else
   {
-    paramfile = argv[1];
-    obstaclefile = argv[2];
+    for (int pos = 0; pos < tiles->ntx * tiles->nty; pos++) tiles->order[pos] = pos;
+  }
+
+  /* each tile starts where the one stored before it ends */
+  for (int pos = 0, first = 0; pos < tiles->ntx * tiles->nty; pos++)
+  {
+    const int tile = tiles->order[pos];
+
+    tiles->base[tile] = first;
+    first += tile_width(*tiles, tile % tiles->ntx) * tile_height(*tiles, tile / tiles->ntx);
   }
+}
+
+static void* openmp_allocate(const t_param params)
+{
+  t_openmp* omp = malloc(sizeof(t_openmp));
+
+  if (omp == NULL) die("cannot allocate memory for the OpenMP backend", __LINE__, __FILE__);
+
+  omp->params = params;
+  omp->tt = 0;
+  omp->unstable_tt = -1;
+  omp->unstable_row = 0;
+  omp->unstable_col = 0;
+
+  place_tiles(params, &omp->tiles);
+
+  omp->speeds.s0 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->speeds.s1 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->speeds.s2 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->speeds.s3 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->speeds.s4 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->speeds.s5 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->speeds.s6 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->speeds.s7 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->speeds.s8 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->tmp_speeds.s0 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->tmp_speeds.s1 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->tmp_speeds.s2 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->tmp_speeds.s3 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->tmp_speeds.s4 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->tmp_speeds.s5 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->tmp_speeds.s6 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->tmp_speeds.s7 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->tmp_speeds.s8 = huge_alloc(sizeof(float) * (params.ny * params.nx), params.hugetlb);
+  omp->obstacles = huge_alloc(sizeof(int) * (params.ny * params.nx), params.hugetlb);
+  omp->av_vels = malloc(sizeof(float) * params.maxIters);
+  omp->forces = malloc(sizeof(float) * 2 * params.nlabels * params.maxIters);
+
+  if (omp->speeds.s0 == NULL || omp->speeds.s1 == NULL || omp->speeds.s2 == NULL
+      || omp->speeds.s3 == NULL || omp->speeds.s4 == NULL || omp->speeds.s5 == NULL
+      || omp->speeds.s6 == NULL || omp->speeds.s7 == NULL || omp->speeds.s8 == NULL
+      || omp->tmp_speeds.s0 == NULL || omp->tmp_speeds.s1 == NULL || omp->tmp_speeds.s2 == NULL
+      || omp->tmp_speeds.s3 == NULL || omp->tmp_speeds.s4 == NULL || omp->tmp_speeds.s5 == NULL
+      || omp->tmp_speeds.s6 == NULL || omp->tmp_speeds.s7 == NULL || omp->tmp_speeds.s8 == NULL
+      || omp->obstacles == NULL || omp->av_vels == NULL || (omp->forces == NULL && params.nlabels > 0))
+    die("cannot allocate memory for the OpenMP lattices", __LINE__, __FILE__);
+
+  return omp;
+}
 
-  /* initialise our data structures and load values from file */
-  initialise(paramfile, obstaclefile, &params, &cells, &tmp_scells, &obstacles, &av_vels);
-
-
-  t_speeds speeds;
-  speeds.s0 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  speeds.s1 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  speeds.s2 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  speeds.s3 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  speeds.s4 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  speeds.s5 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  speeds.s6 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  speeds.s7 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  speeds.s8 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  t_speeds tmp_speeds;
-  tmp_speeds.s0 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  tmp_speeds.s1 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  tmp_speeds.s2 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  tmp_speeds.s3 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  tmp_speeds.s4 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  tmp_speeds.s5 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  tmp_speeds.s6 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  tmp_speeds.s7 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
-  tmp_speeds.s8 = _mm_malloc(sizeof(float) * (params.ny * params.nx),64);
+static void openmp_upload(void* state, const t_speeds cells, const int* obstacles)
+{
+  t_openmp* omp = state;
+  const t_param params = omp->params;
 
   #pragma omp parallel for
   /* loop over _all_ cells */
@@ -188,88 +269,222 @@ int main(int argc, char* argv[])
   {
     for (int ii = 0; ii < params.nx; ii++)
     {
-      speeds.s0[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[0];
-      speeds.s1[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[1];
-      speeds.s2[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[2];
-      speeds.s3[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[3];
-      speeds.s4[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[4];
-      speeds.s5[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[5];
-      speeds.s6[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[6];
-      speeds.s7[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[7];
-      speeds.s8[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[8];
-      tmp_speeds.s0[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[0];
-      tmp_speeds.s1[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[1];
-      tmp_speeds.s2[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[2];
-      tmp_speeds.s3[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[3];
-      tmp_speeds.s4[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[4];
-      tmp_speeds.s5[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[5];
-      tmp_speeds.s6[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[6];
-      tmp_speeds.s7[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[7];
-      tmp_speeds.s8[ii + jj*params.nx] = cells[ii + jj*params.nx].speeds[8];
+      const int index = cell_index(omp->tiles, ii, jj);
+
+      omp->speeds.s0[index] = cells.s0[ii + jj*params.nx];
+      omp->speeds.s1[index] = cells.s1[ii + jj*params.nx];
+      omp->speeds.s2[index] = cells.s2[ii + jj*params.nx];
+      omp->speeds.s3[index] = cells.s3[ii + jj*params.nx];
+      omp->speeds.s4[index] = cells.s4[ii + jj*params.nx];
+      omp->speeds.s5[index] = cells.s5[ii + jj*params.nx];
+      omp->speeds.s6[index] = cells.s6[ii + jj*params.nx];
+      omp->speeds.s7[index] = cells.s7[ii + jj*params.nx];
+      omp->speeds.s8[index] = cells.s8[ii + jj*params.nx];
+      omp->tmp_speeds.s0[index] = cells.s0[ii + jj*params.nx];
+      omp->tmp_speeds.s1[index] = cells.s1[ii + jj*params.nx];
+      omp->tmp_speeds.s2[index] = cells.s2[ii + jj*params.nx];
+      omp->tmp_speeds.s3[index] = cells.s3[ii + jj*params.nx];
+      omp->tmp_speeds.s4[index] = cells.s4[ii + jj*params.nx];
+      omp->tmp_speeds.s5[index] = cells.s5[ii + jj*params.nx];
+      omp->tmp_speeds.s6[index] = cells.s6[ii + jj*params.nx];
+      omp->tmp_speeds.s7[index] = cells.s7[ii + jj*params.nx];
+      omp->tmp_speeds.s8[index] = cells.s8[ii + jj*params.nx];
+      omp->obstacles[index] = obstacles[ii + jj*params.nx];
     }
   }
-  /* iterate for maxIters timesteps */
-  gettimeofday(&timstr, NULL);
-  tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
 
-  for (int tt = 0; tt < params.maxIters/2; tt++)
+  omp->tt = 0;
+}
+
+static void openmp_step_batch(void* state, const int first, const int n)
+{
+  t_openmp* omp = state;
+  int bad;                      /* first row of a tile left unstable by a timestep */
+
+  /* odd timesteps swap the roles of the two lattices */
+  for (int tt = first; tt < first + n; tt++)
   {
-    av_vels[2*tt] = timestep(params, speeds, tmp_speeds, obstacles);
-    av_vels[2*tt+1] = timestep(params, tmp_speeds, speeds, obstacles);
+    float* force = omp->forces + 2 * omp->params.nlabels * tt;
 
-#ifdef DEBUG
-    printf("==timestep: %d==\n", tt);
-    printf("av velocity: %.12E\n", av_vels[tt]);
-    printf("tot density: %.12E\n", total_density(params, cells));
-#endif
+    if (tt % 2 == 0)
+      omp->av_vels[tt] = timestep(omp->params, omp->tiles, omp->speeds, omp->tmp_speeds, omp->obstacles, &bad, force);
+    else
+      omp->av_vels[tt] = timestep(omp->params, omp->tiles, omp->tmp_speeds, omp->speeds, omp->obstacles, &bad, force);
+
+    if (bad < omp->params.ny * omp->tiles.ntx && omp->unstable_tt < 0)
+    {
+      omp->unstable_tt = tt;
+      omp->unstable_row = bad / omp->tiles.ntx;
+      omp->unstable_col = bad % omp->tiles.ntx;
+    }
+  }
+
+  omp->tt = first + n;
+}
+
+static int openmp_poll(void* state, const int wait, int tile[4])
+{
+  t_openmp* omp = state;
+
+  /* the timesteps are done when step_batch() returns, so wait changes nothing */
+  (void)wait;
+
+  if (omp->unstable_tt >= 0)
+  {
+    tile[0] = omp->unstable_col * omp->tiles.nx;
+    tile[1] = omp->unstable_row;
+    tile[2] = tile[0] + tile_width(omp->tiles, omp->unstable_col) - 1;
+    tile[3] = omp->unstable_row;
   }
-  gettimeofday(&timstr, NULL);
-  toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
-  getrusage(RUSAGE_SELF, &ru);
-  timstr = ru.ru_utime;
-  usrtim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
-  timstr = ru.ru_stime;
-  systim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
 
+  return omp->unstable_tt;
+}
+
+static void openmp_reduce(void* state, const int first, const int n, float* av_vels)
+{
+  t_openmp* omp = state;
+
+  memcpy(av_vels + first, omp->av_vels + first, sizeof(float) * n);
+}
+
+static void openmp_forces(void* state, const int first, const int n, float* forces)
+{
+  t_openmp* omp = state;
+  const int pairs = omp->params.nlabels;
+
+  memcpy(forces + 2 * pairs * first, omp->forces + 2 * pairs * first, sizeof(float) * 2 * pairs * n);
+}
+
+static void openmp_download(void* state, t_speeds cells)
+{
+  t_openmp* omp = state;
+  const t_param params = omp->params;
+
+  /* an odd number of timesteps leaves the answer in tmp_speeds */
+  const t_speeds lattice = (omp->tt % 2) ? omp->tmp_speeds : omp->speeds;
 
+  #pragma omp parallel for
   /* loop over _all_ cells */
   for (int jj = 0; jj < params.ny; jj++)
   {
     for (int ii = 0; ii < params.nx; ii++)
     {
-    cells[ii + jj*params.nx].speeds[0] = speeds.s0[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[1] = speeds.s1[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[2] = speeds.s2[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[3] = speeds.s3[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[4] = speeds.s4[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[5] = speeds.s5[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[6] = speeds.s6[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[7] = speeds.s7[ii + jj*params.nx];
-    cells[ii + jj*params.nx].speeds[8] = speeds.s8[ii + jj*params.nx];
+      const int index = cell_index(omp->tiles, ii, jj);
+
+      cells.s0[ii + jj*params.nx] = lattice.s0[index];
+      cells.s1[ii + jj*params.nx] = lattice.s1[index];
+      cells.s2[ii + jj*params.nx] = lattice.s2[index];
+      cells.s3[ii + jj*params.nx] = lattice.s3[index];
+      cells.s4[ii + jj*params.nx] = lattice.s4[index];
+      cells.s5[ii + jj*params.nx] = lattice.s5[index];
+      cells.s6[ii + jj*params.nx] = lattice.s6[index];
+      cells.s7[ii + jj*params.nx] = lattice.s7[index];
+      cells.s8[ii + jj*params.nx] = lattice.s8[index];
     }
   }
+}
+
+static void openmp_release(void* state)
+{
+  t_openmp* omp = state;
+
+  huge_free(omp->speeds.s0);
+  huge_free(omp->speeds.s1);
+  huge_free(omp->speeds.s2);
+  huge_free(omp->speeds.s3);
+  huge_free(omp->speeds.s4);
+  huge_free(omp->speeds.s5);
+  huge_free(omp->speeds.s6);
+  huge_free(omp->speeds.s7);
+  huge_free(omp->speeds.s8);
+  huge_free(omp->tmp_speeds.s0);
+  huge_free(omp->tmp_speeds.s1);
+  huge_free(omp->tmp_speeds.s2);
+  huge_free(omp->tmp_speeds.s3);
+  huge_free(omp->tmp_speeds.s4);
+  huge_free(omp->tmp_speeds.s5);
+  huge_free(omp->tmp_speeds.s6);
+  huge_free(omp->tmp_speeds.s7);
+  huge_free(omp->tmp_speeds.s8);
+  huge_free(omp->obstacles);
+  free(omp->tiles.base);
+  free(omp->tiles.order);
+  free(omp->av_vels);
+  free(omp->forces);
+  free(omp);
+}
+
+/*
+** STREAM triad a = b + s*c over all threads, each thread touching first
+** the part of the arrays it works on, as the timesteps do.
+*/
+static double openmp_measure_peak(void* state)
+{
+  /* the triad runs on arrays of its own */
+  (void)state;
+  const double bytes = 3.0 * sizeof(float) * TRIAD_SIZE;
+  float* a = _mm_malloc(sizeof(float) * TRIAD_SIZE, 64);
+  float* b = _mm_malloc(sizeof(float) * TRIAD_SIZE, 64);
+  float* c = _mm_malloc(sizeof(float) * TRIAD_SIZE, 64);
+  double best = 0.0;
+
+  if (a == NULL || b == NULL || c == NULL)
+    die("cannot allocate memory for the STREAM triad", __LINE__, __FILE__);
+
+  #pragma omp parallel for
+  for (int i = 0; i < TRIAD_SIZE; i++)
+  {
+    a[i] = 0.f;
+    b[i] = 1.f;
+    c[i] = 2.f;
+  }
+
+  for (int r = 0; r < TRIAD_REPEATS; r++)
+  {
+    const float scalar = 3.f;
+    const double t0 = omp_get_wtime();
+
+    #pragma omp parallel for
+    for (int i = 0; i < TRIAD_SIZE; i++)
+    {
+      a[i] = b[i] + scalar * c[i];
+    }
 
+    const double t = omp_get_wtime() - t0;
+    if (t > 0.0 && bytes / t > best) best = bytes / t;
+  }
 
-  /* write final values and free memory */
-  printf("==done==\n");
-  printf("Reynolds number:\t\t%.12E\n", calc_reynolds(params, cells, obstacles));
-  printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
-  printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
-  printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
-  write_values(params, cells, obstacles, av_vels);
-  finalise(&params, &cells, &tmp_scells, &obstacles, &av_vels);
+  _mm_free(a);
+  _mm_free(b);
+  _mm_free(c);
 
-  return EXIT_SUCCESS;
+  return best / 1e9;
 }
 
-float timestep(const t_param params, t_speeds speeds, t_speeds tmp_speeds,int* restrict obstacles)
+const t_backend openmp_backend = {
+  "openmp",
+  64,                   /* any batch will do on the host */
+  2*NSPEEDS*sizeof(float) + sizeof(int),  /* read and write the speeds, read the obstacle */
+  openmp_allocate,
+  openmp_upload,
+  openmp_step_batch,
+  NULL,                 /* the timesteps are done when step_batch() returns */
+  openmp_poll,
+  openmp_reduce,
+  openmp_forces,
+  openmp_download,
+  openmp_release,
+  NULL,
+  openmp_measure_peak,
+  NULL, NULL, NULL, NULL, NULL, NULL  /* one engine only */
+};
+
+static float timestep(const t_param params, const t_tiles tiles, t_speeds speeds, t_speeds tmp_speeds,
+                      int* restrict obstacles, int* unstable_tile, float* force)
 {
 
-  float* restrict s0 = speeds.s0;
   float* restrict s1 = speeds.s1;
-  float* restrict s2 = speeds.s2;
   float* restrict s3 = speeds.s3;
-  float* restrict s4 = speeds.s4;
   float* restrict s5 = speeds.s5;
   float* restrict s6 = speeds.s6;
   float* restrict s7 = speeds.s7;
@@ -288,72 +503,48 @@ float timestep(const t_param params, t_speeds speeds, t_speeds tmp_speeds,int* r
   const float w11 = params.density * params.accel / 9.f;
   const float w21 = params.density * params.accel / 36.f;
 
-  /* modify the 2nd row of the grid */
-  int jj = params.ny - 2;
+  /* modify the 2nd row of the grid, across its tiles */
+  const int accel_row = (params.ny - 2) % tiles.ny;
+  const int* restrict accel_tiles = tiles.base + (params.ny - 2) / tiles.ny * tiles.ntx;
   #pragma vector aligned
   #pragma ivdep
-  __assume_aligned(s0,64);
   __assume_aligned(s1,64);
-  __assume_aligned(s2,64);
   __assume_aligned(s3,64);
-  __assume_aligned(s4,64);
   __assume_aligned(s5,64);
   __assume_aligned(s6,64);
   __assume_aligned(s7,64);
   __assume_aligned(s8,64);
-  __assume(params.nx%128==0);
-  __assume(params.nx%64==0);
-  __assume(params.nx%32==0);
-  __assume(params.nx%16==0);
-  __assume(params.nx%8==0);
-  __assume(params.nx%4==0);
-  __assume(params.nx%2==0);
-  #pragma omp parallel for simd default(none) shared(s0,s1,s2,s3,s4,s5,s6,s7,s8,obstacles,jj)
+  #pragma omp parallel for simd default(none) shared(s1,s3,s5,s6,s7,s8,obstacles,accel_tiles)
   for (int ii = 0; ii < params.nx; ii++)
   {
+    const int index = accel_tiles[ii / tiles.nx] + accel_row * tile_width(tiles, ii / tiles.nx) + ii % tiles.nx;
+
     /* if the cell is not occupied and
     ** we don't send a negative density */
-    if (!obstacles[ii + jj*params.nx]
-        && (s3[ii + jj*params.nx] - w11) > 0.f
-        && (s6[ii + jj*params.nx] - w21) > 0.f
-        && (s7[ii + jj*params.nx] - w21) > 0.f)
+    if (!obstacles[index]
+        && (s3[index] - w11) > 0.f
+        && (s6[index] - w21) > 0.f
+        && (s7[index] - w21) > 0.f)
     {
       /* increase 'east-side' densities */
-      s1[ii + jj*params.nx] += w11;
-      s5[ii + jj*params.nx] += w21;
-      s8[ii + jj*params.nx] += w21;
+      s1[index] += w11;
+      s5[index] += w21;
+      s8[index] += w21;
       /* decrease 'west-side' densities */
-      s3[ii + jj*params.nx] -= w11;
-      s6[ii + jj*params.nx] -= w21;
-      s7[ii + jj*params.nx] -= w21;
+      s3[index] -= w11;
+      s6[index] -= w21;
+      s7[index] -= w21;
     }
   }
 
-  //PROPOGATE
-  const float c_sq = 1.f / 3.f; /* square of speed of sound */
-  const float c_sq_inv = 3.f;
-  const float temp1 = 4.5f;
-  const float w0 = 4.f / 9.f;  /* weighting factor */
-  const float w1 = 1.f / 9.f;  /* weighting factor */
-  const float w2 = 1.f / 36.f; /* weighting factor */
-
-
   //AVERAGE VELOCITY VARS
   int   tot_cells = 0;  /* no. of cells used in calculation */
   float tot_u = 0.f;          /* accumulated magnitudes of velocity for each cell */
+  long long tot_exact = 0;     /* the same in units of 1/EXACT_SCALE, with --deterministic */
+  int   first_tile = params.ny * tiles.ntx;  /* first row of a tile with a non-finite or negative density */
+  float label_force[2*MAXLABELS] = {0.f};  /* x, y force on each label */
 
 
-  #pragma vector aligned
-  #pragma ivdep
-  __assume_aligned(s0,64);
-  __assume_aligned(s1,64);
-  __assume_aligned(s2,64);
-  __assume_aligned(s3,64);
-  __assume_aligned(s4,64);
-  __assume_aligned(s5,64);
-  __assume_aligned(s6,64);
-  __assume_aligned(s7,64);
-  __assume_aligned(s8,64);
   __assume_aligned(tmp_s0,64);
   __assume_aligned(tmp_s1,64);
   __assume_aligned(tmp_s2,64);
@@ -363,513 +554,409 @@ float timestep(const t_param params, t_speeds speeds, t_speeds tmp_speeds,int* r
   __assume_aligned(tmp_s6,64);
   __assume_aligned(tmp_s7,64);
   __assume_aligned(tmp_s8,64);
-  __assume(params.nx%128==0);
-  __assume(params.nx%64==0);
-  __assume(params.nx%32==0);
-  __assume(params.nx%16==0);
-  __assume(params.nx%8==0);
-  __assume(params.nx%4==0);
-  __assume(params.nx%2==0);
-  __assume(params.ny%128==0);
-  __assume(params.ny%64==0);
-  __assume(params.ny%32==0);
-  __assume(params.ny%16==0);
-  __assume(params.ny%8==0);
-  __assume(params.ny%4==0);
-  __assume(params.ny%2==0);
-  #pragma omp parallel for default(none) shared(s0,s1,s2,s3,s4,s5,s6,s7,s8,tmp_s0,tmp_s1,tmp_s2,tmp_s3,tmp_s4,tmp_s5,tmp_s6,tmp_s7,tmp_s8,obstacles) reduction(+:tot_cells) reduction(+:tot_u)
-  for (int jj = 0; jj < params.ny; jj++)
+  #pragma omp parallel for default(none) shared(speeds,tmp_speeds,tmp_s0,tmp_s1,tmp_s2,tmp_s3,tmp_s4,tmp_s5,tmp_s6,tmp_s7,tmp_s8,obstacles) reduction(+:tot_cells) reduction(+:tot_u) reduction(+:tot_exact) reduction(min:first_tile) reduction(+:label_force[:2*MAXLABELS])
+  for (int tr = 0; tr < tiles.ntx * tiles.nty * tiles.ny; tr++)
   {
-    for (int ii = 0; ii < params.nx; ii++)
+    int unstable = 0;  /* whether the row has a non-finite or negative density */
+
+    /* the row of the tile, in the order they are stored, and its tiles
+    ** and rows around respecting periodic boundary conditions (wrap around) */
+    const int tile = tiles.order[tr / tiles.ny];
+    const int tx = tile % tiles.ntx;
+    const int ty = tile / tiles.ntx;
+    const int r = tr % tiles.ny;
+
+    /* the tiles of the last row may have fewer rows */
+    if (r >= tile_height(tiles, ty)) continue;
+
+    const int jj = ty * tiles.ny + r;
+    const int tx_e = (tx + 1) % tiles.ntx;
+    const int tx_w = (tx == 0) ? (tx + tiles.ntx - 1) : (tx - 1);
+    const int ty_n = (r == tile_height(tiles, ty) - 1) ? (ty + 1) % tiles.nty : ty;
+    const int ty_s = (r == 0) ? ((ty == 0) ? (ty + tiles.nty - 1) : (ty - 1)) : ty;
+    const int r_n = (r == tile_height(tiles, ty) - 1) ? 0 : (r + 1);
+    const int r_s = (r == 0) ? (tile_height(tiles, ty_s) - 1) : (r - 1);
+    const int nx = tile_width(tiles, tx);
+    const int nx_e = tile_width(tiles, tx_e);
+    const int nx_w = tile_width(tiles, tx_w);
+
+    /* first cell of the row, the rows north and south of it and of the same rows of the tile east,
+    ** and last cell of the same rows of the tile west */
+    const int row   = tiles.base[ty*tiles.ntx + tx] + r*nx;
+    const int row_e = tiles.base[ty*tiles.ntx + tx_e] + r*nx_e;
+    const int row_w = tiles.base[ty*tiles.ntx + tx_w] + r*nx_w + nx_w - 1;
+    const int row_n = tiles.base[ty_n*tiles.ntx + tx] + r_n*nx;
+    const int row_ne = tiles.base[ty_n*tiles.ntx + tx_e] + r_n*nx_e;
+    const int row_nw = tiles.base[ty_n*tiles.ntx + tx_w] + r_n*nx_w + nx_w - 1;
+    const int row_s = tiles.base[ty_s*tiles.ntx + tx] + r_s*nx;
+    const int row_se = tiles.base[ty_s*tiles.ntx + tx_e] + r_s*nx_e;
+    const int row_sw = tiles.base[ty_s*tiles.ntx + tx_w] + r_s*nx_w + nx_w - 1;
+
+    const t_row rows = {row, row_e, row_w, row_n, row_ne, row_nw, row_s, row_se, row_sw};
+
+    /* each operator has a row loop of its own, picked once per row */
+    switch (params.collision)
     {
-      int index = ii + jj*params.nx;
-      /* determine indices of axis-direction neighbours
-      ** respecting periodic boundary conditions (wrap around) */
-      int y_n = (jj + 1) % params.ny;
-      int x_e = (ii + 1) % params.nx;
-      int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
-      int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
-      /* propagate densities from neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */
-      tmp_s0[index] = s0[index]; /* central cell, no movement */
-      tmp_s1[index] = s1[x_w + jj*params.nx]; /* east */
-      tmp_s2[index] = s2[ii + y_s*params.nx]; /* north */
-      tmp_s3[index] = s3[x_e + jj*params.nx]; /* west */
-      tmp_s4[index] = s4[ii + y_n*params.nx]; /* south */
-      tmp_s5[index] = s5[x_w + y_s*params.nx]; /* north-east */
-      tmp_s6[index] = s6[x_e + y_s*params.nx]; /* north-west */
-      tmp_s7[index] = s7[x_e + y_n*params.nx]; /* south-west */
-      tmp_s8[index] = s8[x_w + y_n*params.nx]; /* south-east */
-
-
-        /* compute local density total */
-        float local_density = 0.f;
-        local_density += tmp_s0[index];
-        local_density += tmp_s1[index];
-        local_density += tmp_s2[index];
-        local_density += tmp_s3[index];
-        local_density += tmp_s4[index];
-        local_density += tmp_s5[index];
-        local_density += tmp_s6[index];
-        local_density += tmp_s7[index];
-        local_density += tmp_s8[index];
-
-        /* compute x velocity component */
-        float u_x = (tmp_s1[index]
-                      + tmp_s5[index]
-                      + tmp_s8[index]
-                      - tmp_s3[index]
-                      - tmp_s6[index]
-                      - tmp_s7[index])
-                     / local_density;
-        /* compute y velocity component */
-        float u_y = (tmp_s2[index]
-                      + tmp_s5[index]
-                      + tmp_s6[index]
-                      - tmp_s4[index]
-                      - tmp_s7[index]
-                      - tmp_s8[index])
-                     / local_density;
-
-        /* velocity squared */
-        float temp2 = - (u_x * u_x + u_y * u_y)/ (2.f * c_sq);
-
-        /* equilibrium densities */
-        float d_equ[NSPEEDS];
-        /* zero velocity density: weight w0 */
-        d_equ[0] = w0 * local_density
-                   * (1.f + temp2);
-        /* axis speeds: weight w1 */
-        d_equ[1] = w1 * local_density * (1.f + u_x * c_sq_inv
-                                         + (u_x * u_x) * temp1
-                                         + temp2);
-        d_equ[2] = w1 * local_density * (1.f + u_y * c_sq_inv
-                                         + (u_y * u_y) * temp1
-                                         + temp2);
-        d_equ[3] = w1 * local_density * (1.f - u_x * c_sq_inv
-                                         + (u_x * u_x) * temp1
-                                         + temp2);
-        d_equ[4] = w1 * local_density * (1.f - u_y * c_sq_inv
-                                         + (u_y * u_y) * temp1
-                                         + temp2);
-        /* diagonal speeds: weight w2 */
-        d_equ[5] = w2 * local_density * (1.f + (u_x + u_y) * c_sq_inv
-                                         + ((u_x + u_y) * (u_x + u_y)) * temp1
-                                         + temp2);
-        d_equ[6] = w2 * local_density * (1.f + (-u_x + u_y) * c_sq_inv
-                                         + ((-u_x + u_y) * (-u_x + u_y)) * temp1
-                                         + temp2);
-        d_equ[7] = w2 * local_density * (1.f + (-u_x - u_y) * c_sq_inv
-                                         + ((-u_x - u_y) * (-u_x - u_y)) * temp1
-                                         + temp2);
-        d_equ[8] = w2 * local_density * (1.f + (u_x - u_y) * c_sq_inv
-                                         + ((u_x - u_y) * (u_x - u_y)) * temp1
-                                         + temp2);
-        float tmp;
-
-        tmp_s0[index] = (obstacles[index]) ? tmp_s0[index] : tmp_s0[index] + params.omega * (d_equ[0] - tmp_s0[index]);
-        tmp = tmp_s1[index];
-        tmp_s1[index] = (obstacles[index]) ? tmp_s3[index] : tmp_s1[index] + params.omega * (d_equ[1] - tmp_s1[index]);
-        tmp_s3[index] = (obstacles[index]) ? tmp : tmp_s3[index] + params.omega * (d_equ[3] - tmp_s3[index]);
-        tmp = tmp_s2[index];
-        tmp_s2[index] = (obstacles[index]) ? tmp_s4[index] : tmp_s2[index] + params.omega * (d_equ[2] - tmp_s2[index]);
-        tmp_s4[index] = (obstacles[index]) ? tmp : tmp_s4[index] + params.omega * (d_equ[4] - tmp_s4[index]);
-        tmp = tmp_s5[index];
-        tmp_s5[index] = (obstacles[index]) ? tmp_s7[index] : tmp_s5[index] + params.omega * (d_equ[5] - tmp_s5[index]);
-        tmp_s7[index] = (obstacles[index]) ? tmp : tmp_s7[index] + params.omega * (d_equ[7] - tmp_s7[index]);
-        tmp = tmp_s6[index];
-        tmp_s6[index] = (obstacles[index]) ? tmp_s8[index] : tmp_s6[index] + params.omega * (d_equ[6] - tmp_s6[index]);
-        tmp_s8[index] = (obstacles[index]) ? tmp : tmp_s8[index] + params.omega * (d_equ[8] - tmp_s8[index]);
-
-        //AVERAGE VELOCITY CODE
-        /* local density total */
-        local_density = 0.f;
-        local_density += tmp_s0[index];
-        local_density += tmp_s1[index];
-        local_density += tmp_s2[index];
-        local_density += tmp_s3[index];
-        local_density += tmp_s4[index];
-        local_density += tmp_s5[index];
-        local_density += tmp_s6[index];
-        local_density += tmp_s7[index];
-        local_density += tmp_s8[index];
-        local_density = 1/local_density;
-
-        /* x-component of velocity */
-        u_x = (tmp_s1[index]
-                      + tmp_s5[index]
-                      + tmp_s8[index]
-                      - tmp_s3[index]
-                      - tmp_s6[index]
-                      - tmp_s7[index])
-                     * local_density;
-        /* compute y velocity component */
-        u_y = (tmp_s2[index]
-                      + tmp_s5[index]
-                      + tmp_s6[index]
-                      - tmp_s4[index]
-                      - tmp_s7[index]
-                      - tmp_s8[index])
-                     * local_density;
-        /* accumulate the norm of x- and y- velocity components */
-        tot_u += (obstacles[index]) ? 0 : sqrtf((u_x * u_x) + (u_y * u_y)) ;
-        /* increase counter of inspected cells */
-        tot_cells += (obstacles[index]) ? 0 : 1 ;
-
-
+      case COLLISION_TRT:
+        stream_collide_row(params, COLLISION_TRT, nx, speeds, tmp_speeds, obstacles, rows,
+                           &tot_u, &tot_cells, &unstable);
+        break;
+      case COLLISION_MRT:
+        stream_collide_row(params, COLLISION_MRT, nx, speeds, tmp_speeds, obstacles, rows,
+                           &tot_u, &tot_cells, &unstable);
+        break;
+      default:
+        stream_collide_row(params, COLLISION_BGK, nx, speeds, tmp_speeds, obstacles, rows,
+                           &tot_u, &tot_cells, &unstable);
+        break;
     }
-  }
-
-  return tot_u / (float)tot_cells;
-}
-
-float av_velocity(const t_param params, t_speed* cells, int* obstacles)
-{
-  int    tot_cells = 0;  /* no. of cells used in calculation */
-  float tot_u;          /* accumulated magnitudes of velocity for each cell */
 
-  /* initialise */
-  tot_u = 0.f;
+    if (unstable && jj * tiles.ntx + tx < first_tile) first_tile = jj * tiles.ntx + tx;
 
-  /* loop over all non-blocked cells */
-  for (int jj = 0; jj < params.ny; jj++)
-  {
-    for (int ii = 0; ii < params.nx; ii++)
+    /* the velocities of the row again, still in cache, truncated to fixed point */
+    if (params.deterministic)
     {
-      /* ignore occupied cells */
-      if (!obstacles[ii + jj*params.nx])
+      for (int ii = 0; ii < nx; ii++)
       {
-        /* local density total */
-        float local_density = 0.f;
-
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += cells[ii + jj*params.nx].speeds[kk];
-        }
-
-        /* x-component of velocity */
-        float u_x = (cells[ii + jj*params.nx].speeds[1]
-                      + cells[ii + jj*params.nx].speeds[5]
-                      + cells[ii + jj*params.nx].speeds[8]
-                      - (cells[ii + jj*params.nx].speeds[3]
-                         + cells[ii + jj*params.nx].speeds[6]
-                         + cells[ii + jj*params.nx].speeds[7]))
-                     / local_density;
-        /* compute y velocity component */
-        float u_y = (cells[ii + jj*params.nx].speeds[2]
-                      + cells[ii + jj*params.nx].speeds[5]
-                      + cells[ii + jj*params.nx].speeds[6]
-                      - (cells[ii + jj*params.nx].speeds[4]
-                         + cells[ii + jj*params.nx].speeds[7]
-                         + cells[ii + jj*params.nx].speeds[8]))
-                     / local_density;
-        /* accumulate the norm of x- and y- velocity components */
-        tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
-        /* increase counter of inspected cells */
-        ++tot_cells;
-      }
-    }
-  }
-
-  return tot_u / (float)tot_cells;
-}
-
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed** cells_ptr, t_speed** tmp_scells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr)
-{
-  char   message[1024];  /* message buffer */
-  FILE*   fp;            /* file pointer */
-  int    xx, yy;         /* generic array indices */
-  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
-  int    retval;         /* to hold return value for checking */
-
-  /* open the parameter file */
-  fp = fopen(paramfile, "r");
-
-  if (fp == NULL)
-  {
-    sprintf(message, "could not open input parameter file: %s", paramfile);
-    die(message, __LINE__, __FILE__);
-  }
-
-  /* read in the parameter values */
-  retval = fscanf(fp, "%d\n", &(params->nx));
-
-  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->ny));
-
-  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->maxIters));
-
-  if (retval != 1) die("could not read param file: maxIters", __LINE__, __FILE__);
+        const int index = row + ii;
 
-  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
+        if (obstacles[index]) continue;
 
-  if (retval != 1) die("could not read param file: reynolds_dim", __LINE__, __FILE__);
+        const float density = tmp_s0[index] + tmp_s1[index] + tmp_s2[index] + tmp_s3[index] + tmp_s4[index]
+                            + tmp_s5[index] + tmp_s6[index] + tmp_s7[index] + tmp_s8[index];
+        const float u_x = (tmp_s1[index] + tmp_s5[index] + tmp_s8[index]
+                           - tmp_s3[index] - tmp_s6[index] - tmp_s7[index]) / density;
+        const float u_y = (tmp_s2[index] + tmp_s5[index] + tmp_s6[index]
+                           - tmp_s4[index] - tmp_s7[index] - tmp_s8[index]) / density;
 
-  retval = fscanf(fp, "%f\n", &(params->density));
-
-  if (retval != 1) die("could not read param file: density", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->accel));
-
-  if (retval != 1) die("could not read param file: accel", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->omega));
-
-  if (retval != 1) die("could not read param file: omega", __LINE__, __FILE__);
-
-  /* and close up the file */
-  fclose(fp);
-
-  /*
-  ** Allocate memory.
-  **
-  ** Remember C is pass-by-value, so we need to
-  ** pass pointers into the initialise function.
-  **
-  ** NB we are allocating a 1D array, so that the
-  ** memory will be contiguous.  We still want to
-  ** index this memory as if it were a (row major
-  ** ordered) 2D array, however.  We will perform
-  ** some arithmetic using the row and column
-  ** coordinates, inside the square brackets, when
-  ** we want to access elements of this array.
-  **
-  ** Note also that we are using a structure to
-  ** hold an array of 'speeds'.  We will allocate
-  ** a 1D array of these structs.
-  */
-
-  /* main grid */
-  *cells_ptr = (t_speed*)malloc(sizeof(t_speed) * (params->ny * params->nx));
-
-  if (*cells_ptr == NULL) die("cannot allocate memory for cells", __LINE__, __FILE__);
-
-  /* 'helper' grid, used as scratch space */
-  *tmp_scells_ptr = (t_speed*)malloc(sizeof(t_speed) * (params->ny * params->nx));
-
-  if (*tmp_scells_ptr == NULL) die("cannot allocate memory for tmp_scells", __LINE__, __FILE__);
-
-  /* the map of obstacles */
-  *obstacles_ptr = malloc(sizeof(int) * (params->ny * params->nx));
-
-  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
-
-  /* initialise densities */
-  float w0 = params->density * 4.f / 9.f;
-  float w1 = params->density      / 9.f;
-  float w2 = params->density      / 36.f;
-
-  for (int jj = 0; jj < params->ny; jj++)
-  {
-    for (int ii = 0; ii < params->nx; ii++)
-    {
-      /* centre */
-      (*cells_ptr)[ii + jj*params->nx].speeds[0] = w0;
-      /* axis directions */
-      (*cells_ptr)[ii + jj*params->nx].speeds[1] = w1;
-      (*cells_ptr)[ii + jj*params->nx].speeds[2] = w1;
-      (*cells_ptr)[ii + jj*params->nx].speeds[3] = w1;
-      (*cells_ptr)[ii + jj*params->nx].speeds[4] = w1;
-      /* diagonals */
-      (*cells_ptr)[ii + jj*params->nx].speeds[5] = w2;
-      (*cells_ptr)[ii + jj*params->nx].speeds[6] = w2;
-      (*cells_ptr)[ii + jj*params->nx].speeds[7] = w2;
-      (*cells_ptr)[ii + jj*params->nx].speeds[8] = w2;
+        tot_exact += (long long)(sqrtf((u_x * u_x) + (u_y * u_y)) * EXACT_SCALE);
+      }
     }
-  }
 
-  /* first set all cells in obstacle array to zero */
-  for (int jj = 0; jj < params->ny; jj++)
-  {
-    for (int ii = 0; ii < params->nx; ii++)
+    /* momentum exchange with the blocked cells of the row, still in cache */
+    if (params.nlabels > 0)
     {
-      (*obstacles_ptr)[ii + jj*params->nx] = 0;
+      for (int ii = 0; ii < nx; ii++)
+      {
+        const int index = row + ii;
+
+        if (!obstacles[index]) continue;
+
+        const int y_n = row_n + ii;
+        const int x_e = (ii == nx - 1) ? row_e : (index + 1);
+        const int y_s = row_s + ii;
+        const int x_w = (ii == 0) ? row_w : (index - 1);
+        const int x_e_y_n = (ii == nx - 1) ? row_ne : (y_n + 1);
+        const int x_w_y_n = (ii == 0) ? row_nw : (y_n - 1);
+        const int x_e_y_s = (ii == nx - 1) ? row_se : (y_s + 1);
+        const int x_w_y_s = (ii == 0) ? row_sw : (y_s - 1);
+
+        /* each population that came in from an open cell took its momentum
+        ** there and brought it back reversed: twice its momentum is handed
+        ** over. Rebounded, it now sits in the opposite speed. */
+        const float f1 = obstacles[x_w]     ? 0.f : tmp_s3[index];
+        const float f2 = obstacles[y_s]     ? 0.f : tmp_s4[index];
+        const float f3 = obstacles[x_e]     ? 0.f : tmp_s1[index];
+        const float f4 = obstacles[y_n]     ? 0.f : tmp_s2[index];
+        const float f5 = obstacles[x_w_y_s] ? 0.f : tmp_s7[index];
+        const float f6 = obstacles[x_e_y_s] ? 0.f : tmp_s8[index];
+        const float f7 = obstacles[x_e_y_n] ? 0.f : tmp_s5[index];
+        const float f8 = obstacles[x_w_y_n] ? 0.f : tmp_s6[index];
+        const int   label = obstacles[index] - 1;
+
+        label_force[2*label]     += 2.f * (f1 - f3 + f5 - f6 - f7 + f8);
+        label_force[2*label + 1] += 2.f * (f2 - f4 + f5 + f6 - f7 - f8);
+      }
     }
   }
 
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile, "r");
-
-  if (fp == NULL)
-  {
-    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
-    die(message, __LINE__, __FILE__);
-  }
-
-  /* read-in the blocked cells list */
-  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
-  {
-    /* some checks */
-    if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
-
-    if (xx < 0 || xx > params->nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
-
-    if (yy < 0 || yy > params->ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
-
-    if (blocked != 1) die("obstacle blocked value should be 1", __LINE__, __FILE__);
-
-    /* assign to array */
-    (*obstacles_ptr)[xx + yy*params->nx] = blocked;
-  }
-
-  /* and close the file */
-  fclose(fp);
-
-  /*
-  ** allocate space to hold a record of the avarage velocities computed
-  ** at each timestep
-  */
-  *av_vels_ptr = (float*)malloc(sizeof(float) * params->maxIters);
-
-  return EXIT_SUCCESS;
-}
-
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_scells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr)
-{
-  /*
-  ** free up allocated memory
-  */
-  free(*cells_ptr);
-  *cells_ptr = NULL;
-
-  free(*tmp_scells_ptr);
-  *tmp_scells_ptr = NULL;
+  *unstable_tile = first_tile;
 
-  free(*obstacles_ptr);
-  *obstacles_ptr = NULL;
+  for (int ll = 0; ll < 2*params.nlabels; ll++) force[ll] = label_force[ll];
 
-  free(*av_vels_ptr);
-  *av_vels_ptr = NULL;
+  if (params.deterministic) return (float)((double)tot_exact / EXACT_SCALE / tot_cells);
 
-  return EXIT_SUCCESS;
+  return tot_u / (float)tot_cells;
 }
 
-
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles)
+static inline void relax_pair(const t_param params, const float f[NSPEEDS], const float d_equ[NSPEEDS],
+                              float g[NSPEEDS], const int i, const int j)
 {
-  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+  const float even = params.omega * 0.5f * ((d_equ[i] + d_equ[j]) - (f[i] + f[j]));
+  const float odd = params.omega_odd * 0.5f * ((d_equ[i] - d_equ[j]) - (f[i] - f[j]));
 
-  return av_velocity(params, cells, obstacles) * params.reynolds_dim / viscosity;
+  g[i] = f[i] + even + odd;
+  g[j] = f[j] + even - odd;
 }
 
-float total_density(const t_param params, t_speed* cells)
+static inline void relax(const int collision, const t_param params, const float f[NSPEEDS],
+                         const float d_equ[NSPEEDS], float g[NSPEEDS])
 {
-  float total = 0.f;  /* accumulator */
-
-  for (int jj = 0; jj < params.ny; jj++)
+  if (collision == COLLISION_TRT)
   {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      for (int kk = 0; kk < NSPEEDS; kk++)
-      {
-        total += cells[ii + jj*params.nx].speeds[kk];
-      }
-    }
+    /* the rest population is even; each other one pairs with its opposite */
+    g[0] = f[0] + params.omega * (d_equ[0] - f[0]);
+    relax_pair(params, f, d_equ, g, 1, 3);
+    relax_pair(params, f, d_equ, g, 2, 4);
+    relax_pair(params, f, d_equ, g, 5, 7);
+    relax_pair(params, f, d_equ, g, 6, 8);
   }
-
-  return total;
-}
-
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels)
-{
-  FILE* fp;                     /* file pointer */
-  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
-  float local_density;         /* per grid cell sum of densities */
-  float pressure;              /* fluid pressure in grid cell */
-  float u_x;                   /* x-component of velocity in grid cell */
-  float u_y;                   /* y-component of velocity in grid cell */
-  float u;                     /* norm--root of summed squares--of u_x and u_y */
-
-  fp = fopen(FINALSTATEFILE, "w");
-
-  if (fp == NULL)
+  else if (collision == COLLISION_MRT)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    /* the moments of the non-equilibrium parts the density and momentum have none of */
+    float n[NSPEEDS];
+
+    for (int i = 0; i < NSPEEDS; i++) n[i] = f[i] - d_equ[i];
+
+    const float e   = -4.f*n[0] - n[1] - n[2] - n[3] - n[4] + 2.f*(n[5] + n[6] + n[7] + n[8]);
+    const float eps =  4.f*n[0] - 2.f*(n[1] + n[2] + n[3] + n[4]) + n[5] + n[6] + n[7] + n[8];
+    const float q_x = -2.f*n[1] + 2.f*n[3] + n[5] - n[6] - n[7] + n[8];
+    const float q_y = -2.f*n[2] + 2.f*n[4] + n[5] + n[6] - n[7] - n[8];
+    const float p_xx = n[1] - n[2] + n[3] - n[4];
+    const float p_xy = n[5] - n[6] + n[7] - n[8];
+
+    /* each relaxed at its own rate and divided by the norm of its row of the transform */
+    const float a_e   = params.s_e * e / 36.f;
+    const float a_eps = params.s_eps * eps / 36.f;
+    const float a_qx  = params.s_q * q_x / 12.f;
+    const float a_qy  = params.s_q * q_y / 12.f;
+    const float a_xx  = params.omega * p_xx / 4.f;
+    const float a_xy  = params.omega * p_xy / 4.f;
+
+    /* and back to the populations through the transpose of the transform */
+    g[0] = f[0] - (-4.f*a_e + 4.f*a_eps);
+    g[1] = f[1] - (-a_e - 2.f*a_eps - 2.f*a_qx + a_xx);
+    g[2] = f[2] - (-a_e - 2.f*a_eps - 2.f*a_qy - a_xx);
+    g[3] = f[3] - (-a_e - 2.f*a_eps + 2.f*a_qx + a_xx);
+    g[4] = f[4] - (-a_e - 2.f*a_eps + 2.f*a_qy - a_xx);
+    g[5] = f[5] - (2.f*a_e + a_eps + a_qx + a_qy + a_xy);
+    g[6] = f[6] - (2.f*a_e + a_eps - a_qx + a_qy - a_xy);
+    g[7] = f[7] - (2.f*a_e + a_eps - a_qx - a_qy + a_xy);
+    g[8] = f[8] - (2.f*a_e + a_eps + a_qx - a_qy - a_xy);
   }
-
-  for (int jj = 0; jj < params.ny; jj++)
+  else
   {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      /* an occupied cell */
-      if (obstacles[ii + jj*params.nx])
-      {
-        u_x = u_y = u = 0.f;
-        pressure = params.density * c_sq;
-      }
-      /* no obstacle */
-      else
-      {
-        local_density = 0.f;
-
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += cells[ii + jj*params.nx].speeds[kk];
-        }
-
-        /* compute x velocity component */
-        u_x = (cells[ii + jj*params.nx].speeds[1]
-               + cells[ii + jj*params.nx].speeds[5]
-               + cells[ii + jj*params.nx].speeds[8]
-               - (cells[ii + jj*params.nx].speeds[3]
-                  + cells[ii + jj*params.nx].speeds[6]
-                  + cells[ii + jj*params.nx].speeds[7]))
-              / local_density;
-        /* compute y velocity component */
-        u_y = (cells[ii + jj*params.nx].speeds[2]
-               + cells[ii + jj*params.nx].speeds[5]
-               + cells[ii + jj*params.nx].speeds[6]
-               - (cells[ii + jj*params.nx].speeds[4]
-                  + cells[ii + jj*params.nx].speeds[7]
-                  + cells[ii + jj*params.nx].speeds[8]))
-              / local_density;
-        /* compute norm of velocity */
-        u = sqrtf((u_x * u_x) + (u_y * u_y));
-        /* compute pressure */
-        pressure = local_density * c_sq;
-      }
-
-      /* write to file */
-      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, u_x, u_y, u, pressure, obstacles[ii * params.nx + jj]);
-    }
+    for (int i = 0; i < NSPEEDS; i++) g[i] = f[i] + params.omega * (d_equ[i] - f[i]);
   }
+}
 
-  fclose(fp);
+static inline void stream_collide_row(const t_param params, const int collision, const int nx,
+                                      const t_speeds speeds, t_speeds tmp_speeds, const int* restrict obstacles,
+                                      const t_row rows, float* tot_u, int* tot_cells, int* unstable)
+{
+  const float* restrict s0 = speeds.s0;
+  const float* restrict s1 = speeds.s1;
+  const float* restrict s2 = speeds.s2;
+  const float* restrict s3 = speeds.s3;
+  const float* restrict s4 = speeds.s4;
+  const float* restrict s5 = speeds.s5;
+  const float* restrict s6 = speeds.s6;
+  const float* restrict s7 = speeds.s7;
+  const float* restrict s8 = speeds.s8;
+  float* restrict tmp_s0 = tmp_speeds.s0;
+  float* restrict tmp_s1 = tmp_speeds.s1;
+  float* restrict tmp_s2 = tmp_speeds.s2;
+  float* restrict tmp_s3 = tmp_speeds.s3;
+  float* restrict tmp_s4 = tmp_speeds.s4;
+  float* restrict tmp_s5 = tmp_speeds.s5;
+  float* restrict tmp_s6 = tmp_speeds.s6;
+  float* restrict tmp_s7 = tmp_speeds.s7;
+  float* restrict tmp_s8 = tmp_speeds.s8;
 
-  fp = fopen(AVVELSFILE, "w");
+  /* first cell of the row, the rows north and south of it and of the same rows of the tile east,
+  ** and last cell of the same rows of the tile west */
+  const int row = rows.c;
+  const int row_e = rows.e;
+  const int row_w = rows.w;
+  const int row_n = rows.n;
+  const int row_ne = rows.ne;
+  const int row_nw = rows.nw;
+  const int row_s = rows.s;
+  const int row_se = rows.se;
+  const int row_sw = rows.sw;
 
-  if (fp == NULL)
-  {
-    die("could not open file output file", __LINE__, __FILE__);
-  }
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const float c_sq_inv = 3.f;
+  const float temp1 = 4.5f;
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
 
-  for (int ii = 0; ii < params.maxIters; ii++)
-  {
-    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
-  }
+  /* the sums so far, added to in the same order as in one loop over the rows */
+  float row_u = *tot_u;
+  int   row_cells = *tot_cells;
+  int   bad = 0;
 
-  fclose(fp);
+  #pragma vector aligned
+  #pragma ivdep
+  __assume_aligned(s0,64);
+  __assume_aligned(s1,64);
+  __assume_aligned(s2,64);
+  __assume_aligned(s3,64);
+  __assume_aligned(s4,64);
+  __assume_aligned(s5,64);
+  __assume_aligned(s6,64);
+  __assume_aligned(s7,64);
+  __assume_aligned(s8,64);
+  __assume_aligned(tmp_s0,64);
+  __assume_aligned(tmp_s1,64);
+  __assume_aligned(tmp_s2,64);
+  __assume_aligned(tmp_s3,64);
+  __assume_aligned(tmp_s4,64);
+  __assume_aligned(tmp_s5,64);
+  __assume_aligned(tmp_s6,64);
+  __assume_aligned(tmp_s7,64);
+  __assume_aligned(tmp_s8,64);
+  for (int ii = 0; ii < nx; ii++)
+  {
+    int index = row + ii;
+    /* determine indices of axis-direction neighbours,
+    ** in the tiles east or west at the ends of the row */
+    int y_n = row_n + ii;
+    int x_e = (ii == nx - 1) ? row_e : (index + 1);
+    int y_s = row_s + ii;
+    int x_w = (ii == 0) ? row_w : (index - 1);
+    int x_e_y_n = (ii == nx - 1) ? row_ne : (y_n + 1);
+    int x_w_y_n = (ii == 0) ? row_nw : (y_n - 1);
+    int x_e_y_s = (ii == nx - 1) ? row_se : (y_s + 1);
+    int x_w_y_s = (ii == 0) ? row_sw : (y_s - 1);
+    /* propagate densities from neighbouring cells, following
+    ** appropriate directions of travel and writing into
+    ** scratch space grid */
+    tmp_s0[index] = s0[index]; /* central cell, no movement */
+    tmp_s1[index] = s1[x_w]; /* east */
+    tmp_s2[index] = s2[y_s]; /* north */
+    tmp_s3[index] = s3[x_e]; /* west */
+    tmp_s4[index] = s4[y_n]; /* south */
+    tmp_s5[index] = s5[x_w_y_s]; /* north-east */
+    tmp_s6[index] = s6[x_e_y_s]; /* north-west */
+    tmp_s7[index] = s7[x_e_y_n]; /* south-west */
+    tmp_s8[index] = s8[x_w_y_n]; /* south-east */
+
+
+      /* compute local density total */
+      float local_density = 0.f;
+      local_density += tmp_s0[index];
+      local_density += tmp_s1[index];
+      local_density += tmp_s2[index];
+      local_density += tmp_s3[index];
+      local_density += tmp_s4[index];
+      local_density += tmp_s5[index];
+      local_density += tmp_s6[index];
+      local_density += tmp_s7[index];
+      local_density += tmp_s8[index];
+
+      /* a non-finite or negative density has the sign or all the exponent bits set */
+      const union { float f; unsigned int u; } bits = {local_density};
+      bad |= bits.u >= 0x7f800000u;
+
+      /* compute x velocity component */
+      float u_x = (tmp_s1[index]
+                    + tmp_s5[index]
+                    + tmp_s8[index]
+                    - tmp_s3[index]
+                    - tmp_s6[index]
+                    - tmp_s7[index])
+                   / local_density;
+      /* compute y velocity component */
+      float u_y = (tmp_s2[index]
+                    + tmp_s5[index]
+                    + tmp_s6[index]
+                    - tmp_s4[index]
+                    - tmp_s7[index]
+                    - tmp_s8[index])
+                   / local_density;
+
+      /* velocity squared */
+      float temp2 = - (u_x * u_x + u_y * u_y)/ (2.f * c_sq);
+
+      /* equilibrium densities */
+      float d_equ[NSPEEDS];
+      /* zero velocity density: weight w0 */
+      d_equ[0] = w0 * local_density
+                 * (1.f + temp2);
+      /* axis speeds: weight w1 */
+      d_equ[1] = w1 * local_density * (1.f + u_x * c_sq_inv
+                                       + (u_x * u_x) * temp1
+                                       + temp2);
+      d_equ[2] = w1 * local_density * (1.f + u_y * c_sq_inv
+                                       + (u_y * u_y) * temp1
+                                       + temp2);
+      d_equ[3] = w1 * local_density * (1.f - u_x * c_sq_inv
+                                       + (u_x * u_x) * temp1
+                                       + temp2);
+      d_equ[4] = w1 * local_density * (1.f - u_y * c_sq_inv
+                                       + (u_y * u_y) * temp1
+                                       + temp2);
+      /* diagonal speeds: weight w2 */
+      d_equ[5] = w2 * local_density * (1.f + (u_x + u_y) * c_sq_inv
+                                       + ((u_x + u_y) * (u_x + u_y)) * temp1
+                                       + temp2);
+      d_equ[6] = w2 * local_density * (1.f + (-u_x + u_y) * c_sq_inv
+                                       + ((-u_x + u_y) * (-u_x + u_y)) * temp1
+                                       + temp2);
+      d_equ[7] = w2 * local_density * (1.f + (-u_x - u_y) * c_sq_inv
+                                       + ((-u_x - u_y) * (-u_x - u_y)) * temp1
+                                       + temp2);
+      d_equ[8] = w2 * local_density * (1.f + (u_x - u_y) * c_sq_inv
+                                       + ((u_x - u_y) * (u_x - u_y)) * temp1
+                                       + temp2);
+      /* relax the open cells with the collision operator, rebound the blocked ones */
+      const float f[NSPEEDS] = {tmp_s0[index], tmp_s1[index], tmp_s2[index], tmp_s3[index], tmp_s4[index],
+                                tmp_s5[index], tmp_s6[index], tmp_s7[index], tmp_s8[index]};
+      float g[NSPEEDS];
+
+      relax(collision, params, f, d_equ, g);
+
+      tmp_s0[index] = (obstacles[index]) ? f[0] : g[0];
+      tmp_s1[index] = (obstacles[index]) ? f[3] : g[1];
+      tmp_s3[index] = (obstacles[index]) ? f[1] : g[3];
+      tmp_s2[index] = (obstacles[index]) ? f[4] : g[2];
+      tmp_s4[index] = (obstacles[index]) ? f[2] : g[4];
+      tmp_s5[index] = (obstacles[index]) ? f[7] : g[5];
+      tmp_s7[index] = (obstacles[index]) ? f[5] : g[7];
+      tmp_s6[index] = (obstacles[index]) ? f[8] : g[6];
+      tmp_s8[index] = (obstacles[index]) ? f[6] : g[8];
+
+      //AVERAGE VELOCITY CODE
+      /* local density total */
+      local_density = 0.f;
+      local_density += tmp_s0[index];
+      local_density += tmp_s1[index];
+      local_density += tmp_s2[index];
+      local_density += tmp_s3[index];
+      local_density += tmp_s4[index];
+      local_density += tmp_s5[index];
+      local_density += tmp_s6[index];
+      local_density += tmp_s7[index];
+      local_density += tmp_s8[index];
+      local_density = 1/local_density;
+
+      /* x-component of velocity */
+      u_x = (tmp_s1[index]
+                    + tmp_s5[index]
+                    + tmp_s8[index]
+                    - tmp_s3[index]
+                    - tmp_s6[index]
+                    - tmp_s7[index])
+                   * local_density;
+      /* compute y velocity component */
+      u_y = (tmp_s2[index]
+                    + tmp_s5[index]
+                    + tmp_s6[index]
+                    - tmp_s4[index]
+                    - tmp_s7[index]
+                    - tmp_s8[index])
+                   * local_density;
+      /* accumulate the norm of x- and y- velocity components */
+      row_u += (obstacles[index]) ? 0 : sqrtf((u_x * u_x) + (u_y * u_y)) ;
+      /* increase counter of inspected cells */
+      row_cells += (obstacles[index]) ? 0 : 1 ;
 
-  return EXIT_SUCCESS;
-}
 
-void die(const char* message, const int line, const char* file)
-{
-  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
-  fprintf(stderr, "%s\n", message);
-  fflush(stderr);
-  exit(EXIT_FAILURE);
-}
+  }
 
-void usage(const char* exe)
-{
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
-  exit(EXIT_FAILURE);
+  *tot_u = row_u;
+  *tot_cells = row_cells;
+  *unstable = bad;
 }
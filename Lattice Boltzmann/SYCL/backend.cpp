@@ -0,0 +1,256 @@
+/*
+** SYCL backend of the shared d2q9-bgk driver in ../Driver: every engine
+** of d2q9-bgk.cpp, run through LbmSolver. The engine is picked by the
+** options of the backend, which the driver hands on, and the obstacle
+** file may be a geometry the solver builds on the device. The lattice
+** the driver uploads is the one the solver starts from, so download()
+** only has to destroy the solver; the out-of-core engine maps that
+** lattice onto a file itself.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "lbm_solver.hpp"
+
+/* the driver's types share their names with the solver's */
+namespace driver {
+#include "lbm.h"
+}
+
+/* struct to hold the solver of the backend */
+typedef struct
+{
+  driver::t_param params;
+  t_options options;
+  LbmSolver* solver;
+  t_speeds cells;               /* the lattice file of the out-of-core engine, if mapped */
+  double updates;               /* cell updates per timestep, the refined patches included */
+  std::string report;           /* lines of the run summary, kept from the solver */
+} t_sycl;
+
+/* the options taken so far, for the solver allocate() creates */
+static t_options options = default_options();
+
+/* the solver's own parameters, the nz of the driver's included */
+static t_param solver_params(const driver::t_param params)
+{
+  t_param solver;
+
+  solver.nx = params.nx;
+  solver.ny = params.ny;
+  solver.nz = params.nz;
+  solver.maxIters = params.maxIters;
+  solver.reynolds_dim = params.reynolds_dim;
+  solver.density = params.density;
+  solver.accel = params.accel;
+  solver.omega = params.omega;
+  solver.collision = params.collision;
+  solver.omega_odd = params.omega_odd;
+  solver.s_e = params.s_e;
+  solver.s_eps = params.s_eps;
+  solver.s_q = params.s_q;
+
+  return solver;
+}
+
+static int sycl_option(const char* arg)
+{
+  return parse_option(arg, &options);
+}
+
+static int sycl_geometry(const char* spec)
+{
+  return parse_geometry(spec, &options.geometry);
+}
+
+static void* sycl_allocate(const driver::t_param params)
+{
+  t_sycl* state = new t_sycl;
+
+  state->params = params;
+  state->solver = NULL;
+  state->cells.s0 = NULL;
+  state->updates = 0.0;
+
+  /* the options of the backend, and those of the driver's the solver takes too */
+  state->options = options;
+  state->options.nlabels = params.nlabels;
+  state->options.deterministic = params.deterministic;
+  state->options.hugetlb = params.hugetlb;
+  state->options.layout = params.layout;
+
+  check_options(state->options);
+
+  /* the driver only asks a lattice deeper than one slice for its flow */
+  if ((options.lattice == LATTICE_D3Q19 || options.lattice == LATTICE_D3Q27) && params.nz == 1)
+    driver::die("--lattice=d3q19 and --lattice=d3q27 need nz > 1 in the parameter file", __LINE__, __FILE__);
+
+  return state;
+}
+
+static int sycl_cells(void* state, driver::t_speeds* cells)
+{
+  t_sycl* s = (t_sycl*)state;
+  char path[1024];              /* name of the lattice file */
+
+  if (!s->options.out_of_core) return 0;
+
+  /* the lattice of the even passes, lattice1 being that of the odd ones */
+  sprintf(path, "%s/d2q9-bgk.lattice0", s->options.out_of_core);
+  map_lattice(path, solver_params(s->params), &s->cells);
+
+  cells->s0 = s->cells.s0; cells->s1 = s->cells.s1; cells->s2 = s->cells.s2;
+  cells->s3 = s->cells.s3; cells->s4 = s->cells.s4; cells->s5 = s->cells.s5;
+  cells->s6 = s->cells.s6; cells->s7 = s->cells.s7; cells->s8 = s->cells.s8;
+
+  return 1;
+}
+
+static void sycl_upload(void* state, const driver::t_speeds cells, const int* obstacles)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  const t_speeds lattice = {cells.s0, cells.s1, cells.s2, cells.s3, cells.s4,
+                            cells.s5, cells.s6, cells.s7, cells.s8};
+
+  /* a generated geometry is written into obstacles as the solver is destroyed */
+  s->solver = new LbmSolver(solver_params(s->params), s->options, lattice, const_cast<int*>(obstacles));
+  s->updates = s->solver->updates();
+}
+
+static void sycl_step_batch(void* state, const int first, const int n)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  if (s->solver->steps() != first)
+    driver::die("timesteps must be taken in order", __LINE__, __FILE__);
+
+  s->solver->submit(n);
+}
+
+static void sycl_finish(void* state)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  s->solver->wait();
+}
+
+static int sycl_poll(void* state, const int wait, int tile[4])
+{
+  t_sycl* s = (t_sycl*)state;
+
+  /* only the population kernels of the D2Q9 lattice watch for instability */
+  if (s->options.engine != ENGINE_POPULATIONS || s->options.out_of_core
+      || s->options.lattice == LATTICE_D3Q19 || s->options.lattice == LATTICE_D3Q27
+      || s->options.refine != REFINE_NONE)
+    return -1;
+
+  return s->solver->unstable(tile, wait != 0);
+}
+
+static void sycl_reduce(void* state, const int first, const int n, float* av_vels)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  if (first + n > s->solver->steps())
+    driver::die("average velocity of a timestep not taken", __LINE__, __FILE__);
+
+  /* fills in every timestep so far, first to first+n-1 among them */
+  s->solver->av_velocities(av_vels);
+}
+
+static void sycl_forces(void* state, const int first, const int n, float* forces)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  if (first + n > s->solver->steps())
+    driver::die("force of a timestep not taken", __LINE__, __FILE__);
+
+  /* fills in every timestep so far, first to first+n-1 among them */
+  s->solver->forces(forces);
+}
+
+static void sycl_flow(void* state, float* density, float* u_x, float* u_y, float* u_z)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  s->solver->flow(density, u_x, u_y, u_z);
+}
+
+static void sycl_download(void* state, driver::t_speeds /* cells */)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  /* the patches and the summary go with the solver */
+  if (s->options.refine != REFINE_NONE) s->solver->write_patches();
+  s->report = s->solver->report();
+
+  /* destroying the solver writes the last lattice back into cells */
+  delete s->solver;
+  s->solver = NULL;
+}
+
+static void sycl_report(void* state)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  fputs(s->report.c_str(), stdout);
+}
+
+static double sycl_measure_peak(void* state)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  return measure_peak(s->options);
+}
+
+static void sycl_work(void* state, driver::t_work* work)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  work->engine = engine_name(s->options);
+  work->updates = s->updates;
+  work->cell_bytes = cell_bytes(s->options);
+}
+
+static void sycl_release(void* state)
+{
+  t_sycl* s = (t_sycl*)state;
+
+  delete s->solver;
+  if (s->cells.s0 != NULL) unmap_lattice(solver_params(s->params), &s->cells);
+  delete s;
+}
+
+const driver::t_backend driver::sycl_backend = {
+  "sycl",
+  256,                  /* timesteps submitted at a time */
+  2 * NSPEEDS * sizeof(float) + sizeof(int),
+  sycl_allocate,
+  sycl_upload,
+  sycl_step_batch,
+  sycl_finish,
+  sycl_poll,
+  sycl_reduce,
+  sycl_forces,
+  sycl_download,
+  sycl_release,
+  sycl_report,
+  sycl_measure_peak,
+  "       <obstaclefile> may instead be a geometry: shapes joined by '+', each one of\n"
+  "       rect:x0,y0,x1,y1, circle:cx,cy,r, porous:porosity,seed or channel:w\n"
+  "       [--coarsen=C] [--coarsen-dir=x|y] [--vector=N]\n"
+  "       [--engine=populations|moments] [--device=cpu|gpu|default]\n"
+  "       [--out-of-core=DIR] [--slab-rows=S] [--slab-steps=K]\n"
+  "       [--lattice=d2q9|d3q19|d3q27] [--refine=auto|x0,y0,x1,y1[+...]]\n"
+  "       --engine=moments is regularized BGK: its average velocity runs about 2%\n"
+  "       off the populations on 128x128 at omega 1.85, more than make check allows\n"
+  "       --watchdog only watches the population kernels of the D2Q9 lattice\n",
+  sycl_option,
+  sycl_geometry,
+  sycl_cells,
+  sycl_flow,
+  sycl_work
+};
@@ -0,0 +1,402 @@
+/*
+** Library interface of the d2q9-bgk lattice boltzmann code.
+**
+** LbmSolver keeps the lattice of the engine picked by the options on
+** the device and advances it on request, so a program can embed the
+** solver, or time its initialisation, its timesteps and its output
+** separately:
+**
+**   LbmSolver solver(params, options, cells, obstacles);
+**   solver.run(params.maxIters);    // returns once a helper thread is queueing the steps
+**   ...                             // overlap other host work
+**   solver.wait();
+**   printf("%f\n", solver.reynolds());
+**
+** The parameter and lattice types mirror those of the d2q9-bgk driver
+** in ../Driver, whose SYCL backend (backend.cpp) is built this way; see
+** d2q9-bgk.cpp for the meaning of each option. Link with liblbm.a,
+** built by 'make lib'.
+*/
+
+#pragma once
+
+#include <CL/sycl.hpp>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "huge.h"
+
+namespace sycl = cl::sycl;
+
+#define NSPEEDS         9
+#define LOCALSIZEX      128
+#define LOCALSIZEY      1
+#define COARSEN_X       0
+#define COARSEN_Y       1
+#define ENGINE_POPULATIONS 0
+#define ENGINE_MOMENTS  1
+#define DEVICE_DEFAULT  0
+#define DEVICE_CPU      1
+#define DEVICE_GPU      2
+#define MAXSHAPES       16
+#define SHAPE_RECT      0
+#define SHAPE_CIRCLE    1
+#define SHAPE_POROUS    2
+#define SHAPE_CHANNEL   3
+#define LATTICE_NONE    0
+#define LATTICE_D2Q9    1
+#define LATTICE_D3Q19   2
+#define LATTICE_D3Q27   3
+#define MAXPATCHES      8
+#define REFINE_NONE     0
+#define REFINE_BOXES    1
+#define REFINE_AUTO     2
+#define REFINE_MARGIN   8
+#ifndef TRIAD_SIZE
+#define TRIAD_SIZE      (1 << 24) /* elements of each STREAM triad array */
+#endif
+#define TRIAD_REPEATS   10        /* STREAM triad passes, the fastest is kept */
+#define MAXLABELS       8         /* obstacle labels the forces are reduced for */
+#define EXACT_SCALE     68719476736.0f /* 2^36, the fixed-point unit of --deterministic sums */
+#define COLLISION_BGK   0         /* one relaxation time, omega */
+#define COLLISION_TRT   1         /* omega for the even parts of the populations, omega_odd for the odd */
+#define COLLISION_MRT   2         /* a relaxation time per moment, omega for the stress */
+#define LAYOUT_ROWS     0         /* row-major, as the driver's cells */
+#define LAYOUT_TILED    1         /* row-major tiles, each tile row-major */
+#define LAYOUT_MORTON   2         /* the same tiles along a Z-order (Morton) curve */
+#ifndef TILE_Y
+#define TILE_Y          32        /* rows of a tile, each row a work-group of LOCALSIZEX cells */
+#endif
+
+/* struct to hold the parameter values */
+typedef struct
+{
+  int    nx;            /* no. of cells in x-direction */
+  int    ny;            /* no. of cells in y-direction */
+  int    nz;            /* no. of cells in z-direction, 1 for 2D lattices */
+  int    maxIters;      /* no. of iterations */
+  int    reynolds_dim;  /* dimension for Reynolds number */
+  float density;       /* density per link */
+  float accel;         /* density redistribution */
+  float omega;         /* relaxation parameter */
+  int    collision;     /* COLLISION_BGK, COLLISION_TRT or COLLISION_MRT */
+  float  omega_odd;     /* TRT relaxation of the odd parts, from the magic parameter */
+  float  s_e;           /* MRT relaxation of the energy */
+  float  s_eps;         /* MRT relaxation of the energy squared */
+  float  s_q;           /* MRT relaxation of the energy flux */
+} t_param;
+
+/* struct to hold the 'speed' values, one array per speed */
+typedef struct
+{
+  float* s0;
+  float* s1;
+  float* s2;
+  float* s3;
+  float* s4;
+  float* s5;
+  float* s6;
+  float* s7;
+  float* s8;
+} t_speeds;
+
+/* struct to hold the device buffers of one lattice, one per speed */
+typedef struct
+{
+  sycl::buffer<float, 1>* s0;
+  sycl::buffer<float, 1>* s1;
+  sycl::buffer<float, 1>* s2;
+  sycl::buffer<float, 1>* s3;
+  sycl::buffer<float, 1>* s4;
+  sycl::buffer<float, 1>* s5;
+  sycl::buffer<float, 1>* s6;
+  sycl::buffer<float, 1>* s7;
+  sycl::buffer<float, 1>* s8;
+} t_speed_buffers;
+
+/* struct to hold where the tiles of a lattice kept in tiles are on the device */
+typedef struct
+{
+  int ntx;                      /* no. of tiles in x-direction */
+  sycl::buffer<int, 1>* base;   /* first cell of each tile, tiles numbered along rows */
+  sycl::buffer<int, 1>* groups; /* first cell x + y*nx of the row of a tile each work-group takes */
+} t_tile_buffers;
+
+/* struct to hold the device buffers of one lattice stored as moments */
+typedef struct
+{
+  sycl::buffer<float, 1>* rho;  /* density */
+  sycl::buffer<float, 1>* ux;   /* x-component of velocity */
+  sycl::buffer<float, 1>* uy;   /* y-component of velocity */
+  sycl::buffer<float, 1>* pxx;  /* momentum flux tensor */
+  sycl::buffer<float, 1>* pxy;
+  sycl::buffer<float, 1>* pyy;
+} t_moment_buffers;
+
+/* struct to hold the moments of a single cell */
+typedef struct
+{
+  float rho;
+  float ux;
+  float uy;
+  float pxx;
+  float pxy;
+  float pyy;
+} t_moments;
+
+/* struct to hold one shape of a generated geometry */
+typedef struct
+{
+  int   type;           /* SHAPE_RECT, SHAPE_CIRCLE, SHAPE_POROUS or SHAPE_CHANNEL */
+  float a, b, c, d;     /* parameters of the shape, in the order they are given */
+  unsigned int seed;    /* seed of the random porous medium */
+} t_shape;
+
+/* struct to hold a geometry generated on the device instead of read from file */
+typedef struct
+{
+  int     nshapes;      /* no. of shapes, 0 when an obstacle file is used */
+  t_shape shapes[MAXSHAPES];
+} t_geometry;
+
+/* struct to hold the coarse cells covered by a refined patch, corners inclusive */
+typedef struct
+{
+  int x0, y0;
+  int x1, y1;
+} t_patch;
+
+/* struct to hold the command line options */
+typedef struct
+{
+  int coarsen;      /* no. of cells updated by each work-item */
+  int coarsen_dir;  /* direction of the strip of cells: COARSEN_X or COARSEN_Y */
+  int vector;       /* width of the sycl::vec used per work-item, 1 for scalar code */
+  int engine;       /* storage of a cell: ENGINE_POPULATIONS or ENGINE_MOMENTS */
+  int device;       /* device to run on: DEVICE_DEFAULT, DEVICE_CPU or DEVICE_GPU */
+  t_geometry geometry; /* obstacles to generate in place of the obstacle file */
+  const char* out_of_core; /* directory of the lattice files, NULL to keep the lattice in memory */
+  int slab_rows;    /* rows written back per out-of-core slab */
+  int slab_steps;   /* timesteps per out-of-core pass, and ghost rows either side of a slab */
+  int lattice;      /* descriptor of the generated kernel, LATTICE_NONE for the default D2Q9 */
+  int refine;       /* placement of refined patches: REFINE_NONE, REFINE_BOXES or REFINE_AUTO */
+  int npatches;     /* no. of refined patches given as boxes */
+  t_patch patches[MAXPATCHES];
+  int nlabels;      /* no. of obstacle labels to reduce forces for, 0 for none */
+  int deterministic; /* whether to sum the velocities in fixed point, to the same bits in any order */
+  int hugetlb;      /* whether to take the host lattices of the solver from reserved huge pages first */
+  int layout;       /* order of the cells on the device: LAYOUT_ROWS, LAYOUT_TILED or LAYOUT_MORTON */
+} t_options;
+
+/*
+** options of the engines, for programs built on the library
+*/
+
+/* the options of the original one cell per work-item kernel */
+t_options default_options(void);
+
+/* take a command line option into options, 0 if it is not one of them */
+int parse_option(const char* arg, t_options* options);
+
+/* die if options combine engines that do not go together */
+void check_options(const t_options options);
+
+/* take spec as a geometry into geometry, 0 if it is the name of an obstacle file */
+int parse_geometry(const char* spec, t_geometry* geometry);
+
+/* bytes moved to and from device memory per cell update by the engine of options, and its name */
+int cell_bytes(const t_options options);
+const char* engine_name(const t_options options);
+
+/* STREAM triad bandwidth of the device picked by options.device, in GB/s */
+double measure_peak(const t_options options);
+
+/* map a lattice file of nx*ny cells into memory, one plane per speed, and release it */
+void map_lattice(const char* path, const t_param params, t_speeds* lattice);
+void unmap_lattice(const t_param params, t_speeds* lattice);
+
+/* host accessor giving direct access to one speed of the device lattice */
+typedef sycl::accessor<float, 1, sycl::access::mode::read_write, sycl::access::target::host_buffer> t_field_access;
+
+/*
+** The engine picked by the options, on the device picked by
+** options.device: the population kernel picked by options.coarsen and
+** options.vector unless options.engine, options.out_of_core,
+** options.lattice or options.refine name another. The obstacles are
+** taken from options.geometry when it has shapes, and from the
+** obstacles array otherwise, which holds the generated ones once the
+** solver is gone. The lattice starts from cells, and cells hold the
+** current lattice again once the solver is gone; the 3D lattices start
+** at rest and leave cells alone. With options.out_of_core the second
+** lattice is a file of that directory, and cells had best be one too
+** (see map_lattice()).
+**
+** Forces on options.nlabels obstacle labels, the values of the blocked
+** cells in obstacles, are only reduced by the default D2Q9 kernel.
+** With options.deterministic every population kernel also sums the
+** velocities in fixed point, and av_velocities() gives those sums, the
+** same for any coarsening, vector width or work-group shape of a kernel.
+**
+** The default D2Q9 kernel may keep its lattice in tiles of LOCALSIZEX
+** by TILE_Y cells with options.layout, laid out as those of the OpenMP
+** backend; cells and obstacles only change order as the solver is
+** made and destroyed.
+*/
+class LbmSolver
+{
+public:
+  LbmSolver(const t_param params, const t_options options, t_speeds cells, int* obstacles);
+  ~LbmSolver();
+
+  /* advance n timesteps and wait for them */
+  void step(const int n = 1);
+
+  /*
+  ** Queue n timesteps from the calling thread and return without
+  ** waiting for them; the out-of-core engine, whose passes are driven
+  ** from the host, has taken them on return.
+  */
+  void submit(const int n);
+
+  /* queue n timesteps from a helper thread and return at once */
+  void run(const int n);
+
+  /* wait for the timesteps queued by submit() or run() */
+  void wait();
+
+  /* no. of timesteps taken so far */
+  int steps() const { return tt; }
+
+  /* cell updates per timestep, those of the refined patches included */
+  double updates() const { return cell_updates; }
+
+  /* observables of the current lattice, reduced on the device (on the host out of core) */
+  float av_velocity();
+  float reynolds();
+  float total_density();
+
+  /* the average velocity of each timestep taken so far, into av_vels */
+  void av_velocities(float* av_vels);
+
+  /* the x, y force on each obstacle label of each timestep taken so far, into forces */
+  void forces(float* forces);
+
+  /*
+  ** The first timestep to leave a non-finite or negative density, and
+  ** in tile the cells x0, y0, x1, y1 of the first work-group it was
+  ** seen in, or -1 if none has. With wait every timestep queued is
+  ** covered; without, only those found done, and the call never blocks.
+  ** Only the population kernels watch for it.
+  */
+  int unstable(int tile[4], const bool wait = true);
+
+  /*
+  ** The speeds of the current D2Q9 lattice in place, without a copy on
+  ** devices sharing host memory. They stay valid until the next call
+  ** to release_fields(), which any further step or observable makes.
+  ** The moment engine, the 3D lattices and a lattice in tiles hold no
+  ** speeds to give.
+  */
+  t_speeds fields();
+  void release_fields();
+
+  /*
+  ** The density and velocity of each of the nx*ny*nz cells of the
+  ** current lattice when it is kept in one buffer, the only one of the
+  ** 3D lattices and the coarse grid of the refined engine.
+  */
+  void flow(float* density, float* u_x, float* u_y, float* u_z);
+
+  /* the lines of the run summary of the out-of-core and refined engines, none for the others */
+  std::string report();
+
+  /* write each refined patch, as the driver writes the grid, to final_state_patch<p>.dat */
+  void write_patches();
+
+private:
+  LbmSolver(const LbmSolver&);
+  LbmSolver& operator=(const LbmSolver&);
+
+  void queue_timesteps(const int first, const int n);
+  void timestep(const int t);
+  void pass(const int first, const int n);
+  void compute_flow();
+  void reduce_observables();
+
+  t_param   params;
+  t_options options;
+  t_speeds  cells;              /* the caller's lattice */
+  int*      obstacles_host;     /* the caller's obstacles */
+  sycl::queue device_queue;
+  int       lattice_kind;       /* descriptor of a lattice kept in one buffer, LATTICE_NONE for the others */
+  unsigned long ngroups;        /* no. of work-groups of the timestep kernel */
+  double    cell_updates;       /* cell updates per timestep */
+
+  /* the population engine, D2Q9 generated from its descriptor or the coarsened and vector kernels */
+  t_speed_buffers speeds;       /* bound to the arrays of cells */
+  t_speed_buffers tmp_speeds;   /* scratch lattice, never copied to the host */
+
+  /* the D2Q9 lattice in tiles, reordered from cells and back */
+  t_speeds  tiled_cells;        /* the speeds the buffers are bound to, in tiles */
+  int*      tiled_obstacles;    /* the obstacles the buffer is bound to, in tiles */
+  int*      tile_groups;        /* first cell of the row of a tile each work-group takes */
+  t_tile_buffers tiles;         /* where the tiles are on the device, NULL buffers for rows */
+
+  /* the moment engine */
+  float*    moments_host[6];    /* the moments of cells the buffers are bound to */
+  t_moment_buffers moments;
+  t_moment_buffers tmp_moments;
+
+  /* the 3D lattices, and the coarse grid of the refined engine, a plane of cells per speed */
+  float*    lattice_host;       /* a plane of cells per speed, bound to lattice */
+  sycl::buffer<float, 1>* lattice;
+  sycl::buffer<float, 1>* tmp_lattice;
+  sycl::buffer<float, 1>* flow_fields[4]; /* density and velocity of each cell, made by flow() */
+
+  /* the refined patches */
+  int       npatches;
+  t_patch   patches[MAXPATCHES];
+  t_param   fine_params[MAXPATCHES];    /* the patch plus its ghost ring, rows padded to whole work-groups */
+  float     alpha;              /* rescaling of the non-equilibrium parts from the coarse grid to a patch */
+  float*    fine[MAXPATCHES];
+  int*      fine_obstacles[MAXPATCHES];
+  sycl::buffer<float, 1>* fine_speeds[MAXPATCHES];
+  sycl::buffer<float, 1>* fine_tmp_speeds[MAXPATCHES];
+  sycl::buffer<int, 1>*   fine_obstacle_buffers[MAXPATCHES];
+  sycl::buffer<float, 1>* fine_sum[MAXPATCHES];   /* the fine partial sums are not used */
+  sycl::buffer<int, 1>*   fine_sum2[MAXPATCHES];
+
+  /* the out-of-core engine */
+  t_speeds  slab_lattice;       /* the other lattice file, written on the odd passes */
+  float*    slab_in[2];         /* double buffered slabs in host memory */
+  int*      slab_obstacles[2];
+  float*    slab_out[2];
+  float*    slab_sum;           /* per work-group velocity sums of the timesteps of a slab */
+  int*      slab_sum2;          /* per work-group open cell counts of the timesteps of a slab */
+  float*    slab_u;             /* velocity sum of every timestep */
+  int*      slab_cells;         /* open cells of every timestep */
+  int       passes;             /* passes over the files so far */
+  double    compute_time;       /* time the device spends on slabs */
+  double    read_time;          /* time the reader threads spend loading slabs */
+  double    write_time;         /* time the writer threads spend storing slabs */
+  double    stall_time;         /* time the device waits for the reader or writer */
+
+  sycl::buffer<int, 1>*   obstacles;
+  sycl::buffer<float, 1>* partial_sum;   /* per work-group velocity sums of every timestep */
+  sycl::buffer<int, 1>*   partial_sum2;  /* per work-group open cell counts of every timestep */
+  sycl::buffer<float, 1>* partial_force; /* per work-group force on each label of every timestep */
+  sycl::buffer<long long, 1>* partial_exact; /* per work-group fixed-point velocity sum, with options.deterministic */
+  sycl::buffer<float, 1>* observables;   /* total density and velocity sum of the lattice */
+  sycl::buffer<int, 1>*   observed_cells;
+  sycl::buffer<int, 1>*   watch;         /* first unstable timestep and group in it, INT_MAX for none */
+  int watch_read[2];            /* watch as copied by watch_done */
+  int watch_seen[2];            /* watch as last found copied */
+  sycl::event watch_done;       /* completion of the copy of watch in flight */
+  bool watch_pending;           /* whether there is such a copy */
+
+  int tt;                       /* no. of timesteps taken */
+  int observed_tt;              /* timestep the observables were reduced at, -1 for none */
+  std::thread runner;           /* submits the timesteps queued by run() */
+  std::unique_ptr<t_field_access> field_access[NSPEEDS];
+};
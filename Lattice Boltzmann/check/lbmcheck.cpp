@@ -0,0 +1,512 @@
+/*
+** Check the output of a d2q9-bgk run against reference results.
+**
+**   ./lbmcheck --ref-av-vels-file=REF --ref-final-state-file=REF
+**              --av-vels-file=FILE --final-state-file=FILE
+**              [--tolerance=PERCENT] [--threads=N]
+**
+** The tests, the tolerance (1% by default) and the report are those of
+** the check.py this replaces: the pressure of every cell and the average
+** velocity of every timestep must lie within the tolerance, taken
+** relative to the value being checked, and the cells must come in the
+** same order.
+**
+** The files are memory-mapped rather than read, and either of a pair
+** may be text or the binary output of --binary (see ../Driver/lbm.h).
+** A text file is first indexed at every BLOCKLINES-th line, then both
+** files are compared a block at a time by a pool of threads; the
+** blocks are combined in order, so the report does not depend on the
+** no. of threads.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "../Driver/lbm.h"
+
+#define BLOCKLINES      65536   /* lines compared by a thread at a time */
+#define MAXLINE         256     /* longest line parsed */
+
+/* struct to hold a mapped output file */
+typedef struct
+{
+  const char* path;
+  const char* data;             /* the whole file */
+  size_t size;
+  int binary;                   /* whether it starts with the magic of --binary */
+  int nx;                       /* row length of a binary final state */
+  size_t lines;                 /* no. of lines, or of records of a binary file */
+  const char* records;          /* first record of a binary file */
+  std::vector<size_t> blocks;   /* offset of every BLOCKLINES-th line of a text file */
+} t_file;
+
+/* struct to hold the values compared on a line */
+typedef struct
+{
+  double ii;                    /* first column of final_state.dat */
+  double jj;                    /* second column of final_state.dat */
+  double value;                 /* pressure, or average velocity */
+} t_line;
+
+/* struct to hold the differences over a block of lines, or all of them */
+typedef struct
+{
+  double total;                 /* sum of the absolute differences */
+  size_t max_line;              /* line of the largest relative difference */
+  double max_pcnt;              /* |largest relative difference| in %, NaN first */
+  double max_diff;
+  double ref_val;
+  double sim_val;
+  t_line sim;                   /* the checked line at max_line */
+  int    coords_differ;         /* whether the cells were in a different order */
+} t_diffs;
+
+/* map a file and work out its format; magic is that of its binary form */
+void map_file(const char* path, const char* magic, t_file* file);
+void unmap_file(t_file* file);
+
+/* index the lines of a text file with nthreads threads */
+void index_lines(t_file* file, const int nthreads);
+
+/* compare the values of two files, final_state.dat when state is set */
+t_diffs compare(const t_file* ref, const t_file* sim, const int state, const int nthreads);
+
+/* the values on line n of a file, reading on from the text at *pos */
+void read_line(const t_file* file, const int state, const size_t n, const char** pos, t_line* line);
+
+/* utility functions */
+int option(const char* arg, const size_t len, const char* name);
+void print_diffs(const t_diffs diffs);
+void die(const char* message, const int line, const char* file);
+void usage(const char* exe);
+
+int main(int argc, char* argv[])
+{
+  const char* ref_av_vels_file = NULL;
+  const char* ref_final_state_file = NULL;
+  const char* av_vels_file = NULL;
+  const char* final_state_file = NULL;
+  double tolerance = 1.0;      /* % tolerance to match against reference results */
+  int nthreads = std::thread::hardware_concurrency();
+  t_file ref_av_vels, ref_final_state, av_vels, final_state;
+
+  for (int i = 1; i < argc; i++)
+  {
+    /* each option as --name=value or --name value */
+    const char* arg = argv[i];
+    const char* eq = strchr(arg, '=');
+    const size_t len = eq ? (size_t)(eq - arg) : strlen(arg);
+    const char* value = eq ? eq + 1 : (i + 1 < argc ? argv[++i] : NULL);
+
+    if (value == NULL) usage(argv[0]);
+
+    if (option(arg, len, "--ref-av-vels-file"))
+      ref_av_vels_file = value;
+    else if (option(arg, len, "--ref-final-state-file"))
+      ref_final_state_file = value;
+    else if (option(arg, len, "--av-vels-file"))
+      av_vels_file = value;
+    else if (option(arg, len, "--final-state-file"))
+      final_state_file = value;
+    else if (option(arg, len, "--tolerance"))
+      tolerance = atof(value);
+    else if (option(arg, len, "--threads"))
+      nthreads = atoi(value);
+    else
+      usage(argv[0]);
+  }
+
+  if (!ref_av_vels_file || !ref_final_state_file || !av_vels_file || !final_state_file)
+    usage(argv[0]);
+
+  if (nthreads < 1) nthreads = 1;
+
+  map_file(ref_av_vels_file, AVVELSMAGIC, &ref_av_vels);
+  map_file(ref_final_state_file, STATEMAGIC, &ref_final_state);
+  map_file(av_vels_file, AVVELSMAGIC, &av_vels);
+  map_file(final_state_file, STATEMAGIC, &final_state);
+
+  index_lines(&ref_av_vels, nthreads);
+  index_lines(&ref_final_state, nthreads);
+  index_lines(&av_vels, nthreads);
+  index_lines(&final_state, nthreads);
+
+  if (ref_final_state.lines != final_state.lines)
+  {
+    printf("Different number of cells in final_state files\n");
+    exit(EXIT_FAILURE);
+  }
+
+  const t_diffs state_diffs = compare(&ref_final_state, &final_state, 1, nthreads);
+
+  /* make sure the coordinates are in the right order */
+  if (state_diffs.coords_differ)
+  {
+    printf("Final state files coordinates were not the same\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* make sure the av_vels have the same number of steps */
+  if (ref_av_vels.lines != av_vels.lines)
+  {
+    printf("Different number of steps in av_vels files\n");
+    exit(EXIT_FAILURE);
+  }
+
+  const t_diffs av_vels_diffs = compare(&ref_av_vels, &av_vels, 0, nthreads);
+
+  printf("Total difference in av_vels : %.12E\n", av_vels_diffs.total);
+  printf("Biggest difference (at step %zu) : %.12E\n", av_vels_diffs.max_line, av_vels_diffs.max_diff);
+  print_diffs(av_vels_diffs);
+  printf("\n");
+
+  printf("Total difference in final_state : %.12E\n", state_diffs.total);
+  printf("Biggest difference (at coord (%d,%d)) : %.12E\n",
+         (int)state_diffs.sim.ii, (int)state_diffs.sim.jj, state_diffs.max_diff);
+  print_diffs(state_diffs);
+  printf("\n");
+
+  /* find out if either of them failed */
+  const int state_failed = !isfinite(state_diffs.max_pcnt) || state_diffs.max_pcnt > tolerance;
+  const int av_vels_failed = !isfinite(av_vels_diffs.max_pcnt) || av_vels_diffs.max_pcnt > tolerance;
+
+  if (state_failed)
+    printf("final state failed check\n");
+  if (av_vels_failed)
+    printf("av_vels failed check\n");
+
+  unmap_file(&ref_av_vels);
+  unmap_file(&ref_final_state);
+  unmap_file(&av_vels);
+  unmap_file(&final_state);
+
+  if (state_failed || av_vels_failed)
+    return EXIT_FAILURE;
+
+  printf("Both tests passed!\n");
+
+  return EXIT_SUCCESS;
+}
+
+void map_file(const char* path, const char* magic, t_file* file)
+{
+  char message[1024];           /* message buffer */
+  struct stat st;
+
+  const int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    snprintf(message, sizeof(message), "could not open file: %s", path);
+    die(message, __LINE__, __FILE__);
+  }
+
+  file->path = path;
+  file->size = st.st_size;
+  file->data = NULL;
+
+  if (file->size > 0)
+  {
+    void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (data == MAP_FAILED)
+    {
+      snprintf(message, sizeof(message), "could not map file: %s", path);
+      die(message, __LINE__, __FILE__);
+    }
+
+    /* the file is read once, front to back */
+    madvise(data, file->size, MADV_SEQUENTIAL);
+    file->data = (const char*)data;
+  }
+
+  close(fd);
+
+  file->binary = file->size >= 8 && memcmp(file->data, magic, 8) == 0;
+  file->nx = 0;
+  file->lines = 0;
+  file->records = NULL;
+
+  if (!file->binary) return;
+
+  const int state = strcmp(magic, STATEMAGIC) == 0;
+  const size_t header = 8 + (state ? 2 : 1) * sizeof(int);
+  const size_t record = state ? sizeof(t_cell_state) : sizeof(float);
+  int dims[2] = {0, 0};
+
+  if (file->size >= header) memcpy(dims, file->data + 8, header - 8);
+
+  const size_t lines = state ? (size_t)dims[0] * dims[1] : (size_t)dims[0];
+
+  if (file->size < header || dims[0] < 0 || dims[1] < 0 || file->size != header + lines * record)
+  {
+    snprintf(message, sizeof(message), "binary file of the wrong size: %s", path);
+    die(message, __LINE__, __FILE__);
+  }
+
+  file->nx = dims[0];
+  file->lines = lines;
+  file->records = file->data + header;
+}
+
+void unmap_file(t_file* file)
+{
+  if (file->data != NULL) munmap((void*)file->data, file->size);
+  file->data = NULL;
+}
+
+void index_lines(t_file* file, const int nthreads)
+{
+  if (file->binary) return;
+
+  /* a line starts at the beginning of the file or after a newline, before the end */
+  const size_t chunk = (file->size + nthreads - 1) / nthreads;
+  std::vector<size_t> counts(nthreads + 1, 0);
+  std::vector<std::thread> threads;
+
+  for (int pass = 0; pass < 2; pass++)
+  {
+    if (pass == 1)
+    {
+      /* lines before each chunk, so that the second pass knows which lines begin a block */
+      for (int t = nthreads; t > 0; t--) counts[t] = counts[t - 1];
+      counts[0] = 0;
+      for (int t = 1; t <= nthreads; t++) counts[t] += counts[t - 1];
+
+      file->lines = counts[nthreads];
+      file->blocks.assign((file->lines + BLOCKLINES - 1) / BLOCKLINES, 0);
+    }
+
+    for (int t = 0; t < nthreads; t++)
+    {
+      threads.push_back(std::thread([file, chunk, pass, t, &counts]{
+        const size_t begin = chunk * t < file->size ? chunk * t : file->size;
+        const size_t end = begin + chunk < file->size ? begin + chunk : file->size;
+        size_t line = (pass == 1) ? counts[t] : 0;
+
+        for (size_t p = begin; p < end; )
+        {
+          if (p == 0 || file->data[p - 1] == '\n')
+          {
+            if (pass == 1 && line % BLOCKLINES == 0) file->blocks[line / BLOCKLINES] = p;
+            line++;
+          }
+
+          const char* nl = (const char*)memchr(file->data + p, '\n', end - p);
+
+          if (nl == NULL) break;
+          p = nl - file->data + 1;
+        }
+
+        if (pass == 0) counts[t] = line;
+      }));
+    }
+
+    for (auto& thread : threads) thread.join();
+    threads.clear();
+  }
+}
+
+t_diffs compare(const t_file* ref, const t_file* sim, const int state, const int nthreads)
+{
+  const size_t nblocks = (ref->lines + BLOCKLINES - 1) / BLOCKLINES;
+  std::vector<t_diffs> blocks(nblocks);
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < nthreads; t++)
+  {
+    threads.push_back(std::thread([&]{
+      for (size_t b = next++; b < nblocks; b = next++)
+      {
+        const size_t first = b * BLOCKLINES;
+        const size_t last = (first + BLOCKLINES < ref->lines) ? first + BLOCKLINES : ref->lines;
+        const char* ref_pos = ref->binary ? NULL : ref->data + ref->blocks[b];
+        const char* sim_pos = sim->binary ? NULL : sim->data + sim->blocks[b];
+        t_diffs d;
+
+        d.total = 0.0;
+        d.max_line = first;
+        d.max_pcnt = -1.0;
+        d.coords_differ = 0;
+
+        for (size_t n = first; n < last; n++)
+        {
+          t_line r, s;
+
+          read_line(ref, state, n, &ref_pos, &r);
+          read_line(sim, state, n, &sim_pos, &s);
+
+          if (state && (r.ii != s.ii || r.jj != s.jj)) d.coords_differ = 1;
+
+          /* the difference relative to the checked value, as check.py had it */
+          const double diff = r.value - s.value;
+          const double pcnt = fabs(100.0 * (diff / (r.value - diff)));
+
+          d.total += fabs(diff);
+
+          /* the first NaN, or else the first largest, like numpy's argmax */
+          if (!isnan(d.max_pcnt) && (isnan(pcnt) || pcnt > d.max_pcnt))
+          {
+            d.max_line = n;
+            d.max_pcnt = pcnt;
+            d.max_diff = diff;
+            d.ref_val = r.value;
+            d.sim_val = s.value;
+            d.sim = s;
+          }
+        }
+
+        blocks[b] = d;
+      }
+    }));
+  }
+
+  for (auto& thread : threads) thread.join();
+
+  t_diffs diffs;
+
+  diffs.total = 0.0;
+  diffs.max_line = 0;
+  diffs.max_pcnt = -1.0;
+  diffs.max_diff = diffs.ref_val = diffs.sim_val = 0.0;
+  diffs.sim.ii = diffs.sim.jj = diffs.sim.value = 0.0;
+  diffs.coords_differ = 0;
+
+  /* in order of the blocks, so the sum and the first largest do not vary */
+  for (size_t b = 0; b < nblocks; b++)
+  {
+    const t_diffs d = blocks[b];
+
+    diffs.total += d.total;
+    diffs.coords_differ |= d.coords_differ;
+
+    if (!isnan(diffs.max_pcnt) && (isnan(d.max_pcnt) || d.max_pcnt > diffs.max_pcnt))
+    {
+      const double total = diffs.total;
+      const int coords_differ = diffs.coords_differ;
+
+      diffs = d;
+      diffs.total = total;
+      diffs.coords_differ = coords_differ;
+    }
+  }
+
+  return diffs;
+}
+
+void read_line(const t_file* file, const int state, const size_t n, const char** pos, t_line* line)
+{
+  char message[1024];           /* message buffer */
+
+  if (file->binary)
+  {
+    if (state)
+    {
+      t_cell_state cell;
+
+      memcpy(&cell, file->records + n * sizeof(cell), sizeof(cell));
+      line->ii = (double)(n % file->nx);
+      line->jj = (double)(n / file->nx);
+      line->value = cell.pressure;
+    }
+    else
+    {
+      float av_vel;
+
+      memcpy(&av_vel, file->records + n * sizeof(av_vel), sizeof(av_vel));
+      line->ii = line->jj = (double)n;
+      line->value = av_vel;
+    }
+
+    return;
+  }
+
+  /* the columns wanted: ii, jj and pressure of the final state, or the average velocity */
+  const char* p = *pos;
+  const char* end = file->data + file->size;
+  const int last = state ? 5 : 1;
+  char token[MAXLINE];
+  int col = 0;
+
+  line->ii = line->jj = (double)n;
+
+  while (col <= last)
+  {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+    const char* start = p;
+
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+
+    if (p == start || p - start >= MAXLINE)
+    {
+      snprintf(message, sizeof(message), "could not parse line %zu of file: %s", n + 1, file->path);
+      die(message, __LINE__, __FILE__);
+    }
+
+    if (col == last || (state && col < 2))
+    {
+      char* parsed;
+
+      memcpy(token, start, p - start);
+      token[p - start] = '\0';
+
+      const double value = strtod(token, &parsed);
+
+      if (*parsed != '\0')
+      {
+        snprintf(message, sizeof(message), "could not parse line %zu of file: %s", n + 1, file->path);
+        die(message, __LINE__, __FILE__);
+      }
+
+      if (col == last) line->value = value;
+      else if (col == 0) line->ii = value;
+      else line->jj = value;
+    }
+
+    col++;
+  }
+
+  /* on to the next line */
+  const char* nl = (const char*)memchr(p, '\n', end - p);
+
+  *pos = nl ? nl + 1 : end;
+}
+
+int option(const char* arg, const size_t len, const char* name)
+{
+  return len == strlen(name) && strncmp(arg, name, len) == 0;
+}
+
+void print_diffs(const t_diffs diffs)
+{
+  const double pcnt = 100.0 * (diffs.max_diff / (diffs.ref_val - diffs.max_diff));
+
+  printf("  %.12E vs. %.12E = %.2g%%\n", diffs.sim_val, diffs.ref_val, pcnt);
+}
+
+void die(const char* message, const int line, const char* file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n", message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}
+
+void usage(const char* exe)
+{
+  fprintf(stderr, "Usage: %s --ref-av-vels-file=FILE --ref-final-state-file=FILE\n"
+                  "       --av-vels-file=FILE --final-state-file=FILE [--tolerance=PERCENT] [--threads=N]\n", exe);
+  exit(EXIT_FAILURE);
+}
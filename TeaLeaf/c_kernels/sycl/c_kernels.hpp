@@ -1,5 +1,12 @@
 #include "../../settings.h"
 
+/* KERNEL INITIALISE */
+// Creates a field buffer bound to a host array on huge pages
+SyclBuffer* allocate_field_buffer(size_t len, bool hugetlb);
+
+// Allocates the scratch of a reduction of nvalues sums over len values
+void allocate_reduction(SyclReduction* reduction, size_t nvalues, size_t len);
+
 /* STORE ENERGY */
 // Copies energy0 into energy1.
 void store_energy(
@@ -49,7 +56,7 @@ void calculate_residual(
 // Calculates the 2 norm of the provided buffer.
 void calculate_2norm(
   const int x, const int y, const int halo_depth, SyclBuffer& bufferBuff,
-  double* norm, queue& device_queue);
+  double* norm, SyclReduction& reduction, queue& device_queue);
 
 // Finalises the energy field.
 void finalise(
@@ -74,6 +81,54 @@ void ppcg_calc_sd(
   const double alpha, const double beta, SyclBuffer& sdBuff, SyclBuffer& rBuff,
   queue& device_queue);
 
+/* PIPELINED CG SOLVER */
+// Calculates w = Ar and z = As, and then (r,r) and (w,r)
+void pipecg_init(
+  const int x, const int y, const int halo_depth, SyclBuffer& rBuff,
+  SyclBuffer& wBuff, SyclBuffer& sdBuff, SyclBuffer& zBuff, SyclBuffer& kxBuff,
+  SyclBuffer& kyBuff, double* rr, double* wr, SyclReduction& reduction,
+  queue& device_queue);
+
+// Calculates q = Aw
+void pipecg_calc_q(
+  const int x, const int y, const int halo_depth, SyclBuffer& sdBuff,
+  SyclBuffer& qBuff, SyclBuffer& kxBuff, SyclBuffer& kyBuff,
+  queue& device_queue);
+
+// Updates z, s, p, u, r and w, and calculates the next (r,r) and (w,r)
+void pipecg_calc_update(
+  const int x, const int y, const int halo_depth, const double alpha,
+  const double beta, SyclBuffer& uBuff, SyclBuffer& pBuff, SyclBuffer& rBuff,
+  SyclBuffer& wBuff, SyclBuffer& sdBuff, SyclBuffer& qBuff, SyclBuffer& zBuff,
+  double* rr, double* wr, SyclReduction& reduction, queue& device_queue);
+
+/* S-STEP CG SOLVER */
+// Initialises kx,ky in the halo as well, from the density
+void sstep_init_k(
+  const int x, const int y, const int coefficient, SyclBuffer& densityBuff,
+  SyclBuffer& kxBuff, SyclBuffer& kyBuff, const double rx, const double ry,
+  queue& device_queue);
+
+// Calculates the basis from p and r, which have halos steps deep
+void sstep_calc_basis(
+  const int x, const int y, const int halo_depth, const int steps,
+  const double sigma, SyclBuffer& pBuff, SyclBuffer& rBuff,
+  SyclBuffer& basisBuff, SyclBuffer& kxBuff, SyclBuffer& kyBuff,
+  queue& device_queue);
+
+// Adds the Gram matrix of the basis to gram, (2s+1)(s+1) values by rows
+void sstep_calc_gram(
+  const int x, const int y, const int halo_depth, const int steps,
+  SyclBuffer& basisBuff, double* gram, SyclReduction& reduction,
+  queue& device_queue);
+
+// Sets u += Vcu, r = Vcr and p = Vcp for the basis V
+void sstep_calc_update(
+  const int x, const int y, const int halo_depth, const int steps,
+  const double* cu, const double* cr, const double* cp, SyclBuffer& uBuff,
+  SyclBuffer& pBuff, SyclBuffer& rBuff, SyclBuffer& basisBuff,
+  queue& device_queue);
+
 /* CHEBY SOLVER */
 // Initialises the Chebyshev solver
 void cheby_init(
@@ -103,13 +158,13 @@ void cg_calc_p(
 void cg_calc_ur(
   const int x, const int y, const int halo_depth, SyclBuffer& uBuff,
   SyclBuffer& rBuff, SyclBuffer& pBuff, SyclBuffer& wBuff, const double alpha,
-  double* rrn, queue& device_queue);
+  double* rrn, SyclReduction& reduction, queue& device_queue);
 
 // Calculates the value for w
 void cg_calc_w(
   const int x, const int y, const int halo_depth, SyclBuffer& wBuff,
   SyclBuffer& pBff, SyclBuffer& kxBuff, SyclBuffer& kyBuff, double* pw,
-  queue& device_queue);
+  SyclReduction& reduction, queue& device_queue);
 
 // Initialises kx,ky
 void cg_init_k(
@@ -121,7 +176,8 @@ void cg_init_k(
 void cg_init_others(
   const int x, const int y, const int halo_depth, SyclBuffer& kxBuff,
   SyclBuffer& kyBuff, SyclBuffer& pBuff, SyclBuffer& rBuff, SyclBuffer& uBuff,
-  SyclBuffer& wBuff, double* rro, queue& device_queue);
+  SyclBuffer& wBuff, double* rro, SyclReduction& reduction,
+  queue& device_queue);
 
 // Initialises p,r,u,w
 void cg_init_u(
@@ -129,6 +185,32 @@ void cg_init_u(
   SyclBuffer& pBuff, SyclBuffer& rBuff, SyclBuffer& uBuff, SyclBuffer& wBuff,
   SyclBuffer& densityBuff, SyclBuffer& energyBuff, queue& device_queue);
 
+// Sets rro for the iterations that keep their scalars on the device
+void cg_device_init(const double rro, SyclBuffer& scalarsBuff);
+
+// Calculates w, and alpha from pw, on the device
+void cg_device_calc_w(
+  const int x, const int y, const int halo_depth, const int tt,
+  SyclBuffer& wBuff, SyclBuffer& pBuff, SyclBuffer& kxBuff, SyclBuffer& kyBuff,
+  SyclBuffer& scalarsBuff, SyclReduction& reduction, queue& device_queue);
+
+// Calculates u and r with the alpha on the device, and then rrn and beta
+void cg_device_calc_ur(
+  const int x, const int y, const int halo_depth, const int tt,
+  const int max_iters, SyclBuffer& uBuff, SyclBuffer& rBuff, SyclBuffer& pBuff,
+  SyclBuffer& wBuff, SyclBuffer& scalarsBuff, SyclReduction& reduction,
+  queue& device_queue);
+
+// Calculates a value for p with the beta on the device
+void cg_device_calc_p(
+  const int x, const int y, const int halo_depth, SyclBuffer& pBuff,
+  SyclBuffer& rBuff, SyclBuffer& scalarsBuff, queue& device_queue);
+
+// Reads rrn, and the alphas and betas of iterations first to last-1, back
+void cg_device_read(
+  const int max_iters, const int first, const int last, SyclBuffer& scalarsBuff,
+  double* rrn, double* alphas, double* betas);
+
 /* JACOBI SOLVER */
 // Initialises the Jacobi solver
 void jacobi_init(
@@ -146,7 +228,7 @@ void jacobi_copy_u(
 void jacobi_iterate(
   const int x, const int y, const int halo_depth, SyclBuffer& u, SyclBuffer& u0,
   SyclBuffer& r, SyclBuffer& kx, SyclBuffer& ky, double* error,
-  queue& device_queue);
+  SyclReduction& reduction, queue& device_queue);
 
 /* UPDATING LOCAL HALOS */
 // Updates the local left halo region(s)
@@ -214,4 +296,5 @@ void unpack_right(
 void field_summary_func(
 	const int x, const int y, const int halo_depth, SyclBuffer& uBuff,
 	SyclBuffer& densityBuff, SyclBuffer& energy0Buff, SyclBuffer& volumeBuff,
-	double* vol, double* mass, double* ie, double* temp, queue& device_queue);
+	double* vol, double* mass, double* ie, double* temp,
+	SyclReduction& reduction, queue& device_queue);
@@ -72,12 +72,12 @@ void cg_init_k(
 void cg_init_others(
   const int x, const int y, const int halo_depth, SyclBuffer& kxBuff,
   SyclBuffer& kyBuff, SyclBuffer& pBuff, SyclBuffer& rBuff, SyclBuffer& uBuff,
-  SyclBuffer& wBuff, double* rro, queue& device_queue)
+  SyclBuffer& wBuff, double* rro, SyclReduction& reduction,
+  queue& device_queue)
 {
   size_t wgroup_size = WORK_GROUP_SIZE;
   auto len = rBuff.get_count();
   auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
-  buffer<double, 1> tmpArrayBuff{range<1>{(size_t)n_wgroups}};
 
   device_queue.submit([&](handler &cgh) {
     auto r            = rBuff.get_access<access::mode::read_write>(cgh);
@@ -86,7 +86,9 @@ void cg_init_others(
     auto p            = pBuff.get_access<access::mode::read_write>(cgh);
     auto kx           = kxBuff.get_access<access::mode::read>(cgh);
     auto ky           = kyBuff.get_access<access::mode::read>(cgh);
-    auto global_mem = tmpArrayBuff.get_access<access::mode::discard_write>(cgh);
+    auto partials     = reduction.partials->get_access<access::mode::read_write>(cgh);
+    auto totals       = reduction.totals->get_access<access::mode::discard_write>(cgh);
+    auto count        = reduction.count->get_access<access::mode::atomic>(cgh);
     accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(wgroup_size), cgh);
 
     auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
@@ -110,19 +112,7 @@ void cg_init_others(
       local_mem[local_id] = r[global_id]*p[global_id];
     }
 
-    item.barrier(access::fence_space::local_space);
-
-    for (size_t stride = 1; stride < wgroup_size; stride *= 2) {
-      auto idx = 2 * stride * local_id;
-      if (idx < wgroup_size) {
-        local_mem[idx] = local_mem[idx] + local_mem[idx + stride];
-      }
-      item.barrier(access::fence_space::local_space);
-    }
-
-    if (local_id == 0) {
-      global_mem[item.get_group_linear_id()] = local_mem[0];
-    }
+    SyclHelper::reduceGroups<1>(item, local_mem, partials, totals, count);
 
     });//end of parallel for
   });//end of queue
@@ -130,26 +120,29 @@ void cg_init_others(
   device_queue.wait();
   #endif
 
-  *rro += SyclHelper::reduceArray(tmpArrayBuff, device_queue);
+  double total;
+  SyclHelper::readTotals(reduction, &total, 1);
+  *rro += total;
 }
 
 // Calculates the value for w
 void cg_calc_w(
   const int x, const int y, const int halo_depth, SyclBuffer& wBuff,
   SyclBuffer& pBuff, SyclBuffer& kxBuff, SyclBuffer& kyBuff, double* pw,
-  queue& device_queue)
+  SyclReduction& reduction, queue& device_queue)
 {
   size_t wgroup_size = WORK_GROUP_SIZE;
   auto len = wBuff.get_count();
   auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
-  buffer<double, 1> tmpArrayBuff{range<1>{(size_t)n_wgroups}};
 
   device_queue.submit([&](handler &cgh) {
     auto w            = wBuff.get_access<access::mode::read_write>(cgh);
     auto p            = pBuff.get_access<access::mode::read>(cgh);
     auto kx           = kxBuff.get_access<access::mode::read>(cgh);
     auto ky           = kyBuff.get_access<access::mode::read>(cgh);
-    auto global_mem = tmpArrayBuff.get_access<access::mode::discard_write>(cgh);
+    auto partials     = reduction.partials->get_access<access::mode::read_write>(cgh);
+    auto totals       = reduction.totals->get_access<access::mode::discard_write>(cgh);
+    auto count        = reduction.count->get_access<access::mode::atomic>(cgh);
     accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(wgroup_size), cgh);
 
     auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
@@ -171,19 +164,7 @@ void cg_calc_w(
         local_mem[local_id] =  w[global_id]*p[global_id];
       }
 
-      item.barrier(access::fence_space::local_space);
-
-      for (size_t stride = 1; stride < wgroup_size; stride *= 2) {
-        auto idx = 2 * stride * local_id;
-        if (idx < wgroup_size) {
-          local_mem[idx] = local_mem[idx] + local_mem[idx + stride];
-        }
-        item.barrier(access::fence_space::local_space);
-      }
-
-      if (local_id == 0) {
-        global_mem[item.get_group_linear_id()] = local_mem[0];
-      }
+      SyclHelper::reduceGroups<1>(item, local_mem, partials, totals, count);
 
       });//end of parallel for
     });//end of queue
@@ -191,26 +172,29 @@ void cg_calc_w(
     device_queue.wait();
     #endif
 
-    *pw += SyclHelper::reduceArray(tmpArrayBuff, device_queue);
+    double total;
+    SyclHelper::readTotals(reduction, &total, 1);
+    *pw += total;
 }
 
 // Calculates the value of u and r
 void cg_calc_ur(
   const int x, const int y, const int halo_depth, SyclBuffer& uBuff,
   SyclBuffer& rBuff, SyclBuffer& pBuff, SyclBuffer& wBuff, const double alpha,
-  double* rrn, queue& device_queue)
+  double* rrn, SyclReduction& reduction, queue& device_queue)
 {
   size_t wgroup_size = WORK_GROUP_SIZE;
   auto len = rBuff.get_count();
   auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
-  buffer<double, 1> tmpArrayBuff{range<1>{(size_t)n_wgroups}};
 
   device_queue.submit([&](handler &cgh) {
     auto w           = wBuff.get_access<access::mode::read_write>(cgh);
     auto p           = pBuff.get_access<access::mode::read>(cgh);
     auto u           = uBuff.get_access<access::mode::read_write>(cgh);
     auto r           = rBuff.get_access<access::mode::read_write>(cgh);
-    auto global_mem = tmpArrayBuff.get_access<access::mode::discard_write>(cgh);
+    auto partials     = reduction.partials->get_access<access::mode::read_write>(cgh);
+    auto totals       = reduction.totals->get_access<access::mode::discard_write>(cgh);
+    auto count        = reduction.count->get_access<access::mode::atomic>(cgh);
     accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(wgroup_size), cgh);
 
     auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
@@ -230,19 +214,7 @@ void cg_calc_ur(
           local_mem[local_id] = r[global_id]*r[global_id];
       }
 
-      item.barrier(access::fence_space::local_space);
-
-      for (size_t stride = 1; stride < wgroup_size; stride *= 2) {
-         auto idx = 2 * stride * local_id;
-         if (idx < wgroup_size) {
-            local_mem[idx] = local_mem[idx] + local_mem[idx + stride];
-         }
-         item.barrier(access::fence_space::local_space);
-      }
-
-      if (local_id == 0) {
-         global_mem[item.get_group_linear_id()] = local_mem[0];
-      }
+      SyclHelper::reduceGroups<1>(item, local_mem, partials, totals, count);
 
       });//end of parallel for
     });//end of queue
@@ -250,7 +222,9 @@ void cg_calc_ur(
     device_queue.wait();
     #endif
 
-    *rrn = SyclHelper::reduceArray(tmpArrayBuff, device_queue);
+    double total;
+    SyclHelper::readTotals(reduction, &total, 1);
+    *rrn = total;
 }
 
 // Calculates a value for p
@@ -279,3 +253,164 @@ void cg_calc_p(
   device_queue.wait();
   #endif
 }
+
+// Sets rro for the iterations that keep their scalars on the device
+void cg_device_init(const double rro, SyclBuffer& scalarsBuff)
+{
+  auto scalars = scalarsBuff.get_access<access::mode::write>();
+  scalars[CG_RRO] = rro;
+}
+
+// Calculates w, and alpha from pw, on the device
+void cg_device_calc_w(
+  const int x, const int y, const int halo_depth, const int tt,
+  SyclBuffer& wBuff, SyclBuffer& pBuff, SyclBuffer& kxBuff, SyclBuffer& kyBuff,
+  SyclBuffer& scalarsBuff, SyclReduction& reduction, queue& device_queue)
+{
+  size_t wgroup_size = WORK_GROUP_SIZE;
+  auto len = wBuff.get_count();
+  auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
+
+  device_queue.submit([&](handler &cgh) {
+    auto w            = wBuff.get_access<access::mode::read_write>(cgh);
+    auto p            = pBuff.get_access<access::mode::read>(cgh);
+    auto kx           = kxBuff.get_access<access::mode::read>(cgh);
+    auto ky           = kyBuff.get_access<access::mode::read>(cgh);
+    auto scalars      = scalarsBuff.get_access<access::mode::read_write>(cgh);
+    auto partials     = reduction.partials->get_access<access::mode::read_write>(cgh);
+    auto totals       = reduction.totals->get_access<access::mode::read_write>(cgh);
+    auto count        = reduction.count->get_access<access::mode::atomic>(cgh);
+    accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(wgroup_size), cgh);
+
+    auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
+    cgh.parallel_for<class cg_device_calc_w>( myRange, [=] (nd_item<1> item){
+
+      size_t local_id = item.get_local_linear_id();
+      size_t global_id = item.get_global_linear_id();
+      local_mem[local_id] = 0;
+
+      const size_t kk = global_id % x;
+      const size_t jj = global_id / x;
+      if(kk >= halo_depth && kk < x - halo_depth &&
+         jj >= halo_depth && jj < y - halo_depth)
+      {
+        //smvp uses kx and ky and index
+        int index = global_id;
+        const double smvp = SMVP(p);
+        w[global_id] = smvp;
+        local_mem[local_id] =  w[global_id]*p[global_id];
+      }
+
+      if (SyclHelper::reduceGroups<1>(item, local_mem, partials, totals, count)) {
+        // pw only reaches zero past convergence, where u is left as it is
+        const double pw = totals[0];
+        const double alpha = (pw != 0.0) ? scalars[CG_RRO] / pw : 0.0;
+        scalars[CG_ALPHA] = alpha;
+        scalars[CG_SCALARS + tt] = alpha;
+      }
+
+      });//end of parallel for
+    });//end of queue
+    #ifdef ENABLE_PROFILING
+    device_queue.wait();
+    #endif
+}
+
+// Calculates u and r with the alpha on the device, and then rrn and beta
+void cg_device_calc_ur(
+  const int x, const int y, const int halo_depth, const int tt,
+  const int max_iters, SyclBuffer& uBuff, SyclBuffer& rBuff, SyclBuffer& pBuff,
+  SyclBuffer& wBuff, SyclBuffer& scalarsBuff, SyclReduction& reduction,
+  queue& device_queue)
+{
+  size_t wgroup_size = WORK_GROUP_SIZE;
+  auto len = rBuff.get_count();
+  auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
+
+  device_queue.submit([&](handler &cgh) {
+    auto w           = wBuff.get_access<access::mode::read>(cgh);
+    auto p           = pBuff.get_access<access::mode::read>(cgh);
+    auto u           = uBuff.get_access<access::mode::read_write>(cgh);
+    auto r           = rBuff.get_access<access::mode::read_write>(cgh);
+    auto scalars     = scalarsBuff.get_access<access::mode::read_write>(cgh);
+    auto partials    = reduction.partials->get_access<access::mode::read_write>(cgh);
+    auto totals      = reduction.totals->get_access<access::mode::read_write>(cgh);
+    auto count       = reduction.count->get_access<access::mode::atomic>(cgh);
+    accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(wgroup_size), cgh);
+
+    auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
+    cgh.parallel_for<class cg_device_calc_ur>(myRange, [=] (nd_item<1> item){
+
+      size_t local_id = item.get_local_linear_id();
+      size_t global_id = item.get_global_linear_id();
+      local_mem[local_id] = 0;
+
+      const size_t kk = global_id % x;
+      const size_t jj = global_id / x;
+      if(kk >= halo_depth && kk < x - halo_depth &&
+         jj >= halo_depth && jj < y - halo_depth)
+      {
+          const double alpha = scalars[CG_ALPHA];
+          u[global_id] += alpha*p[global_id];
+          r[global_id] -= alpha*w[global_id];
+          local_mem[local_id] = r[global_id]*r[global_id];
+      }
+
+      if (SyclHelper::reduceGroups<1>(item, local_mem, partials, totals, count)) {
+        const double rrn = totals[0];
+        const double rro = scalars[CG_RRO];
+        const double beta = (rro != 0.0) ? rrn / rro : 0.0;
+        scalars[CG_RRN] = rrn;
+        scalars[CG_BETA] = beta;
+        scalars[CG_RRO] = rrn;
+        scalars[CG_SCALARS + max_iters + tt] = beta;
+      }
+
+      });//end of parallel for
+    });//end of queue
+    #ifdef ENABLE_PROFILING
+    device_queue.wait();
+    #endif
+}
+
+// Calculates a value for p with the beta on the device
+void cg_device_calc_p(
+  const int x, const int y, const int halo_depth, SyclBuffer& pBuff,
+  SyclBuffer& rBuff, SyclBuffer& scalarsBuff, queue& device_queue)
+{
+  device_queue.submit([&](handler &cgh){
+    auto p            = pBuff.get_access<access::mode::read_write>(cgh);
+    auto r            = rBuff.get_access<access::mode::read>(cgh);
+    auto scalars      = scalarsBuff.get_access<access::mode::read>(cgh);
+
+    auto myRange = range<1>(x*y);
+    cgh.parallel_for<class cg_device_calc_p>( myRange, [=] (id<1> idx){
+
+      const int kk = idx[0] % x;
+      const int jj = idx[0] / x;
+      if(kk >= halo_depth && kk < x - halo_depth &&
+        jj >= halo_depth && jj < y - halo_depth)
+      {
+        p[idx[0]] = scalars[CG_BETA]*p[idx[0]] + r[idx[0]];
+      }
+
+    });//end of parallel for
+  });//end of queue
+  #ifdef ENABLE_PROFILING
+  device_queue.wait();
+  #endif
+}
+
+// Reads rrn, and the alphas and betas of iterations first to last-1, back
+void cg_device_read(
+  const int max_iters, const int first, const int last, SyclBuffer& scalarsBuff,
+  double* rrn, double* alphas, double* betas)
+{
+  auto scalars = scalarsBuff.get_access<access::mode::read>();
+  *rrn = scalars[CG_RRN];
+  for(int tt = first; tt < last; ++tt)
+  {
+    alphas[tt] = scalars[CG_SCALARS + tt];
+    betas[tt] = scalars[CG_SCALARS + max_iters + tt];
+  }
+}
@@ -9,5 +9,15 @@ typedef buffer<double, 1>* FieldBufferType;
 typedef struct ChunkExtension
 {
     FieldBufferType comms_buffer;
+    SyclReduction reduction;
+    FieldBufferType cg_scalars;
+
+    // Allocated by the first pipelined CG solve only
+    FieldBufferType pipecg_q;
+    FieldBufferType pipecg_z;
+
+    // Allocated by the first s-step CG solve only
+    FieldBufferType sstep_basis;
+    SyclReduction sstep_reduction;
 
 } ChunkExtension;
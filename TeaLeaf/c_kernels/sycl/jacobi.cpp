@@ -57,12 +57,12 @@ void jacobi_init(
 void jacobi_iterate(
 	const int x, const int y, const int halo_depth, SyclBuffer& uBuff,
   SyclBuffer& u0Buff, SyclBuffer& rBuff, SyclBuffer& kxBuff,
-	SyclBuffer& kyBuff, double* error, queue& device_queue)
+	SyclBuffer& kyBuff, double* error, SyclReduction& reduction,
+	queue& device_queue)
 {
 	size_t wgroup_size = WORK_GROUP_SIZE;
 	auto len = uBuff.get_count();
 	auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
-	buffer<double, 1> tmpArrayBuff{range<1>{(size_t)n_wgroups}};
 
   device_queue.submit([&](handler &cgh) {
     auto r            = rBuff.get_access<access::mode::read>(cgh);
@@ -70,7 +70,9 @@ void jacobi_iterate(
     auto u0           = u0Buff.get_access<access::mode::read>(cgh);
     auto kx           = kxBuff.get_access<access::mode::read>(cgh);
     auto ky           = kyBuff.get_access<access::mode::read>(cgh);
-		auto global_mem = tmpArrayBuff.get_access<access::mode::discard_write>(cgh);
+		auto partials     = reduction.partials->get_access<access::mode::read_write>(cgh);
+		auto totals       = reduction.totals->get_access<access::mode::discard_write>(cgh);
+		auto count        = reduction.count->get_access<access::mode::atomic>(cgh);
 		accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(wgroup_size), cgh);
 
     auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
@@ -93,19 +95,7 @@ void jacobi_iterate(
         local_mem[local_id] += cl::sycl::fabs((u[global_id]-r[global_id])); // fabs is float version of abs
       }
 
-			item.barrier(access::fence_space::local_space);
-
-			for (size_t stride = 1; stride < wgroup_size; stride *= 2) {
-				auto idx = 2 * stride * local_id;
-				if (idx < wgroup_size) {
-					local_mem[idx] = local_mem[idx] + local_mem[idx + stride];
-				}
-			 	item.barrier(access::fence_space::local_space);
-			}
-
-			if (local_id == 0) {
-				 global_mem[item.get_group_linear_id()] = local_mem[0];
-			}
+			SyclHelper::reduceGroups<1>(item, local_mem, partials, totals, count);
 
     });//end of parallel for
   });//end of queue
@@ -113,7 +103,9 @@ void jacobi_iterate(
 	device_queue.wait();
 	#endif
 
-  *error = SyclHelper::reduceArray(tmpArrayBuff, device_queue);
+  double total;
+  SyclHelper::readTotals(reduction, &total, 1);
+  *error = total;
 }
 
 // Copies u into r
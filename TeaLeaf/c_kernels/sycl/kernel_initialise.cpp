@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <memory>
 #include "sycl_shared.hpp"
 #include "../../settings.h"
 #include "../../shared.h"
@@ -6,10 +7,9 @@
 using namespace cl::sycl;
 
 // Allocates, and zeroes an individual buffer
-void allocate_buffer(double** a, int x, int y)
+void allocate_buffer(double** a, int x, int y, bool hugetlb)
 {
-    //*a = (double*)malloc(sizeof(double)*x*y);
-    *a = new double[x*y];
+    *a = (double*)huge_alloc(sizeof(double)*x*y, hugetlb);
 
     if(*a == NULL)
     {
@@ -27,6 +27,34 @@ void allocate_buffer(double** a, int x, int y)
     }
 }
 
+// Creates a field buffer bound to a host array on huge pages, which the
+// runtime may use in place on the host, and which is unmapped once the
+// buffer is gone
+SyclBuffer* allocate_field_buffer(size_t len, bool hugetlb)
+{
+    double* host = (double*)huge_alloc(sizeof(double)*len, hugetlb);
+
+    if(host == NULL)
+    {
+        die(__LINE__, __FILE__, "Error allocating field buffer\n");
+    }
+
+    return new SyclBuffer{std::shared_ptr<double>(host, huge_free),
+        range<1>{len}, {property::buffer::use_host_ptr()}};
+}
+
+// Allocates the scratch of a reduction of nvalues sums over len values
+void allocate_reduction(SyclReduction* reduction, size_t nvalues, size_t len)
+{
+    const size_t n_wgroups = (len + WORK_GROUP_SIZE - 1) / WORK_GROUP_SIZE;
+    reduction->partials = new SyclBuffer{range<1>{nvalues*n_wgroups}};
+    reduction->totals   = new SyclBuffer{range<1>{nvalues}};
+    reduction->count    = new buffer<int, 1>{range<1>{1}};
+
+    auto count = reduction->count->get_access<access::mode::discard_write>();
+    count[0] = 0;
+}
+
 // Allocates all of the field buffers
 void kernel_initialise(
   Settings* settings, int x, int y, SyclBuffer** density0Buff,
@@ -37,7 +65,10 @@ void kernel_initialise(
   SyclBuffer** y_areaBuff, SyclBuffer** cell_xBuff, SyclBuffer** cell_yBuff,
   SyclBuffer** cell_dxBuff, SyclBuffer** cell_dyBuff, SyclBuffer** vertex_dxBuff,
   SyclBuffer** vertex_dyBuff, SyclBuffer** vertex_xBuff, SyclBuffer** vertex_yBuff,
-  SyclBuffer** comms_bufferBuff, double** cg_alphas, double** cg_betas,
+  SyclBuffer** comms_bufferBuff, SyclReduction* reduction,
+  SyclBuffer** cg_scalarsBuff, SyclBuffer** pipecg_qBuff,
+  SyclBuffer** pipecg_zBuff, SyclBuffer** sstep_basisBuff,
+  SyclReduction* sstep_reduction, double** cg_alphas, double** cg_betas,
   double** cheby_alphas, double** cheby_betas, queue** device_queue)
 {
     print_and_log(settings,
@@ -47,22 +78,22 @@ void kernel_initialise(
     (*device_queue) = new queue(cl::sycl::default_selector{});
     std::cout << "Running on " << (**device_queue).get_device().get_info<cl::sycl::info::device::name>()  << "\n";
 
-    (*density0Buff)     = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*densityBuff)      = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*energy0Buff)      = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*energyBuff)       = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*uBuff)            = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*u0Buff)           = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*pBuff)            = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*rBuff)            = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*miBuff)           = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*wBuff)            = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*kxBuff)           = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*kyBuff)           = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*sdBuff)           = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*volumeBuff)       = new SyclBuffer{range<1>{(size_t)x*y}};
-    (*x_areaBuff)       = new SyclBuffer{range<1>{(size_t)(x+1)*y}};
-    (*y_areaBuff)       = new SyclBuffer{range<1>{(size_t)x*(y+1)}};
+    (*density0Buff)     = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*densityBuff)      = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*energy0Buff)      = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*energyBuff)       = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*uBuff)            = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*u0Buff)           = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*pBuff)            = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*rBuff)            = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*miBuff)           = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*wBuff)            = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*kxBuff)           = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*kyBuff)           = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*sdBuff)           = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*volumeBuff)       = allocate_field_buffer((size_t)x*y, settings->hugetlb);
+    (*x_areaBuff)       = allocate_field_buffer((size_t)(x+1)*y, settings->hugetlb);
+    (*y_areaBuff)       = allocate_field_buffer((size_t)x*(y+1), settings->hugetlb);
     (*cell_xBuff)       = new SyclBuffer{range<1>{(size_t)x}};
     (*cell_yBuff)       = new SyclBuffer{range<1>{(size_t)y}};
     (*cell_dxBuff)      = new SyclBuffer{range<1>{(size_t)x}};
@@ -73,10 +104,20 @@ void kernel_initialise(
     (*vertex_yBuff)     = new SyclBuffer{range<1>{(size_t)(y+1)}};
     (*comms_bufferBuff) = new SyclBuffer{range<1>{(size_t)(MAX(x, y)*settings->halo_depth)}};
 
-    allocate_buffer(cg_alphas, settings->max_iters, 1);
-    allocate_buffer(cg_betas, settings->max_iters, 1);
-    allocate_buffer(cheby_alphas, settings->max_iters, 1);
-    allocate_buffer(cheby_betas, settings->max_iters, 1);
+    // Every reduction is over one x*y field
+    allocate_reduction(reduction, REDUCE_VALUES, (size_t)x*y);
+    (*cg_scalarsBuff)   = new SyclBuffer{range<1>{(size_t)(CG_SCALARS + 2*settings->max_iters)}};
+    (*pipecg_qBuff)     = NULL;
+    (*pipecg_zBuff)     = NULL;
+    (*sstep_basisBuff)  = NULL;
+    sstep_reduction->partials = NULL;
+    sstep_reduction->totals   = NULL;
+    sstep_reduction->count    = NULL;
+
+    allocate_buffer(cg_alphas, settings->max_iters, 1, settings->hugetlb);
+    allocate_buffer(cg_betas, settings->max_iters, 1, settings->hugetlb);
+    allocate_buffer(cheby_alphas, settings->max_iters, 1, settings->hugetlb);
+    allocate_buffer(cheby_betas, settings->max_iters, 1, settings->hugetlb);
 }
 
 void kernel_finalise(
@@ -87,13 +128,16 @@ void kernel_finalise(
   SyclBuffer** y_areaBuff, SyclBuffer** cell_xBuff, SyclBuffer** cell_yBuff,
   SyclBuffer** cell_dxBuff, SyclBuffer** cell_dyBuff, SyclBuffer** vertex_dxBuff,
   SyclBuffer** vertex_dyBuff, SyclBuffer** vertex_xBuff, SyclBuffer** vertex_yBuff,
-  SyclBuffer** comms_bufferBuff, double* cg_alphas, double* cg_betas,
+  SyclBuffer** comms_bufferBuff, SyclReduction* reduction,
+  SyclBuffer** cg_scalarsBuff, SyclBuffer** pipecg_qBuff,
+  SyclBuffer** pipecg_zBuff, SyclBuffer** sstep_basisBuff,
+  SyclReduction* sstep_reduction, double* cg_alphas, double* cg_betas,
   double* cheby_alphas, double* cheby_betas, cl::sycl::queue** device_queue)
 {
-    delete(cg_alphas);
-    delete(cg_betas);
-    delete(cheby_alphas);
-    delete(cheby_betas);
+    huge_free(cg_alphas);
+    huge_free(cg_betas);
+    huge_free(cheby_alphas);
+    huge_free(cheby_betas);
 
     delete(*device_queue);
 
@@ -122,4 +166,14 @@ void kernel_finalise(
     delete(*vertex_xBuff);
     delete(*vertex_yBuff);
     delete(*comms_bufferBuff);
+    delete(reduction->partials);
+    delete(reduction->totals);
+    delete(reduction->count);
+    delete(*cg_scalarsBuff);
+    delete(*pipecg_qBuff);
+    delete(*pipecg_zBuff);
+    delete(*sstep_basisBuff);
+    delete(sstep_reduction->partials);
+    delete(sstep_reduction->totals);
+    delete(sstep_reduction->count);
 }
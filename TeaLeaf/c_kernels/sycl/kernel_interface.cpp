@@ -16,7 +16,9 @@ void kernel_initialise(
   SyclBuffer** cell_xBuff, SyclBuffer** cell_yBuff, SyclBuffer** cell_dxBuff,
   SyclBuffer** cell_dyBuff, SyclBuffer** vertex_dxBuff, SyclBuffer** vertex_dyBuff,
   SyclBuffer** vertex_xBuff, SyclBuffer** vertex_yBuff, SyclBuffer** comms_bufferBuff,
-  double** cg_alphas, double** cg_betas, double** cheby_alphas, double** cheby_betas,
+  SyclReduction* reduction, SyclBuffer** cg_scalarsBuff,
+  SyclBuffer** pipecg_qBuff, SyclBuffer** pipecg_zBuff,
+  SyclBuffer** sstep_basisBuff, SyclReduction* sstep_reduction, double** cg_alphas, double** cg_betas, double** cheby_alphas, double** cheby_betas,
   cl::sycl::queue** device_queue);
 
 void kernel_finalise(
@@ -27,7 +29,10 @@ void kernel_finalise(
   SyclBuffer** x_areaBuff, SyclBuffer** y_areaBuff, SyclBuffer** cell_xBuff,
   SyclBuffer** cell_yBuff, SyclBuffer** cell_dxBuff, SyclBuffer** cell_dyBuff,
   SyclBuffer** vertex_dxBuff, SyclBuffer** vertex_dyBuff, SyclBuffer** vertex_xBuff,
-  SyclBuffer** vertex_yBuff, SyclBuffer** comms_bufferBuff, double* cg_alphas,
+  SyclBuffer** vertex_yBuff, SyclBuffer** comms_bufferBuff,
+  SyclReduction* reduction, SyclBuffer** cg_scalarsBuff,
+  SyclBuffer** pipecg_qBuff, SyclBuffer** pipecg_zBuff,
+  SyclBuffer** sstep_basisBuff, SyclReduction* sstep_reduction, double* cg_alphas,
   double* cg_betas, double* cheby_alphas, double* cheby_betas,
   cl::sycl::queue** device_queue);
 
@@ -79,7 +84,9 @@ void run_kernel_initialise(Chunk* chunk, Settings* settings)
     &(chunk->cell_x), &(chunk->cell_y), &(chunk->cell_dx),
     &(chunk->cell_dy), &(chunk->vertex_dx), &(chunk->vertex_dy),
     &(chunk->vertex_x), &(chunk->vertex_y), &(chunk->ext->comms_buffer),
-    &(chunk->cg_alphas), &(chunk->cg_betas), &(chunk->cheby_alphas),
+    &(chunk->ext->reduction), &(chunk->ext->cg_scalars), &(chunk->ext->pipecg_q),
+    &(chunk->ext->pipecg_z), &(chunk->ext->sstep_basis),
+    &(chunk->ext->sstep_reduction), &(chunk->cg_alphas), &(chunk->cg_betas), &(chunk->cheby_alphas),
     &(chunk->cheby_betas),&(device_queue));
 }
 
@@ -92,7 +99,10 @@ void run_kernel_finalise(Chunk* chunk, Settings* settings)
       &(chunk->volume), &(chunk->x_area), &(chunk->y_area), &(chunk->cell_x),
       &(chunk->cell_y), &(chunk->cell_dx), &(chunk->cell_dy), &(chunk->vertex_dx),
       &(chunk->vertex_dy), &(chunk->vertex_x), &(chunk->vertex_y),
-      &(chunk->ext->comms_buffer), (chunk->cg_alphas), (chunk->cg_betas),
+      &(chunk->ext->comms_buffer), &(chunk->ext->reduction),
+      &(chunk->ext->cg_scalars), &(chunk->ext->pipecg_q),
+      &(chunk->ext->pipecg_z), &(chunk->ext->sstep_basis),
+      &(chunk->ext->sstep_reduction), (chunk->cg_alphas), (chunk->cg_betas),
       (chunk->cheby_alphas), (chunk->cheby_betas),&(device_queue));
 }
 
@@ -124,6 +134,8 @@ void run_local_halos(
     LAUNCH_UPDATE(FIELD_ENERGY1, *(chunk->energy));
     LAUNCH_UPDATE(FIELD_U, *(chunk->u));
     LAUNCH_UPDATE(FIELD_SD, *(chunk->sd));
+    LAUNCH_UPDATE(FIELD_R, *(chunk->r));
+    LAUNCH_UPDATE(FIELD_W, *(chunk->w));
 }
 
 void run_pack_or_unpack(
@@ -183,7 +195,8 @@ void run_field_summary(Chunk* chunk, Settings* settings, double* vol,
 
   field_summary_func(
     chunk->x, chunk->y, settings->halo_depth, *(chunk->u), *(chunk->density),
-    *(chunk->energy0), *(chunk->volume), vol, mass, ie, temp, *(device_queue));
+    *(chunk->energy0), *(chunk->volume), vol, mass, ie, temp, chunk->ext->reduction,
+    *(device_queue));
 
   STOP_PROFILING(settings->kernel_profile, __func__);
 }
@@ -204,7 +217,8 @@ void run_cg_init( Chunk* chunk, Settings* settings, double rx, double ry,
 
   cg_init_others(
       chunk->x, chunk->y, settings->halo_depth, *(chunk->kx), *(chunk->ky),
-      *(chunk->p), *(chunk->r), *(chunk->u), *(chunk->w), rro, *(device_queue));
+      *(chunk->p), *(chunk->r), *(chunk->u), *(chunk->w), rro,
+      chunk->ext->reduction, *(device_queue));
 
   STOP_PROFILING(settings->kernel_profile, __func__);
 }
@@ -215,7 +229,8 @@ void run_cg_calc_w(Chunk* chunk, Settings* settings, double* pw)
 
   cg_calc_w(
       chunk->x, chunk->y, settings->halo_depth, *(chunk->w),
-      *(chunk->p), *(chunk->kx), *(chunk->ky), pw, *(device_queue));
+      *(chunk->p), *(chunk->kx), *(chunk->ky), pw, chunk->ext->reduction,
+      *(device_queue));
 
   STOP_PROFILING(settings->kernel_profile, __func__);
 }
@@ -226,7 +241,8 @@ void run_cg_calc_ur( Chunk* chunk, Settings* settings, double alpha, double* rrn
 
   cg_calc_ur(
       chunk->x, chunk->y, settings->halo_depth, *(chunk->u), *(chunk->r),
-      *(chunk->p), *(chunk->w), alpha, rrn, *(device_queue));
+      *(chunk->p), *(chunk->w), alpha, rrn, chunk->ext->reduction,
+      *(device_queue));
 
   STOP_PROFILING(settings->kernel_profile, __func__);
 }
@@ -242,6 +258,149 @@ void run_cg_calc_p(Chunk* chunk, Settings* settings, double beta)
   STOP_PROFILING(settings->kernel_profile, __func__);
 }
 
+// CG solver kernels keeping alpha, beta, rro and rrn on the device
+void run_cg_device_init(Chunk* chunk, Settings* settings, double rro)
+{
+  START_PROFILING(settings->kernel_profile);
+
+  cg_device_init(rro, *(chunk->ext->cg_scalars));
+
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
+void run_cg_device_main_step(Chunk* chunk, Settings* settings, int tt)
+{
+  START_PROFILING(settings->kernel_profile);
+
+  cg_device_calc_w(
+      chunk->x, chunk->y, settings->halo_depth, tt, *(chunk->w),
+      *(chunk->p), *(chunk->kx), *(chunk->ky), *(chunk->ext->cg_scalars),
+      chunk->ext->reduction, *(device_queue));
+
+  cg_device_calc_ur(
+      chunk->x, chunk->y, settings->halo_depth, tt, settings->max_iters,
+      *(chunk->u), *(chunk->r), *(chunk->p), *(chunk->w),
+      *(chunk->ext->cg_scalars), chunk->ext->reduction, *(device_queue));
+
+  cg_device_calc_p(
+      chunk->x, chunk->y, settings->halo_depth, *(chunk->p), *(chunk->r),
+      *(chunk->ext->cg_scalars), *(device_queue));
+
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
+void run_cg_device_read(
+    Chunk* chunk, Settings* settings, int first, int last, double* rrn)
+{
+  START_PROFILING(settings->kernel_profile);
+
+  cg_device_read(
+      settings->max_iters, first, last, *(chunk->ext->cg_scalars), rrn,
+      chunk->cg_alphas, chunk->cg_betas);
+
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
+// Pipelined CG solver kernels
+void run_pipecg_init(Chunk* chunk, Settings* settings, double* rr, double* wr)
+{
+  START_PROFILING(settings->kernel_profile);
+
+  // The solver may be picked on the command line, after kernel_initialise
+  if(chunk->ext->pipecg_q == NULL)
+  {
+    chunk->ext->pipecg_q = allocate_field_buffer((size_t)chunk->x*chunk->y, settings->hugetlb);
+    chunk->ext->pipecg_z = allocate_field_buffer((size_t)chunk->x*chunk->y, settings->hugetlb);
+  }
+
+  pipecg_init(
+      chunk->x, chunk->y, settings->halo_depth, *(chunk->r), *(chunk->w),
+      *(chunk->sd), *(chunk->ext->pipecg_z), *(chunk->kx), *(chunk->ky), rr, wr,
+      chunk->ext->reduction, *(device_queue));
+
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
+void run_pipecg_calc_q(Chunk* chunk, Settings* settings)
+{
+  START_PROFILING(settings->kernel_profile);
+
+  pipecg_calc_q(
+      chunk->x, chunk->y, settings->halo_depth, *(chunk->sd),
+      *(chunk->ext->pipecg_q), *(chunk->kx), *(chunk->ky), *(device_queue));
+
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
+void run_pipecg_calc_update(
+    Chunk* chunk, Settings* settings, double alpha, double beta,
+    double* rr, double* wr)
+{
+  START_PROFILING(settings->kernel_profile);
+
+  pipecg_calc_update(
+      chunk->x, chunk->y, settings->halo_depth, alpha, beta, *(chunk->u),
+      *(chunk->p), *(chunk->r), *(chunk->w), *(chunk->sd),
+      *(chunk->ext->pipecg_q), *(chunk->ext->pipecg_z), rr, wr,
+      chunk->ext->reduction, *(device_queue));
+
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
+// S-step CG solver kernels
+void run_sstep_init(Chunk* chunk, Settings* settings, double rx, double ry)
+{
+  START_PROFILING(settings->kernel_profile);
+
+  // The solver may be picked on the command line, after kernel_initialise
+  if(chunk->ext->sstep_basis == NULL)
+  {
+    const size_t len = (size_t)chunk->x*chunk->y;
+    chunk->ext->sstep_basis = allocate_field_buffer(
+        (2*settings->sstep_cg_steps+1)*len, settings->hugetlb);
+    allocate_reduction(&(chunk->ext->sstep_reduction),
+        (settings->sstep_cg_steps+1)*(2*settings->sstep_cg_steps+1), len);
+  }
+
+  sstep_init_k(
+      chunk->x, chunk->y, settings->coefficient, *(chunk->density),
+      *(chunk->kx), *(chunk->ky), rx, ry, *(device_queue));
+
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
+void run_sstep_calc_basis(
+    Chunk* chunk, Settings* settings, int steps, double sigma, double* gram)
+{
+  START_PROFILING(settings->kernel_profile);
+
+  sstep_calc_basis(
+      chunk->x, chunk->y, settings->halo_depth, steps, sigma, *(chunk->p),
+      *(chunk->r), *(chunk->ext->sstep_basis), *(chunk->kx), *(chunk->ky),
+      *(device_queue));
+
+  sstep_calc_gram(
+      chunk->x, chunk->y, settings->halo_depth, steps,
+      *(chunk->ext->sstep_basis), gram, chunk->ext->sstep_reduction,
+      *(device_queue));
+
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
+void run_sstep_calc_update(
+    Chunk* chunk, Settings* settings, int steps, double* cu, double* cr,
+    double* cp)
+{
+  START_PROFILING(settings->kernel_profile);
+
+  sstep_calc_update(
+      chunk->x, chunk->y, settings->halo_depth, steps, cu, cr, cp,
+      *(chunk->u), *(chunk->p), *(chunk->r), *(chunk->ext->sstep_basis),
+      *(device_queue));
+
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
 // Chebyshev solver kernels
 void run_cheby_init(Chunk* chunk, Settings* settings)
 {
@@ -294,7 +453,8 @@ void run_jacobi_iterate(
 
   jacobi_iterate(
       chunk->x, chunk->y, settings->halo_depth, *(chunk->u),
-      *(chunk->u0), *(chunk->r), *(chunk->kx), *(chunk->ky), error, *(device_queue));
+      *(chunk->u0), *(chunk->r), *(chunk->kx), *(chunk->ky), error,
+      chunk->ext->reduction, *(device_queue));
 
   STOP_PROFILING(settings->kernel_profile, __func__);
 }
@@ -354,7 +514,8 @@ void run_calculate_2norm(
   START_PROFILING(settings->kernel_profile);
 
   calculate_2norm(
-      chunk->x, chunk->y, settings->halo_depth, *(buffer), norm, *(device_queue));
+      chunk->x, chunk->y, settings->halo_depth, *(buffer), norm,
+      chunk->ext->reduction, *(device_queue));
 
   STOP_PROFILING(settings->kernel_profile, __func__);
 }
@@ -0,0 +1,164 @@
+#include "sycl_shared.hpp"
+#include "../../shared.h"
+
+using namespace cl::sycl;
+
+// The pipelined (Ghysels-Vanroose) CG keeps w = Ar in sd, for its halo
+// exchange, s = Ap in w, and q = Aw and z = As in buffers of its own
+
+// Calculates w = Ar and z = As, and then (r,r) and (w,r)
+void pipecg_init(
+  const int x, const int y, const int halo_depth, SyclBuffer& rBuff,
+  SyclBuffer& wBuff, SyclBuffer& sdBuff, SyclBuffer& zBuff, SyclBuffer& kxBuff,
+  SyclBuffer& kyBuff, double* rr, double* wr, SyclReduction& reduction,
+  queue& device_queue)
+{
+  size_t wgroup_size = WORK_GROUP_SIZE;
+  auto len = rBuff.get_count();
+  auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
+
+  device_queue.submit([&](handler &cgh) {
+    auto r            = rBuff.get_access<access::mode::read>(cgh);
+    auto s            = wBuff.get_access<access::mode::read>(cgh);
+    auto w            = sdBuff.get_access<access::mode::write>(cgh);
+    auto z            = zBuff.get_access<access::mode::write>(cgh);
+    auto kx           = kxBuff.get_access<access::mode::read>(cgh);
+    auto ky           = kyBuff.get_access<access::mode::read>(cgh);
+    auto partials     = reduction.partials->get_access<access::mode::read_write>(cgh);
+    auto totals       = reduction.totals->get_access<access::mode::discard_write>(cgh);
+    auto count        = reduction.count->get_access<access::mode::atomic>(cgh);
+    // (r,r) and then (w,r) of the work-items
+    accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(2*wgroup_size), cgh);
+
+    auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
+    cgh.parallel_for<class pipecg_init>( myRange, [=] (nd_item<1> item){
+
+      size_t local_id = item.get_local_linear_id();
+      size_t global_id = item.get_global_linear_id();
+      local_mem[local_id] = 0;
+      local_mem[wgroup_size + local_id] = 0;
+
+      const size_t kk = global_id % x;
+      const size_t jj = global_id / x;
+      if(kk >= halo_depth && kk < x - halo_depth &&
+         jj >= halo_depth && jj < y - halo_depth)
+      {
+        int index = global_id;
+        const double smvp = SMVP(r);
+        w[global_id] = smvp;
+        z[global_id] = SMVP(s);
+        local_mem[local_id] = r[global_id]*r[global_id];
+        local_mem[wgroup_size + local_id] = smvp*r[global_id];
+      }
+
+      SyclHelper::reduceGroups<2>(item, local_mem, partials, totals, count);
+
+    });//end of parallel for
+  });//end of queue
+  #ifdef ENABLE_PROFILING
+  device_queue.wait();
+  #endif
+
+  double total[2];
+  SyclHelper::readTotals(reduction, total, 2);
+  *rr += total[0];
+  *wr += total[1];
+}
+
+// Calculates q = Aw
+void pipecg_calc_q(
+  const int x, const int y, const int halo_depth, SyclBuffer& sdBuff,
+  SyclBuffer& qBuff, SyclBuffer& kxBuff, SyclBuffer& kyBuff,
+  queue& device_queue)
+{
+  device_queue.submit([&](handler &cgh){
+    auto sd           = sdBuff.get_access<access::mode::read>(cgh);
+    auto q            = qBuff.get_access<access::mode::write>(cgh);
+    auto kx           = kxBuff.get_access<access::mode::read>(cgh);
+    auto ky           = kyBuff.get_access<access::mode::read>(cgh);
+
+    auto myRange = range<1>(x*y);
+    cgh.parallel_for<class pipecg_calc_q>( myRange, [=] (id<1> idx){
+
+      const size_t kk = idx[0] % x;
+      const size_t jj = idx[0] / x;
+      if(kk >= halo_depth && kk < x - halo_depth &&
+         jj >= halo_depth && jj < y - halo_depth)
+      {
+        int index = idx[0];
+        q[idx[0]] = SMVP(sd);
+      }
+
+    });//end of parallel for
+  });//end of queue
+  #ifdef ENABLE_PROFILING
+  device_queue.wait();
+  #endif
+}
+
+// Updates z, s, p, u, r and w, and calculates the next (r,r) and (w,r)
+void pipecg_calc_update(
+  const int x, const int y, const int halo_depth, const double alpha,
+  const double beta, SyclBuffer& uBuff, SyclBuffer& pBuff, SyclBuffer& rBuff,
+  SyclBuffer& wBuff, SyclBuffer& sdBuff, SyclBuffer& qBuff, SyclBuffer& zBuff,
+  double* rr, double* wr, SyclReduction& reduction, queue& device_queue)
+{
+  size_t wgroup_size = WORK_GROUP_SIZE;
+  auto len = rBuff.get_count();
+  auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
+
+  device_queue.submit([&](handler &cgh) {
+    auto u            = uBuff.get_access<access::mode::read_write>(cgh);
+    auto p            = pBuff.get_access<access::mode::read_write>(cgh);
+    auto r            = rBuff.get_access<access::mode::read_write>(cgh);
+    auto s            = wBuff.get_access<access::mode::read_write>(cgh);
+    auto w            = sdBuff.get_access<access::mode::read_write>(cgh);
+    auto q            = qBuff.get_access<access::mode::read>(cgh);
+    auto z            = zBuff.get_access<access::mode::read_write>(cgh);
+    auto partials     = reduction.partials->get_access<access::mode::read_write>(cgh);
+    auto totals       = reduction.totals->get_access<access::mode::discard_write>(cgh);
+    auto count        = reduction.count->get_access<access::mode::atomic>(cgh);
+    // (r,r) and then (w,r) of the work-items
+    accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(2*wgroup_size), cgh);
+
+    auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
+    cgh.parallel_for<class pipecg_calc_update>( myRange, [=] (nd_item<1> item){
+
+      size_t local_id = item.get_local_linear_id();
+      size_t global_id = item.get_global_linear_id();
+      local_mem[local_id] = 0;
+      local_mem[wgroup_size + local_id] = 0;
+
+      const size_t kk = global_id % x;
+      const size_t jj = global_id / x;
+      if(kk >= halo_depth && kk < x - halo_depth &&
+         jj >= halo_depth && jj < y - halo_depth)
+      {
+        const double z_new = q[global_id] + beta*z[global_id];
+        const double s_new = w[global_id] + beta*s[global_id];
+        const double p_new = r[global_id] + beta*p[global_id];
+        const double r_new = r[global_id] - alpha*s_new;
+        const double w_new = w[global_id] - alpha*z_new;
+        z[global_id] = z_new;
+        s[global_id] = s_new;
+        p[global_id] = p_new;
+        u[global_id] += alpha*p_new;
+        r[global_id] = r_new;
+        w[global_id] = w_new;
+        local_mem[local_id] = r_new*r_new;
+        local_mem[wgroup_size + local_id] = w_new*r_new;
+      }
+
+      SyclHelper::reduceGroups<2>(item, local_mem, partials, totals, count);
+
+    });//end of parallel for
+  });//end of queue
+  #ifdef ENABLE_PROFILING
+  device_queue.wait();
+  #endif
+
+  double total[2];
+  SyclHelper::readTotals(reduction, total, 2);
+  *rr += total[0];
+  *wr += total[1];
+}
@@ -67,16 +67,17 @@ void calculate_residual(
 // Calculates the 2 norm of the provided buffer.
 void calculate_2norm(
   const int x, const int y, const int halo_depth, SyclBuffer& bufferBuff,
-  double* norm, queue& device_queue)
+  double* norm, SyclReduction& reduction, queue& device_queue)
 {
   size_t wgroup_size = WORK_GROUP_SIZE;
   auto len = bufferBuff.get_count();
   auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
-  buffer<double, 1> tmpArrayBuff{range<1>{(size_t)n_wgroups}};
 
   device_queue.submit([&](handler &cgh) {
     auto buffer           = bufferBuff.get_access<access::mode::read>(cgh);
-    auto global_mem       = tmpArrayBuff.get_access<access::mode::discard_write>(cgh);
+    auto partials         = reduction.partials->get_access<access::mode::read_write>(cgh);
+    auto totals           = reduction.totals->get_access<access::mode::discard_write>(cgh);
+    auto count            = reduction.count->get_access<access::mode::atomic>(cgh);
     accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(wgroup_size), cgh);
 
     auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
@@ -94,26 +95,16 @@ void calculate_2norm(
         local_mem[local_id] = buffer[global_id]*buffer[global_id];
       }
 
-      item.barrier(access::fence_space::local_space);
-
-      for (size_t stride = 1; stride < wgroup_size; stride *= 2) {
-        auto idx = 2 * stride * local_id;
-        if (idx < wgroup_size) {
-          local_mem[idx] = local_mem[idx] + local_mem[idx + stride];
-        }
-        item.barrier(access::fence_space::local_space);
-      }
-
-      if (local_id == 0) {
-        global_mem[item.get_group_linear_id()] = local_mem[0];
-      }
+      SyclHelper::reduceGroups<1>(item, local_mem, partials, totals, count);
 
     });//end of parallel for
   });//end of queue
   #ifdef ENABLE_PROFILING
   device_queue.wait();
   #endif
-  *norm = SyclHelper::reduceArray(tmpArrayBuff, device_queue);
+  double total;
+  SyclHelper::readTotals(reduction, &total, 1);
+  *norm = total;
 }
 
 // Finalises the energy field.
@@ -0,0 +1,280 @@
+#include "sycl_shared.hpp"
+#include "../../settings.h"
+#include "../../shared.h"
+
+using namespace cl::sycl;
+
+// The s-step CG keeps the basis p, Ap/sigma, ..., (A/sigma)^s p followed by
+// r, Ar/sigma, ..., (A/sigma)^(s-1) r, 2s+1 fields one after another
+
+// The sstep_calc_gram kernel of s steps
+template <int STEPS> class sstep_calc_gram_kernel;
+
+// The matrix-vector product of the field at offset in a
+template <typename KAcc, typename VAcc>
+static inline double sstep_smvp(
+  const KAcc& kx, const KAcc& ky, const VAcc& a, const int x,
+  const size_t index, const size_t offset)
+{
+  return (1.0 + (kx[index+1]+kx[index]) + (ky[index+x]+ky[index]))*a[offset+index]
+    - (kx[index+1]*a[offset+index+1]+kx[index]*a[offset+index-1])
+    - (ky[index+x]*a[offset+index+x]+ky[index]*a[offset+index-x]);
+}
+
+// Initialises kx,ky in the halo as well, from the density
+void sstep_init_k(
+  const int x, const int y, const int coefficient, SyclBuffer& densityBuff,
+  SyclBuffer& kxBuff, SyclBuffer& kyBuff, const double rx, const double ry,
+  queue& device_queue)
+{
+  device_queue.submit([&](handler &cgh){
+    auto density      = densityBuff.get_access<access::mode::read>(cgh);
+    auto kx           = kxBuff.get_access<access::mode::write>(cgh);
+    auto ky           = kyBuff.get_access<access::mode::write>(cgh);
+
+    auto myRange = range<1>(x*y);
+    cgh.parallel_for<class sstep_init_k>( myRange, [=] (id<1> idx){
+
+      const size_t kk = idx[0] % x;
+      const size_t jj = idx[0] / x;
+
+      if(jj >= 1 && kk >= 1)
+      {
+        // As the w of cg_init_u
+        const double w = (coefficient == CONDUCTIVITY)
+          ? density[idx[0]] : 1.0/density[idx[0]];
+        const double w_left = (coefficient == CONDUCTIVITY)
+          ? density[idx[0]-1] : 1.0/density[idx[0]-1];
+        const double w_down = (coefficient == CONDUCTIVITY)
+          ? density[idx[0]-x] : 1.0/density[idx[0]-x];
+
+        kx[idx[0]] = rx*(w_left+w) / (2.0*w_left*w);
+        ky[idx[0]] = ry*(w_down+w) / (2.0*w_down*w);
+      }
+    });//end of parallel for
+  });//end of queue
+  #ifdef ENABLE_PROFILING
+  device_queue.wait();
+  #endif
+}
+
+// Calculates the basis from p and r, which have halos steps deep
+void sstep_calc_basis(
+  const int x, const int y, const int halo_depth, const int steps,
+  const double sigma, SyclBuffer& pBuff, SyclBuffer& rBuff,
+  SyclBuffer& basisBuff, SyclBuffer& kxBuff, SyclBuffer& kyBuff,
+  queue& device_queue)
+{
+  const size_t len = (size_t)x*y;
+  const size_t r_first = (steps+1)*len;
+
+  for(int ss = 0; ss < steps; ++ss)
+  {
+    // Each power is valid one cell less deep into the halo than the last
+    const int depth = steps - 1 - ss;
+    const bool with_r = ss < steps - 1;
+
+    device_queue.submit([&](handler &cgh){
+      auto p            = pBuff.get_access<access::mode::read>(cgh);
+      auto r            = rBuff.get_access<access::mode::read>(cgh);
+      auto basis        = basisBuff.get_access<access::mode::read_write>(cgh);
+      auto kx           = kxBuff.get_access<access::mode::read>(cgh);
+      auto ky           = kyBuff.get_access<access::mode::read>(cgh);
+
+      auto myRange = range<1>(len);
+      cgh.parallel_for<class sstep_calc_basis>( myRange, [=] (id<1> idx){
+
+        const size_t kk = idx[0] % x;
+        const size_t jj = idx[0] / x;
+
+        if(ss == 0)
+        {
+          basis[idx[0]] = p[idx[0]];
+          basis[r_first+idx[0]] = r[idx[0]];
+        }
+
+        if(kk >= halo_depth - depth && kk < x - halo_depth + depth &&
+           jj >= halo_depth - depth && jj < y - halo_depth + depth)
+        {
+          const size_t from = ss*len;
+          basis[from+len+idx[0]] = (ss == 0)
+            ? sstep_smvp(kx, ky, p, x, idx[0], 0) / sigma
+            : sstep_smvp(kx, ky, basis, x, idx[0], from) / sigma;
+
+          if(with_r)
+          {
+            const size_t r_from = r_first + ss*len;
+            basis[r_from+len+idx[0]] = (ss == 0)
+              ? sstep_smvp(kx, ky, r, x, idx[0], 0) / sigma
+              : sstep_smvp(kx, ky, basis, x, idx[0], r_from) / sigma;
+          }
+        }
+      });//end of parallel for
+    });//end of queue
+    #ifdef ENABLE_PROFILING
+    device_queue.wait();
+    #endif
+  }
+}
+
+// Calculates the upper triangle of the Gram matrix of the basis, by rows
+template <int STEPS>
+static void sstep_calc_gram_steps(
+  const int x, const int y, const int halo_depth, SyclBuffer& basisBuff,
+  double* gram, SyclReduction& reduction, queue& device_queue)
+{
+  const int nbasis = 2*STEPS + 1;
+  const int ngram = nbasis*(nbasis+1)/2;
+
+  size_t wgroup_size = WORK_GROUP_SIZE;
+  const size_t len = (size_t)x*y;
+  auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
+
+  device_queue.submit([&](handler &cgh) {
+    auto basis        = basisBuff.get_access<access::mode::read>(cgh);
+    auto partials     = reduction.partials->get_access<access::mode::read_write>(cgh);
+    auto totals       = reduction.totals->get_access<access::mode::discard_write>(cgh);
+    auto count        = reduction.count->get_access<access::mode::atomic>(cgh);
+    // The ngram products of the work-items, one after another
+    accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(ngram*wgroup_size), cgh);
+
+    auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
+    cgh.parallel_for<sstep_calc_gram_kernel<STEPS>>( myRange, [=] (nd_item<1> item){
+
+      size_t local_id = item.get_local_linear_id();
+      size_t global_id = item.get_global_linear_id();
+
+      const size_t kk = global_id % x;
+      const size_t jj = global_id / x;
+      if(kk >= halo_depth && kk < x - halo_depth &&
+         jj >= halo_depth && jj < y - halo_depth)
+      {
+        double v[nbasis];
+        for(int ii = 0; ii < nbasis; ++ii)
+        {
+          v[ii] = basis[ii*len + global_id];
+        }
+
+        int gg = 0;
+        for(int ii = 0; ii < nbasis; ++ii)
+        {
+          for(int ll = ii; ll < nbasis; ++ll, ++gg)
+          {
+            local_mem[gg*wgroup_size + local_id] = v[ii]*v[ll];
+          }
+        }
+      }
+      else
+      {
+        for(int gg = 0; gg < ngram; ++gg)
+        {
+          local_mem[gg*wgroup_size + local_id] = 0;
+        }
+      }
+
+      SyclHelper::reduceGroups<ngram>(item, local_mem, partials, totals, count);
+
+    });//end of parallel for
+  });//end of queue
+  #ifdef ENABLE_PROFILING
+  device_queue.wait();
+  #endif
+
+  double total[ngram];
+  SyclHelper::readTotals(reduction, total, ngram);
+  for(int gg = 0; gg < ngram; ++gg)
+  {
+    gram[gg] += total[gg];
+  }
+}
+
+// Adds the Gram matrix of the basis to gram, (2s+1)(s+1) values by rows
+void sstep_calc_gram(
+  const int x, const int y, const int halo_depth, const int steps,
+  SyclBuffer& basisBuff, double* gram, SyclReduction& reduction,
+  queue& device_queue)
+{
+  static_assert(SSTEP_CG_MAX_STEPS == 5, "a Gram kernel per step count");
+
+  switch(steps)
+  {
+    case 1:
+      sstep_calc_gram_steps<1>(x, y, halo_depth, basisBuff, gram, reduction, device_queue);
+      break;
+    case 2:
+      sstep_calc_gram_steps<2>(x, y, halo_depth, basisBuff, gram, reduction, device_queue);
+      break;
+    case 3:
+      sstep_calc_gram_steps<3>(x, y, halo_depth, basisBuff, gram, reduction, device_queue);
+      break;
+    case 4:
+      sstep_calc_gram_steps<4>(x, y, halo_depth, basisBuff, gram, reduction, device_queue);
+      break;
+    case 5:
+      sstep_calc_gram_steps<5>(x, y, halo_depth, basisBuff, gram, reduction, device_queue);
+      break;
+    default:
+      die(__LINE__, __FILE__, "No s-step CG kernel for %d steps\n", steps);
+  }
+}
+
+// Sets u += Vcu, r = Vcr and p = Vcp for the basis V and the coordinates
+// c of u, r and p in it, 2s+1 of each
+void sstep_calc_update(
+  const int x, const int y, const int halo_depth, const int steps,
+  const double* cu, const double* cr, const double* cp, SyclBuffer& uBuff,
+  SyclBuffer& pBuff, SyclBuffer& rBuff, SyclBuffer& basisBuff,
+  queue& device_queue)
+{
+  struct Coordinates
+  {
+    double u[2*SSTEP_CG_MAX_STEPS+1];
+    double r[2*SSTEP_CG_MAX_STEPS+1];
+    double p[2*SSTEP_CG_MAX_STEPS+1];
+  } c;
+
+  const int nbasis = 2*steps + 1;
+  for(int ii = 0; ii < nbasis; ++ii)
+  {
+    c.u[ii] = cu[ii];
+    c.r[ii] = cr[ii];
+    c.p[ii] = cp[ii];
+  }
+
+  const size_t len = (size_t)x*y;
+
+  device_queue.submit([&](handler &cgh){
+    auto u            = uBuff.get_access<access::mode::read_write>(cgh);
+    auto p            = pBuff.get_access<access::mode::write>(cgh);
+    auto r            = rBuff.get_access<access::mode::write>(cgh);
+    auto basis        = basisBuff.get_access<access::mode::read>(cgh);
+
+    auto myRange = range<1>(len);
+    cgh.parallel_for<class sstep_calc_update>( myRange, [=] (id<1> idx){
+
+      const size_t kk = idx[0] % x;
+      const size_t jj = idx[0] / x;
+      if(kk >= halo_depth && kk < x - halo_depth &&
+         jj >= halo_depth && jj < y - halo_depth)
+      {
+        double du = 0.0;
+        double r_new = 0.0;
+        double p_new = 0.0;
+        for(int ii = 0; ii < nbasis; ++ii)
+        {
+          const double v = basis[ii*len + idx[0]];
+          du += c.u[ii]*v;
+          r_new += c.r[ii]*v;
+          p_new += c.p[ii]*v;
+        }
+
+        u[idx[0]] += du;
+        r[idx[0]] = r_new;
+        p[idx[0]] = p_new;
+      }
+    });//end of parallel for
+  });//end of queue
+  #ifdef ENABLE_PROFILING
+  device_queue.wait();
+  #endif
+}
@@ -6,8 +6,25 @@
 using namespace cl::sycl;
 
 #define WORK_GROUP_SIZE 64
+#define REDUCE_VALUES 4 // most sums one reduction makes, in field_summary
 typedef buffer<double, 1> SyclBuffer;
 
+// Scratch of the reductions, allocated once for the chunk
+typedef struct SyclReduction
+{
+    SyclBuffer* partials;     // REDUCE_VALUES sums of each work-group
+    SyclBuffer* totals;       // REDUCE_VALUES sums over the work-groups
+    buffer<int, 1>* count;    // work-groups done, back to 0 after each
+} SyclReduction;
+
+// The CG scalars kept on the device with cg_check_frequency, followed by the
+// alpha and then the beta of each iteration, max_iters of each
+#define CG_RRO 0
+#define CG_RRN 1
+#define CG_ALPHA 2
+#define CG_BETA 3
+#define CG_SCALARS 4
+
 class SyclHelper
 {
 	public:
@@ -32,50 +49,96 @@ class SyclHelper
 			}
 		}
 
-		static double reduceArray(SyclBuffer& arrayBuff, queue& device_queue)
+		// Ends a reduction of NVALUES sums, each in a slice of local_mem as
+		// long as the work-group: the group adds its slices up and writes
+		// them to the partials, and the last group to get there adds every
+		// group's partials into the totals, so a reduction is one kernel.
+		// Both additions go in a fixed order, whichever group is last, and
+		// the first work-item of that group is the only one to get true.
+		template <int NVALUES, class LocalAcc, class PartialsAcc,
+		          class TotalsAcc, class CountAcc>
+		static bool reduceGroups(
+			nd_item<1>& item, const LocalAcc& local_mem,
+			const PartialsAcc& partials, const TotalsAcc& totals,
+			const CountAcc& count)
 		{
-		  size_t wgroup_size = WORK_GROUP_SIZE;
-		  auto len = arrayBuff.get_count();
-		  while (len != 1) {
-		  	auto n_wgroups = floor((len + wgroup_size - 1) / wgroup_size);
-		     device_queue.submit([&] (handler& cgh) {
-		    	accessor <double, 1, access::mode::read_write, access::target::local> local_mem(range<1>(wgroup_size), cgh);
-          auto global_mem = arrayBuff.get_access<access::mode::read_write>(cgh);
-
-					auto myRange = nd_range<1>(n_wgroups * wgroup_size, wgroup_size);
-				  cgh.parallel_for<class reduceArrays>(myRange, [=] (nd_item<1> item) {
-
-		      	size_t local_id = item.get_local_linear_id();
-		        size_t global_id = item.get_global_linear_id();
-		        local_mem[local_id] = 0;
-
-		        if(global_id+1<=len){
-		        	local_mem[local_id] = global_mem[global_id];
-		        }
-
-		        item.barrier(access::fence_space::local_space);
-
-		        for (size_t stride = 1; stride < wgroup_size; stride *= 2) {
-		        	auto idx = 2 * stride * local_id;
-		          if (idx < wgroup_size) {
-		          	local_mem[idx] = local_mem[idx] + local_mem[idx + stride];
-		          }
-             	item.barrier(access::fence_space::local_space);
-		        }
-
-		        if (local_id == 0) {
-		        	global_mem[item.get_group_linear_id()] = local_mem[0];
-		        }
-
-					});//end of parallel for
-			  });//end of queue
-				#ifdef ENABLE_PROFILING
-				device_queue.wait();
-				#endif
-		    len = n_wgroups;
-		  }
-		  auto acc = arrayBuff.get_access<access::mode::read>();
-		  return acc[0];
+			const size_t wgroup_size = item.get_local_range(0);
+			const size_t n_wgroups = item.get_group_range(0);
+			const size_t local_id = item.get_local_linear_id();
+			const size_t group_id = item.get_group_linear_id();
+
+			item.barrier(access::fence_space::local_space);
+
+			for (size_t stride = 1; stride < wgroup_size; stride *= 2) {
+				auto idx = 2 * stride * local_id;
+				if (idx < wgroup_size) {
+					for (int vv = 0; vv < NVALUES; ++vv) {
+						local_mem[vv*wgroup_size + idx] = local_mem[vv*wgroup_size + idx]
+							+ local_mem[vv*wgroup_size + idx + stride];
+					}
+				}
+				item.barrier(access::fence_space::local_space);
+			}
+
+			if (local_id == 0) {
+				for (int vv = 0; vv < NVALUES; ++vv) {
+					partials[vv*n_wgroups + group_id] = local_mem[vv*wgroup_size];
+				}
+				// The partials have to be seen by the group counted last
+				item.mem_fence(access::fence_space::global_space);
+				local_mem[0] = (atomic_fetch_add(count[0], 1) == (int)n_wgroups - 1) ? 1.0 : 0.0;
+			}
+
+			item.barrier(access::fence_space::local_space);
+			const bool last = local_mem[0] != 0.0;
+			item.barrier(access::fence_space::local_space);
+
+			if (!last) {
+				return false;
+			}
+
+			item.mem_fence(access::fence_space::global_space);
+
+			for (int vv = 0; vv < NVALUES; ++vv) {
+				double sum = 0.0;
+				for (size_t gg = local_id; gg < n_wgroups; gg += wgroup_size) {
+					sum += partials[vv*n_wgroups + gg];
+				}
+				local_mem[vv*wgroup_size + local_id] = sum;
+			}
+
+			item.barrier(access::fence_space::local_space);
+
+			for (size_t stride = 1; stride < wgroup_size; stride *= 2) {
+				auto idx = 2 * stride * local_id;
+				if (idx < wgroup_size) {
+					for (int vv = 0; vv < NVALUES; ++vv) {
+						local_mem[vv*wgroup_size + idx] = local_mem[vv*wgroup_size + idx]
+							+ local_mem[vv*wgroup_size + idx + stride];
+					}
+				}
+				item.barrier(access::fence_space::local_space);
+			}
+
+			if (local_id == 0) {
+				for (int vv = 0; vv < NVALUES; ++vv) {
+					totals[vv] = local_mem[vv*wgroup_size];
+				}
+				// Ready for the next reduction
+				count[0].store(0);
+			}
+
+			return local_id == 0;
+		}
+
+		// Reads the totals of the last reduction back to the host
+		static void readTotals(SyclReduction& reduction, double* values, int nvalues)
+		{
+			auto acc = reduction.totals->get_access<access::mode::read>();
+			for (int vv = 0; vv != nvalues; ++vv)
+			{
+				values[vv] = acc[vv];
+			}
 		}
 
 		static void GetSyclArrayVal(int len, SyclBuffer& device_buffer, const char* name)
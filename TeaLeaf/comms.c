@@ -60,6 +60,27 @@ void sum_over_ranks(Settings* settings, double* a)
   STOP_PROFILING(settings->kernel_profile, __func__);
 }
 
+// The one sum over ranks that may be in flight at a time
+static MPI_Request sum_request = MPI_REQUEST_NULL;
+
+// Starts a sum of n values over all ranks, in place, which must not be
+// touched until sum_over_ranks_end returns
+void sum_over_ranks_begin(Settings* settings, double* a, int n)
+{
+  START_PROFILING(settings->kernel_profile);
+  MPI_Iallreduce(
+      MPI_IN_PLACE, a, n, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD, &sum_request);
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
+// Waits for the sum started by sum_over_ranks_begin
+void sum_over_ranks_end(Settings* settings)
+{
+  START_PROFILING(settings->kernel_profile);
+  MPI_Wait(&sum_request, MPI_STATUS_IGNORE);
+  STOP_PROFILING(settings->kernel_profile, __func__);
+}
+
 // Reduce across all ranks to get minimum value
 void min_over_ranks(Settings* settings, double* a)
 {
@@ -91,6 +112,8 @@ void initialise_ranks(Settings* settings)
 }
 void finalise_comms() { }
 void sum_over_ranks(Settings* settings, double* a) { }
+void sum_over_ranks_begin(Settings* settings, double* a, int n) { }
+void sum_over_ranks_end(Settings* settings) { }
 void min_over_ranks(Settings* settings, double* a) { }
 void barrier() { }
 void abort_comms() 
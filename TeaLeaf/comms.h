@@ -12,6 +12,8 @@ void abort_comms(); void finalise_comms();
 void initialise_comms(int argc, char** argv);
 void initialise_ranks(Settings* settings);
 void sum_over_ranks(Settings* settings, double* a);
+void sum_over_ranks_begin(Settings* settings, double* a, int n);
+void sum_over_ranks_end(Settings* settings);
 void min_over_ranks(Settings* settings, double* a);
 void wait_for_requests(
         Settings* settings, int num_requests, MPI_Request* requests);
@@ -27,6 +29,8 @@ void finalise_comms();
 void initialise_comms(int argc, char** argv);
 void initialise_ranks(Settings* settings);
 void sum_over_ranks(Settings* settings, double* a);
+void sum_over_ranks_begin(Settings* settings, double* a, int n);
+void sum_over_ranks_end(Settings* settings);
 void min_over_ranks(Settings* settings, double* a);
 
 #endif 
@@ -15,6 +15,11 @@ void diffuse(Chunk* chunks, Settings* settings)
     solve(chunks, settings, tt, &wallclock_prev);
   }
 
+  long huge[3];
+  huge_pages(huge);
+  print_and_log(settings, "Huge pages: \t\t%ld of %ld (%ld reserved)\n",
+      huge[0], huge[1], huge[2]);
+
   field_summary_driver(chunks, settings, true);
 
 }
@@ -58,6 +63,12 @@ void solve(Chunk* chunks, Settings* settings, int tt, double* wallclock_prev)
     case PPCG_SOLVER:
       ppcg_driver(chunks, settings, rx, ry, &error);
       break;
+    case PIPECG_SOLVER:
+      pipecg_driver(chunks, settings, rx, ry, &error);
+      break;
+    case SSTEP_CG_SOLVER:
+      sstep_cg_driver(chunks, settings, rx, ry, &error);
+      break;
   }
 
   // Perform solve finalisation tasks
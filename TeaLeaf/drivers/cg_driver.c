@@ -14,17 +14,53 @@ void cg_driver(
   // Perform CG initialisation
   cg_init_driver(chunks, settings, rx, ry, &rro);
 
-  // Iterate till convergence
+  if(settings->cg_check_frequency > 0)
+  {
+    tt = cg_device_driver(chunks, settings, rro, error);
+  }
+  else
+  {
+    // Iterate till convergence
+    for(tt = 0; tt < settings->max_iters; ++tt)
+    {
+      cg_main_step_driver(chunks, settings, tt, &rro, error);
+
+      halo_update_driver(chunks, settings, 1);
+
+      if(std::sqrt(std::fabs(*error)) < settings->eps) break;
+    }
+  }
+
+  print_and_log(settings, "CG: \t\t\t%d iterations\n", tt);
+}
+
+// Iterates with alpha, beta, rro and rrn left on the device, reading rrn
+// back to test for convergence every cg_check_frequency iterations, so a
+// solve may run up to that many iterations past convergence
+int cg_device_driver(
+    Chunk* chunks, Settings* settings, double rro, double* error)
+{
+  int tt;
+  int num_read = 0;
+
+  run_cg_device_init(&(chunks[0]), settings, rro);
+
   for(tt = 0; tt < settings->max_iters; ++tt)
   {
-    cg_main_step_driver(chunks, settings, tt, &rro, error);
+    run_cg_device_main_step(&(chunks[0]), settings, tt);
 
     halo_update_driver(chunks, settings, 1);
 
+    if((tt+1) % settings->cg_check_frequency && tt+1 < settings->max_iters)
+      continue;
+
+    run_cg_device_read(&(chunks[0]), settings, num_read, tt+1, error);
+    num_read = tt+1;
+
     if(std::sqrt(std::fabs(*error)) < settings->eps) break;
   }
 
-  print_and_log(settings, "CG: \t\t\t%d iterations\n", tt);
+  return tt;
 }
 
 // Invokes the CG initialisation kernels
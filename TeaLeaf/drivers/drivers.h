@@ -28,6 +28,29 @@ void cg_init_driver(
 void cg_main_step_driver(
         Chunk* chunks, Settings* settings, int tt, 
         double* rro, double* error);
+int cg_device_driver(
+        Chunk* chunks, Settings* settings, double rro, double* error);
+
+// Pipelined CG solver drivers
+void pipecg_driver(
+        Chunk* chunks, Settings* settings,
+        double rx, double ry, double* error);
+void pipecg_init_driver(
+        Chunk* chunks, Settings* settings, double* dots);
+void pipecg_main_step_driver(
+        Chunk* chunks, Settings* settings, int tt,
+        double* rro, double* alpha, double* rmax, double* dots,
+        double* error);
+
+// S-step CG solver drivers
+void sstep_cg_driver(
+        Chunk* chunks, Settings* settings,
+        double rx, double ry, double* error);
+void sstep_cg_init_driver(
+        Chunk* chunks, Settings* settings, double rx, double ry);
+bool sstep_cg_main_step_driver(
+        Chunk* chunks, Settings* settings, int steps, int* tt,
+        double* sigma, double* rmax, double* error);
 
 // Chebyshev solver drivers
 void cheby_driver(
@@ -0,0 +1,164 @@
+#include <float.h>
+#include "../comms.h"
+#include "drivers.h"
+#include "../kernel_interface.h"
+#include "../chunk.h"
+
+void pipecg_calc_q_driver(Chunk* chunks, Settings* settings, double* dots);
+void pipecg_replace_driver(Chunk* chunks, Settings* settings, double* dots);
+
+// Performs a full solve with the pipelined CG solver of Ghysels and
+// Vanroose, which makes one global sum per iteration, of (r,r) and (w,r)
+// together, and overlaps it with the halo exchange and matvec after it
+void pipecg_driver(
+    Chunk* chunks, Settings* settings,
+    double rx, double ry, double* error)
+{
+  int tt;
+  double rro = 0.0;
+  double alpha = 0.0;
+  double rmax = 0.0;
+  double dots[2];
+
+  // Perform CG initialisation
+  cg_init_driver(chunks, settings, rx, ry, &rro);
+
+  pipecg_init_driver(chunks, settings, dots);
+
+  // Iterate till convergence
+  for(tt = 0; tt < settings->max_iters; ++tt)
+  {
+    pipecg_main_step_driver(
+        chunks, settings, tt, &rro, &alpha, &rmax, dots, error);
+
+    if(std::sqrt(std::fabs(*error)) < settings->eps) break;
+  }
+
+  // Only w has had its halo exchanged while iterating
+  reset_fields_to_exchange(settings);
+  settings->fields_to_exchange[FIELD_U] = true;
+  halo_update_driver(chunks, settings, 1);
+
+  print_and_log(settings, "PipeCG: \t\t%d iterations\n", tt);
+}
+
+// Invokes the pipelined CG initialisation kernels, after the CG ones
+void pipecg_init_driver(Chunk* chunks, Settings* settings, double* dots)
+{
+  // w = Ar and z = As need the halos of r and s
+  reset_fields_to_exchange(settings);
+  settings->fields_to_exchange[FIELD_R] = true;
+  settings->fields_to_exchange[FIELD_W] = true;
+  halo_update_driver(chunks, settings, 1);
+
+  dots[0] = 0.0;
+  dots[1] = 0.0;
+
+  for(int cc = 0; cc < settings->num_chunks_per_rank; ++cc)
+  {
+    if(settings->kernel_language == C)
+    {
+      run_pipecg_init(&(chunks[cc]), settings, &dots[0], &dots[1]);
+    }
+    else if(settings->kernel_language == FORTRAN)
+    {
+    }
+  }
+
+  pipecg_calc_q_driver(chunks, settings, dots);
+}
+
+// Invokes the main pipelined CG solve kernels
+void pipecg_main_step_driver(
+    Chunk* chunks, Settings* settings, int tt,
+    double* rro, double* alpha, double* rmax, double* dots, double* error)
+{
+  // dots holds (r,r) and (w,r), rro and alpha are those of the last step,
+  // and rmax the largest |r| since r was last replaced
+  const double rr = dots[0];
+  const double wr = dots[1];
+  const double beta = (tt > 0) ? rr / *rro : 0.0;
+  *alpha = (tt > 0) ? rr / (wr - beta*rr / *alpha) : rr / wr;
+  *rro = rr;
+
+  dots[0] = 0.0;
+  dots[1] = 0.0;
+
+  for(int cc = 0; cc < settings->num_chunks_per_rank; ++cc)
+  {
+    if(settings->kernel_language == C)
+    {
+      run_pipecg_calc_update(
+          &(chunks[cc]), settings, *alpha, beta, &dots[0], &dots[1]);
+    }
+    else if(settings->kernel_language == FORTRAN)
+    {
+    }
+  }
+
+  pipecg_calc_q_driver(chunks, settings, dots);
+
+  // The recurrences drift from u0-Au by rounding errors in proportion to
+  // the largest |r| they have carried, so until it has converged r is
+  // replaced once it falls by sqrt(DBL_EPSILON) from that, after van der
+  // Vorst and Ye
+  const double rnorm = std::sqrt(std::fabs(dots[0]));
+  *rmax = std::fmax(*rmax, rnorm);
+  if(rnorm >= settings->eps && rnorm < std::sqrt(DBL_EPSILON) * *rmax)
+  {
+    pipecg_replace_driver(chunks, settings, dots);
+    *rmax = std::sqrt(std::fabs(dots[0]));
+  }
+
+  *error = dots[0];
+}
+
+// Replaces the r, w, s and z of the recurrences with u0-Au, Ar, Ap and As,
+// which the rounding errors of the recurrences otherwise drift away from
+void pipecg_replace_driver(Chunk* chunks, Settings* settings, double* dots)
+{
+  reset_fields_to_exchange(settings);
+  settings->fields_to_exchange[FIELD_U] = true;
+  settings->fields_to_exchange[FIELD_P] = true;
+  halo_update_driver(chunks, settings, 1);
+
+  double pw = 0.0;
+
+  for(int cc = 0; cc < settings->num_chunks_per_rank; ++cc)
+  {
+    if(settings->kernel_language == C)
+    {
+      run_calculate_residual(&(chunks[cc]), settings);
+      run_cg_calc_w(&(chunks[cc]), settings, &pw);
+    }
+    else if(settings->kernel_language == FORTRAN)
+    {
+    }
+  }
+
+  pipecg_init_driver(chunks, settings, dots);
+}
+
+// Sums (r,r) and (w,r) over the ranks while the halo of w is exchanged
+// and q = Aw is calculated
+void pipecg_calc_q_driver(Chunk* chunks, Settings* settings, double* dots)
+{
+  sum_over_ranks_begin(settings, dots, 2);
+
+  reset_fields_to_exchange(settings);
+  settings->fields_to_exchange[FIELD_SD] = true;
+  halo_update_driver(chunks, settings, 1);
+
+  for(int cc = 0; cc < settings->num_chunks_per_rank; ++cc)
+  {
+    if(settings->kernel_language == C)
+    {
+      run_pipecg_calc_q(&(chunks[cc]), settings);
+    }
+    else if(settings->kernel_language == FORTRAN)
+    {
+    }
+  }
+
+  sum_over_ranks_end(settings);
+}
@@ -163,6 +163,12 @@ int invoke_pack_or_unpack(
             case FIELD_SD:
                 field = chunk->sd;
                 break;
+            case FIELD_R:
+                field = chunk->r;
+                break;
+            case FIELD_W:
+                field = chunk->w;
+                break;
             default:
                 die(__LINE__,__FILE__, "Incorrect field provided: %d.\n", ii+1);
         }
@@ -0,0 +1,244 @@
+#include <float.h>
+#include "../comms.h"
+#include "drivers.h"
+#include "../kernel_interface.h"
+#include "../chunk.h"
+
+// The most vectors in the basis, and values in its Gram matrix
+#define SSTEP_CG_MAX_BASIS (2*SSTEP_CG_MAX_STEPS+1)
+#define SSTEP_CG_MAX_GRAM (SSTEP_CG_MAX_BASIS*(SSTEP_CG_MAX_STEPS+1))
+
+void sstep_cg_replace_driver(Chunk* chunks, Settings* settings);
+
+// Performs a full solve with the s-step CG solver, which takes s steps of
+// CG for each global sum, from the basis p, Ap, ..., A^s p, r, ..., A^(s-1) r
+// calculated with halos s deep
+void sstep_cg_driver(
+    Chunk* chunks, Settings* settings,
+    double rx, double ry, double* error)
+{
+  // Picked with -solver, the solver has the halo of the other solvers
+  const int steps = MIN(settings->sstep_cg_steps, settings->halo_depth);
+  int tt = 0;
+  double rro = 0.0;
+  double sigma = 1.0;
+  double rmax = 0.0;
+
+  // Perform CG initialisation
+  cg_init_driver(chunks, settings, rx, ry, &rro);
+
+  sstep_cg_init_driver(chunks, settings, rx, ry);
+
+  // Iterate till convergence
+  while(tt < settings->max_iters &&
+      !sstep_cg_main_step_driver(
+        chunks, settings, steps, &tt, &sigma, &rmax, error));
+
+  // Only p and r have had their halos exchanged while iterating
+  reset_fields_to_exchange(settings);
+  settings->fields_to_exchange[FIELD_U] = true;
+  halo_update_driver(chunks, settings, 1);
+
+  print_and_log(settings, "SStepCG: \t\t%d iterations (%d steps per sum)\n",
+      tt, steps);
+}
+
+// Invokes the s-step CG initialisation kernels, after the CG ones
+void sstep_cg_init_driver(
+    Chunk* chunks, Settings* settings, double rx, double ry)
+{
+  // The matrix powers need kx and ky through the whole halo
+  reset_fields_to_exchange(settings);
+  settings->fields_to_exchange[FIELD_DENSITY] = true;
+  halo_update_driver(chunks, settings, settings->halo_depth);
+
+  for(int cc = 0; cc < settings->num_chunks_per_rank; ++cc)
+  {
+    if(settings->kernel_language == C)
+    {
+      run_sstep_init(&(chunks[cc]), settings, rx, ry);
+    }
+    else if(settings->kernel_language == FORTRAN)
+    {
+    }
+  }
+}
+
+// Invokes the s-step CG kernels for up to steps iterations, counted in tt,
+// and returns whether the solve has converged
+bool sstep_cg_main_step_driver(
+    Chunk* chunks, Settings* settings, int steps, int* tt,
+    double* sigma, double* rmax, double* error)
+{
+  const int nbasis = 2*steps + 1;
+  const int ngram = nbasis*(steps+1);
+
+  // The matrix powers of p and r for the steps need halos as deep
+  reset_fields_to_exchange(settings);
+  settings->fields_to_exchange[FIELD_P] = true;
+  settings->fields_to_exchange[FIELD_R] = true;
+  halo_update_driver(chunks, settings, steps);
+
+  double packed[SSTEP_CG_MAX_GRAM] = { 0.0 };
+
+  for(int cc = 0; cc < settings->num_chunks_per_rank; ++cc)
+  {
+    if(settings->kernel_language == C)
+    {
+      run_sstep_calc_basis(&(chunks[cc]), settings, steps, *sigma, packed);
+    }
+    else if(settings->kernel_language == FORTRAN)
+    {
+    }
+  }
+
+  // The only global sum of the steps
+  sum_over_ranks_begin(settings, packed, ngram);
+  sum_over_ranks_end(settings);
+
+  double gram[SSTEP_CG_MAX_BASIS][SSTEP_CG_MAX_BASIS];
+  for(int ii = 0, gg = 0; ii < nbasis; ++ii)
+  {
+    for(int jj = ii; jj < nbasis; ++jj, ++gg)
+    {
+      gram[ii][jj] = packed[gg];
+      gram[jj][ii] = packed[gg];
+    }
+  }
+
+  // A applied to the basis is the basis shifted by one in p's powers and
+  // in r's, times sigma, which keeps the next basis scaled as p is
+  const double shift = *sigma;
+  if(gram[0][0] > 0.0)
+  {
+    *sigma *= std::sqrt(gram[1][1] / gram[0][0]);
+  }
+
+  // The coordinates of p, r and the change in u in the basis
+  double cp[SSTEP_CG_MAX_BASIS] = { 0.0 };
+  double cr[SSTEP_CG_MAX_BASIS] = { 0.0 };
+  double cu[SSTEP_CG_MAX_BASIS] = { 0.0 };
+  cp[0] = 1.0;
+  cr[steps+1] = 1.0;
+
+  double rro = gram[steps+1][steps+1];
+  *rmax = std::fmax(*rmax, std::sqrt(rro));
+
+  bool converged = false;
+
+  for(int ss = 0; ss < steps && *tt < settings->max_iters; ++ss)
+  {
+    double cw[SSTEP_CG_MAX_BASIS] = { 0.0 };
+    for(int ii = 0; ii < steps; ++ii)
+    {
+      cw[ii+1] = shift*cp[ii];
+    }
+    for(int ii = steps+1; ii < nbasis-1; ++ii)
+    {
+      cw[ii+1] = shift*cp[ii];
+    }
+
+    double pw = 0.0;
+    for(int ii = 0; ii < nbasis; ++ii)
+    {
+      for(int jj = 0; jj < nbasis; ++jj)
+      {
+        pw += cp[ii]*gram[ii][jj]*cw[jj];
+      }
+    }
+
+    const double alpha = rro / pw;
+
+    double cr_new[SSTEP_CG_MAX_BASIS];
+    for(int ii = 0; ii < nbasis; ++ii)
+    {
+      cr_new[ii] = cr[ii] - alpha*cw[ii];
+    }
+
+    double rrn = 0.0;
+    for(int ii = 0; ii < nbasis; ++ii)
+    {
+      for(int jj = 0; jj < nbasis; ++jj)
+      {
+        rrn += cr_new[ii]*gram[ii][jj]*cr_new[jj];
+      }
+    }
+
+    // The basis is too close to singular for the rest of the steps, which
+    // are left to the next basis
+    if(!(pw > 0.0) || !(rrn >= 0.0))
+    {
+      if(ss == 0)
+      {
+        die(__LINE__, __FILE__,
+            "s-step CG broke down, try fewer sstep_cg_steps.\n");
+      }
+      break;
+    }
+
+    const double beta = rrn / rro;
+
+    for(int ii = 0; ii < nbasis; ++ii)
+    {
+      cu[ii] += alpha*cp[ii];
+      cr[ii] = cr_new[ii];
+      cp[ii] = cr[ii] + beta*cp[ii];
+    }
+
+    rro = rrn;
+    *error = rrn;
+
+    if(std::sqrt(std::fabs(rrn)) < settings->eps)
+    {
+      converged = true;
+      break;
+    }
+
+    ++(*tt);
+  }
+
+  for(int cc = 0; cc < settings->num_chunks_per_rank; ++cc)
+  {
+    if(settings->kernel_language == C)
+    {
+      run_sstep_calc_update(&(chunks[cc]), settings, steps, cu, cr, cp);
+    }
+    else if(settings->kernel_language == FORTRAN)
+    {
+    }
+  }
+
+  // The recurrences drift from u0-Au by rounding errors in proportion to
+  // the largest |r| they have carried, so r is replaced once it has fallen
+  // by sqrt(DBL_EPSILON) from that. Within 1/sqrt(DBL_EPSILON) of eps the
+  // drift no longer matters, and u0-Au, mostly rounding error by then, would
+  // only spoil the conjugacy of r and p, so r is left as it is
+  const double rnorm = std::sqrt(std::fabs(rro));
+  if(!converged && rnorm < std::sqrt(DBL_EPSILON) * *rmax &&
+      rnorm > settings->eps / std::sqrt(DBL_EPSILON))
+  {
+    sstep_cg_replace_driver(chunks, settings);
+    *rmax = 0.0;
+  }
+
+  return converged;
+}
+
+// Replaces the r of the recurrences with u0-Au
+void sstep_cg_replace_driver(Chunk* chunks, Settings* settings)
+{
+  reset_fields_to_exchange(settings);
+  settings->fields_to_exchange[FIELD_U] = true;
+  halo_update_driver(chunks, settings, 1);
+
+  for(int cc = 0; cc < settings->num_chunks_per_rank; ++cc)
+  {
+    if(settings->kernel_language == C)
+    {
+      run_calculate_residual(&(chunks[cc]), settings);
+    }
+    else if(settings->kernel_language == FORTRAN)
+    {
+    }
+  }
+}
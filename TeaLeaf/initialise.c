@@ -13,9 +13,34 @@ void initialise_application(Chunk** chunks, Settings* settings)
   State* states = NULL;
   read_config(settings, &states);
 
+  if(settings->sstep_cg_steps < 1 ||
+      settings->sstep_cg_steps > SSTEP_CG_MAX_STEPS)
+  {
+    die(__LINE__, __FILE__,
+        "sstep_cg_steps must be between 1 and %d.\n", SSTEP_CG_MAX_STEPS);
+  }
+
+  // The s-step CG solver computes its s matrix powers from halos s deep
+  if(settings->solver == SSTEP_CG_SOLVER &&
+      settings->halo_depth < settings->sstep_cg_steps)
+  {
+    print_and_log(settings, "halo_depth is raised to %d for s-step CG\n",
+        settings->sstep_cg_steps);
+    settings->halo_depth = settings->sstep_cg_steps;
+  }
+
   *chunks = (Chunk*)malloc(sizeof(Chunk)*settings->num_chunks_per_rank);
 
   decompose_field(settings, *chunks);
+
+  // The CG scalars can only stay on the device when no sum spans chunks
+  if(settings->cg_check_frequency > 0 && settings->num_chunks > 1)
+  {
+    print_and_log(settings,
+        "cg_check_frequency is ignored with more than one chunk\n");
+    settings->cg_check_frequency = 0;
+  }
+
   kernel_initialise_driver(*chunks, settings);
   set_chunk_data_driver(*chunks, settings);
   set_chunk_state_driver(*chunks, settings, states);
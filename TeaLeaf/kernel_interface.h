@@ -42,6 +42,33 @@ void run_cg_calc_ur(
 void run_cg_calc_p(
         Chunk* chunk, Settings* settings, double beta);
 
+// CG solver kernels keeping alpha, beta, rro and rrn on the device
+void run_cg_device_init(
+        Chunk* chunk, Settings* settings, double rro);
+void run_cg_device_main_step(
+        Chunk* chunk, Settings* settings, int tt);
+void run_cg_device_read(
+        Chunk* chunk, Settings* settings, int first, int last, double* rrn);
+
+// Pipelined CG solver kernels
+void run_pipecg_init(
+        Chunk* chunk, Settings* settings, double* rr, double* wr);
+void run_pipecg_calc_q(
+        Chunk* chunk, Settings* settings);
+void run_pipecg_calc_update(
+        Chunk* chunk, Settings* settings, double alpha, double beta,
+        double* rr, double* wr);
+
+// S-step CG solver kernels
+void run_sstep_init(
+        Chunk* chunk, Settings* settings, double rx, double ry);
+void run_sstep_calc_basis(
+        Chunk* chunk, Settings* settings, int steps, double sigma,
+        double* gram);
+void run_sstep_calc_update(
+        Chunk* chunk, Settings* settings, int steps, double* cu, double* cr,
+        double* cp);
+
 // Chebyshev solver kernels
 void run_cheby_init(
         Chunk* chunk, Settings* settings);
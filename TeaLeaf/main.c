@@ -72,6 +72,8 @@ void settings_overload(Settings* settings, int argc, char** argv)
       if(strmatch(argv[aa+1], "cheby")) settings->solver = CHEBY_SOLVER;
       if(strmatch(argv[aa+1], "ppcg")) settings->solver = PPCG_SOLVER;
       if(strmatch(argv[aa+1], "jacobi")) settings->solver = JACOBI_SOLVER;
+      if(strmatch(argv[aa+1], "pipecg")) settings->solver = PIPECG_SOLVER;
+      if(strmatch(argv[aa+1], "sstep")) settings->solver = SSTEP_CG_SOLVER;
     }
     else if(strmatch(argv[aa], "-x"))
     {
@@ -91,7 +93,7 @@ void settings_overload(Settings* settings, int argc, char** argv)
       print_and_log(settings, "options:\n");
       print_and_log(settings, "\t-solver, --solver, -s:\n");
       print_and_log(settings, 
-          "\t\tCan be 'cg', 'cheby', 'ppcg', or 'jacobi'\n");
+          "\t\tCan be 'cg', 'cheby', 'ppcg', 'pipecg', 'sstep', or 'jacobi'\n");
       finalise_comms();
       exit(0);
     } 
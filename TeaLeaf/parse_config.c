@@ -55,6 +55,10 @@ void read_config(Settings* settings, State** states)
       "\tnum_chunks_per_rank = %d\n", settings->num_chunks_per_rank);
   print_to_log(settings,
       "\tsummary_frequency = %d\n", settings->summary_frequency);
+  print_to_log(settings,
+      "\tcg_check_frequency = %d\n", settings->cg_check_frequency);
+  print_to_log(settings,
+      "\tsstep_cg_steps = %d\n", settings->sstep_cg_steps);
 
   for(int ss = 0; ss < settings->num_states; ++ss)
   {
@@ -121,6 +125,10 @@ void read_settings(FILE* tea_in, Settings* settings)
       continue;
     if(starts_get_int("halo_depth", line, word, &settings->halo_depth))
       continue;
+    if(starts_get_int("cg_check_frequency", line, word, &settings->cg_check_frequency))
+      continue;
+    if(starts_get_int("sstep_cg_steps", line, word, &settings->sstep_cg_steps))
+      continue;
 
     // Parse the switches
     if(starts_with("check_result", line))
@@ -138,6 +146,11 @@ void read_settings(FILE* tea_in, Settings* settings)
       settings->preconditioner = true;
       continue;
     }
+    if(starts_with("use_hugetlb", line))
+    {
+      settings->hugetlb = true;
+      continue;
+    }
     if(starts_with("use_fortran_kernels", line))
     {
       settings->kernel_language = FORTRAN;
@@ -160,6 +173,18 @@ void read_settings(FILE* tea_in, Settings* settings)
       strcpy(settings->solver_name, "CG");
       continue;
     }
+    if(starts_with("use_pipecg", line))
+    {
+      settings->solver = PIPECG_SOLVER;
+      strcpy(settings->solver_name, "PipeCG");
+      continue;
+    }
+    if(starts_with("use_sstep_cg", line))
+    {
+      settings->solver = SSTEP_CG_SOLVER;
+      strcpy(settings->solver_name, "SStepCG");
+      continue;
+    }
     if(starts_with("use_chebyshev", line))
     {
       settings->solver = CHEBY_SOLVER;
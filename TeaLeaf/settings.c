@@ -47,6 +47,9 @@ void set_default_settings(Settings* settings)
   settings->num_ranks = DEF_NUM_RANKS;
   settings->halo_depth = DEF_HALO_DEPTH;
   settings->is_offload = DEF_IS_OFFLOAD;
+  settings->hugetlb = DEF_HUGETLB;
+  settings->cg_check_frequency = DEF_CG_CHECK_FREQUENCY;
+  settings->sstep_cg_steps = DEF_SSTEP_CG_STEPS;
   settings->kernel_language = DEF_KERNEL_LANGUAGE;
   settings->kernel_profile =
     (struct Profile*)malloc(sizeof(struct Profile));
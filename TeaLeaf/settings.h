@@ -6,7 +6,7 @@
 #define __STDC_LIMIT_MACROS
 #include <stdint.h>
 
-#define NUM_FIELDS 6
+#define NUM_FIELDS 8
 
 // Default settings
 #define DEF_TEA_IN_FILENAME "tea.in"
@@ -43,6 +43,13 @@
 #define DEF_HALO_DEPTH 2
 #define DEF_RANK 0
 #define DEF_IS_OFFLOAD false
+#define DEF_HUGETLB false
+#define DEF_CG_CHECK_FREQUENCY 0
+#define DEF_SSTEP_CG_STEPS 4
+
+// The most steps the s-step CG solver takes between global sums, beyond
+// which its monomial basis is too close to singular to be of use
+#define SSTEP_CG_MAX_STEPS 5
 
 // The type of solver to be run
 typedef enum
@@ -50,7 +57,9 @@ typedef enum
     JACOBI_SOLVER,
     CG_SOLVER,
     CHEBY_SOLVER,
-    PPCG_SOLVER
+    PPCG_SOLVER,
+    PIPECG_SOLVER,
+    SSTEP_CG_SOLVER
 } Solver;
 
 // The language of the kernels to be run
@@ -84,6 +93,8 @@ typedef struct Settings
     int num_chunks;
     int num_chunks_per_rank;
     int num_ranks;
+    int cg_check_frequency;
+    int sstep_cg_steps;
     bool* fields_to_exchange;
 
     bool is_offload;
@@ -91,6 +102,7 @@ typedef struct Settings
     bool error_switch;
     bool check_result;
     bool preconditioner;
+    bool hugetlb;
 
     double eps;
     double dt_init;
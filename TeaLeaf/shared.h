@@ -22,6 +22,9 @@ void print_and_log(struct Settings* settings, const char* format, ...);
 void plot_2d(int x, int y, double* buffer, const char* name);
 void die(int lineNum, const char* file, const char* format, ...);
 
+// Maps host arrays on 2 MB aligned huge pages, with the Lattice Boltzmann code
+#include "../Common/huge.h"
+
 // Write out data for visualisation in visit
 void write_to_visit(
     const int nx, const int ny, const int x_off, const int y_off,
@@ -43,10 +46,13 @@ void write_to_visit(
 #define FIELD_U 3
 #define FIELD_P 4
 #define FIELD_SD 5
+#define FIELD_R 6
+#define FIELD_W 7
 
 #define CONDUCTIVITY 1
 #define RECIP_CONDUCTIVITY 2
 
+
 #define CG_ITERS_FOR_EIGENVALUES 20
 #define ERROR_SWITCH_MAX 1.0
 